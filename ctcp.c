@@ -13,10 +13,35 @@
 
 #include "ctcp.h"
 #include "ctcp_linked_list.h"
+#include "ctcp_stats.h"
+#include "ctcp_trace.h"
 #include "ctcp_utils.h"
 
 #define DEBUG 0
 
+/* Retransmissions of a segment before the other end is taken to be gone. */
+#define MAX_RETRANSMITS 5
+
+/* Retransmission timeouts to stay in TIME_WAIT for. If our ACK of the other
+   end's FIN is lost, it sends the FIN again every timeout up to
+   MAX_RETRANSMITS times, so stay long enough to ACK each one. */
+#define TIME_WAIT_RTOS (MAX_RETRANSMITS + 1)
+
+/*
+ * Where a connection is in closing, as in TCP. Each direction closes on its
+ * own: data is still received after our FIN, and still sent after theirs.
+ */
+typedef enum {
+    ESTABLISHED,   // neither side has sent a FIN
+    FIN_WAIT_1,    // our FIN is sent but not ACK'd
+    FIN_WAIT_2,    // our FIN is ACK'd, waiting for theirs
+    CLOSING,       // both FINs sent, ours not ACK'd yet
+    TIME_WAIT,     // both FINs ACK'd, theirs came last; ACK it again if it
+                   // comes back, until the timer tears down the connection
+    CLOSE_WAIT,    // their FIN received, we're still sending
+    LAST_ACK       // their FIN received, ours sent but not ACK'd
+} tcp_state_t;
+
 
 /**
  * Connection state.
@@ -47,9 +72,10 @@ struct ctcp_state {
     long timeSent;
     uint8_t retransCount;
 
-    uint8_t finSent;
-    uint8_t finSentAcked;
-    uint8_t finRecv;
+    tcp_state_t tcpState;
+    long timeWaitStart;
+
+    uint8_t stalled;
 
     int inputSize;
 
@@ -149,7 +175,7 @@ ctcp_segment_t *make_segment(ctcp_state_t *state, char *buf, uint32_t flags)
     segment->flags = 0;
     segment->flags |= flags;
 
-    segment->window = MAX_SEG_DATA_SIZE;
+    segment->window = conn_mss(state->conn);
     segment->cksum = 0;
 
     // convert everything to network byte order
@@ -251,7 +277,10 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg)
 
     state->cfg = cfg;
 
-    state->output_data = calloc(MAX_SEG_DATA_SIZE, sizeof(char));
+    state->output_data = calloc(conn_mss(conn), sizeof(char));
+
+    // stop-and-wait: one segment in flight at a time
+    stats_set(conn_stats(conn), STAT_CWND, conn_mss(conn));
 
     return state;
 }
@@ -286,15 +315,15 @@ void ctcp_destroy(ctcp_state_t *state)
 */
 void ctcp_read(ctcp_state_t *state)
 {
-    if (state->finSent) {
+    if (state->tcpState != ESTABLISHED && state->tcpState != CLOSE_WAIT) {
         // if a FIN has been sent, we don't accept input anymore
         return;
     } else if (state->sent == NULL) {
         // otherwise, if no segment is waiting to be ACK'd, we read from STDIN.
         // allocate the input buffer
         char *buf;
-        buf = calloc(sizeof(char), MAX_SEG_DATA_SIZE);
-        size_t len = MAX_SEG_DATA_SIZE;
+        size_t len = conn_mss(state->conn);
+        buf = calloc(sizeof(char), len);
 
         // read the input
         int ret = 0;
@@ -307,21 +336,25 @@ void ctcp_read(ctcp_state_t *state)
 
         if (ret == -1) // EOF found
         {
-            // send EOF to output in ctcp_output
+            // send our FIN. Our output stays open until their FIN arrives.
             fprintf(stderr, "EOF\n");
-            conn_output(state->conn, NULL, 0);
-
-            // send our FIN
+            state->inputSize = 0;
             ctcp_segment_t *finSeg = make_segment(state, NULL, FIN | ACK);
             ctcp_send(state, finSeg);
-            state->finSent = 1;
+            state->tcpState = state->tcpState == ESTABLISHED ? FIN_WAIT_1
+                                                             : LAST_ACK;
         } else if (ret > 0) {
             // otherwise we send the inputted data
             ctcp_segment_t *segment = make_segment(state, buf, ACK);
             ctcp_send(state, segment);
+            state->stalled = 0;
         }
 
         free(buf);
+    } else if (!state->stalled) {
+        // input has to wait for the segment in flight to be ACK'd
+        stats_add(conn_stats(state->conn), STAT_WINDOW_STALLS, 1);
+        state->stalled = 1;
     }
 }
 
@@ -334,6 +367,9 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
 
     // use the segment's checksum to verify the packet.
     if (!verify_cksum(segment)) {
+        CTCP_TRACE(cksum_fail, state->conn, ntohl(segment->seqno),
+                   ntohs(segment->len));
+
         #if DEBUG
         fprintf(stderr, "corrupted segment\n");
         fprintf(stderr, "---\n");
@@ -346,60 +382,30 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
     // convert fields to host byte order
     convert_to_host_order(segment);
 
-    // ----------------- shutdown process --------------------------------------
-    // if we receive an ACK and we sent a FIN.
-    if ((segment->flags & ACK) && state->finSent == 1) {
-        // ensure the ACK we just got is ACKing the FIN
-        if (segment->ackno == state->seqno + 1) 
-        {
-            // mark our FIN as having been ACK'd and update the sequence number
-            state->finSentAcked = 1;
-            state->seqno = segment->ackno;
-
-            // free the sent segment and reset the retransmission counter.
-            state_list->timeSent = 0;
-            free(state->sent);
-            state->sent = NULL;
-            state->retransCount = 0;
-
-            // if we already received a FIN before sending one 
-            // and having it ACKd, teardown
-            if (state->finRecv) {
-                #if DEBUG
-                fprintf(stderr, "\n--- recv end\n\n");
-                #endif
-
-                free(segment);
-                ctcp_destroy(state);
-
-                // exit the function in case the program's running as the server
-                // in which case ctcp_destroy will not exit the program
-                return;
-            }
-        }
-    }
-
-    // if we receive a FIN
-    if ((segment->flags & FIN)) {
-        if (state->finRecv == 0) {
-            // increase the ackno if we haven't yet received a FIN.
-            state->ackno += 1;
-        }
-        state->finRecv = 1;
-
-        // ACK the received FIN.
-        ctcp_segment_t *ackSeg = make_segment(state, NULL, ACK);
-        conn_send(state->conn, ackSeg, sizeof(ctcp_segment_t));
-
-        #if DEBUG
-        print_hdr_ctcp(ackSeg);
-        #endif
-
-        free(ackSeg);
+    // ------------------- ACK of our FIN --------------------------------------
+    int finInFlight = state->tcpState == FIN_WAIT_1 ||
+                      state->tcpState == CLOSING ||
+                      state->tcpState == LAST_ACK;
+    if ((segment->flags & ACK) && finInFlight &&
+        segment->ackno == state->seqno + 1)
+    {
+        // mark our FIN as having been ACK'd and update the sequence number
+        state->seqno = segment->ackno;
 
-        // if we receive a FIN and have already sent a FIN and had it ACKd
-        // then exit the client.
-        if (state->finSentAcked) {
+        // free the sent segment and reset the retransmission counter.
+        state->timeSent = 0;
+        free(state->sent);
+        state->sent = NULL;
+        state->retransCount = 0;
+
+        if (state->tcpState == FIN_WAIT_1) {
+            state->tcpState = FIN_WAIT_2;
+        } else if (state->tcpState == CLOSING) {
+            state->tcpState = TIME_WAIT;
+            state->timeWaitStart = current_time();
+        } else {
+            // LAST_ACK: both directions are done, and the other end closed
+            // first, so it is the one to wait.
             #if DEBUG
             fprintf(stderr, "\n--- recv end\n\n");
             #endif
@@ -412,11 +418,9 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
             return;
         }
     }
-    // -------------------- END shutdown process -------------------------------
 
-
-    // If the ACK flag is turned on
-    if (segment->flags & ACK) {
+    // ------------------- ACK of our data -------------------------------------
+    else if ((segment->flags & ACK) && state->sent != NULL && !finInFlight) {
         int dataLen = state->inputSize;
 
         #if DEBUG
@@ -428,9 +432,11 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
         // sent segment.
         if (state->seqno + dataLen == segment->ackno) {
             state->seqno = segment->ackno;
+            CTCP_TRACE(window_update, state->conn, segment->ackno,
+                       segment->window);
 
             free(state->sent);
-            state_list->timeSent = 0;
+            state->timeSent = 0;
             state->sent = NULL;
             state->retransCount = 0;
 
@@ -440,9 +446,11 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
         }
     }
 
+    // ------------------- Data, in any state until their FIN ------------------
     // get the data size and the available space for outputting
     size_t received_data_len = segment->len - sizeof(ctcp_segment_t);
     size_t available_space = conn_bufspace(state->conn);
+    int sendAck = 0;
 
     // only ACK the segment and output if there is enough space, and if 
     // there is enough data
@@ -459,7 +467,39 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
             #endif
         }
 
-        // construct and send an ACK segment - only if we receive data.
+        // ACK the segment - only if we receive data.
+        sendAck = 1;
+    }
+
+    // ------------------- Their FIN -------------------------------------------
+    // A FIN that comes after all their data closes their direction: output an
+    // EOF. One we've already taken (our ACK was lost) is just ACK'd again.
+    if (segment->flags & FIN) {
+        int finRecv = state->tcpState == CLOSE_WAIT ||
+                      state->tcpState == LAST_ACK ||
+                      state->tcpState == CLOSING ||
+                      state->tcpState == TIME_WAIT;
+        if (!finRecv && segment->seqno + received_data_len == state->ackno) {
+            state->ackno += 1;
+            conn_output(state->conn, NULL, 0);
+
+            if (state->tcpState == ESTABLISHED) {
+                state->tcpState = CLOSE_WAIT;
+            } else if (state->tcpState == FIN_WAIT_1) {
+                state->tcpState = CLOSING;
+            } else {
+                state->tcpState = TIME_WAIT;
+                state->timeWaitStart = current_time();
+            }
+        } else if (state->tcpState == TIME_WAIT) {
+            // wait again, in case this ACK is lost too
+            state->timeWaitStart = current_time();
+        }
+        sendAck = 1;
+    }
+
+    if (sendAck) {
+        // construct and send an ACK segment
         ctcp_segment_t *ack_segment = make_segment(state, NULL, ACK);
         conn_send(state->conn, ack_segment, sizeof(ctcp_segment_t));
 
@@ -482,27 +522,42 @@ void ctcp_receive(ctcp_state_t *state, ctcp_segment_t *segment, size_t len)
 void ctcp_output(ctcp_state_t *state)
 {
     // verify if there is enough space for outputting before call conn_output
+    // the library also calls this when output drains, with nothing new
     size_t space = conn_bufspace(state->conn);
-    if (space >= state->received_data_len)
+    if (state->received_data_len > 0 && space >= state->received_data_len)
     {
         conn_output(state->conn, state->output_data, state->received_data_len);
-        memset(state->output_data, 0, MAX_SEG_DATA_SIZE);
+        memset(state->output_data, 0, conn_mss(state->conn));
+        state->received_data_len = 0;
     }
 }
 
 void ctcp_timer()
 {
     ctcp_state_t *state = state_list;
+    ctcp_state_t *next;
+
+    // iterate through the list of states. Get the next state first, since
+    // this one might be destroyed.
+    for (; state != NULL; state = next) {
+        next = state->next;
+
+        // TIME_WAIT is over: their FIN hasn't come back, so our ACK of it
+        // made it.
+        if (state->tcpState == TIME_WAIT) {
+            if (current_time() - state->timeWaitStart >=
+                TIME_WAIT_RTOS * state->cfg->rt_timeout) {
+                ctcp_destroy(state);
+            }
+            continue;
+        }
 
-    // iterate through the list of states
-    while (state != NULL) {
         if (state->timeSent == 0) {
-            state = state->next;
             continue;
         } // haven't sent anything yet
 
         // teardown the connection if the retransmission limit is reached.
-        if (state->retransCount >= 5) {
+        if (state->retransCount >= MAX_RETRANSMITS) {
             ctcp_destroy(state);
         } else if ((current_time() - state->timeSent) > state->cfg->rt_timeout) {
             // otherwise check if the last sent segment has timed out.
@@ -512,11 +567,11 @@ void ctcp_timer()
 
             // retransmit the segment and increase the retransmission counter.
             ctcp_segment_t *segment = state->sent;
+            CTCP_TRACE(retransmit, state->conn, ntohl(segment->seqno),
+                       state->retransCount + 1);
             ctcp_send(state, segment);
 
             state->retransCount += 1;
         }
-
-        state = state->next;
     }
 }
@@ -25,6 +25,9 @@
  *
  * A sliding window of size n * MAX_SEG_DATA_SIZE may have more than n segments,
  * if not all the segments are of the full MAX_SEG_DATA_SIZE in size.
+ *
+ * This is the size over the network. A connection may agree on larger
+ * segments (see conn_mss()), and its windows are then in multiples of that.
  */
 #define MAX_SEG_DATA_SIZE 1440
 
@@ -97,6 +100,10 @@ ctcp_state_t *ctcp_init(conn_t *conn, ctcp_config_t *cfg);
  *      and have sent a FIN to the other side.
  *    - All sent segments (including the FIN) have been acknowledged.
  *    - All received segments have been outputted.
+ *    - If you sent your FIN before theirs arrived, TIME_WAIT has run out: a few
+ *      retransmission timeouts in which their FIN was not retransmitted, so
+ *      your ACK of it must have arrived. Run this from ctcp_timer() rather than
+ *      blocking; other connections keep going meanwhile.
  * Or:
  *    - The other side is unresponsive (after retransmitting the same segment 5
  *      times and still receiving no response).
@@ -0,0 +1,486 @@
+/******************************************************************************
+ * ctcp_analyze.c
+ * --------------
+ * Offline analysis of segment logs (-l) and packet captures (--pcap). Rebuilds
+ * each connection from the segments in the file and reports, for each
+ * direction data flowed in: goodput, RTT samples, retransmissions, spurious
+ * retransmissions and the time the sender was limited by the receiver's
+ * window. With --timeline, the same figures are also written out as CSV for
+ * every interval, to plot over time.
+ *
+ * Files are read once, front to back, and only segments still in flight are
+ * kept, so memory does not grow with the size of the file.
+ *
+ * Times are as seen by the host that wrote the file, so RTTs are only
+ * meaningful for data that host sent. A retransmission is spurious if the data
+ * had already been acknowledged when it was resent (as a receiver sees it), or
+ * if the acknowledgment came back sooner after the retransmission than the
+ * smallest RTT seen, and so must have been for the original (as a sender sees
+ * it).
+ *
+ *****************************************************************************/
+
+#include "ctcp_histogram.h"
+#include "ctcp_reader.h"
+
+/** Default length of the timeline's intervals, in ms. */
+#define DEFAULT_INTERVAL_MS 100
+
+/** Initial number of segments in flight a direction has room for. Must be a
+    power of 2. */
+#define INITIAL_FLIGHT 64
+
+/** Compares sequence numbers, allowing for wrap-around. */
+#define SEQ_LT(a, b) ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t) ((a) - (b)) <= 0)
+
+/** A segment sent and not yet acknowledged. */
+typedef struct {
+  uint32_t end;               /* Sequence number after the segment */
+  uint64_t sent_us;           /* When first sent */
+  uint64_t resent_us;         /* When last retransmitted, or 0 */
+} flight_t;
+
+/** One direction of a connection: data from src to dst, and the ACKs for it
+    from dst to src. */
+typedef struct {
+  endpoint_t src;
+  endpoint_t dst;
+  bool have_base;             /* Captures: src's initial sequence number */
+  uint32_t base;
+
+  bool started;               /* Seen data yet */
+  uint32_t snd_una;           /* Oldest unacknowledged sequence number */
+  uint32_t snd_max;           /* Highest sequence number sent */
+  uint32_t rwnd;              /* Window last advertised by dst, 0 if none */
+  flight_t *flight;           /* Segments in flight, as a ring */
+  size_t flight_head;
+  size_t flight_len;
+  size_t flight_size;
+
+  uint64_t first_us;          /* First data sent */
+  uint64_t last_us;           /* Last data acknowledged */
+  uint64_t segments;
+  uint64_t bytes;
+  uint64_t retransmits;
+  uint64_t spurious;
+  uint64_t acked;
+  histogram_t rtt;            /* In us */
+  bool limited;               /* Window-limited since limited_since */
+  uint64_t limited_since;
+  uint64_t limited_us;
+  double peak_kbps;
+
+  /* The current interval of the timeline. */
+  uint64_t iv_segments;
+  uint64_t iv_acked;
+  uint64_t iv_retransmits;
+  uint64_t iv_rtt_sum;
+  uint64_t iv_rtt_count;
+  uint64_t iv_limited_us;
+} direction_t;
+
+/** A connection. dir[0] is from whoever sent the first segment seen. */
+typedef struct connection {
+  direction_t dir[2];
+  bool closed;                /* Replaced by a new connection, as a new SYN
+                                 came from the same address and port */
+  struct connection *next;
+} connection_t;
+
+/** State for one file. */
+typedef struct {
+  const char *path;
+  connection_t *conns;
+  connection_t *last_conn;    /* For appending */
+  connection_t *cache;        /* Last one looked up */
+  bool ports_only;            /* Match segments to connections by port */
+  uint64_t packets;
+  uint64_t start_us;          /* Time of the first segment */
+  uint64_t interval_us;
+  uint64_t interval_start;    /* 0 until the first segment */
+  FILE *timeline;             /* NULL if no timeline */
+} analysis_t;
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-i interval ms]\n"
+    "   [-t timeline.csv]\n"
+    "   file...\n\n",
+    progname
+  );
+  exit(1);
+}
+
+static bool same_endpoint(endpoint_t a, endpoint_t b, bool ports_only) {
+  return (ports_only || a.ip == b.ip) && a.port == b.port;
+}
+
+static void print_endpoint(FILE *f, endpoint_t e) {
+  char ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &e.ip, ip, sizeof(ip));
+  fprintf(f, "%s:%d", ip, e.port);
+}
+
+/* Whether a segment belongs to a connection. */
+static bool matches(const connection_t *c, const packet_t *p,
+                    bool ports_only) {
+  int i;
+  for (i = 0; i < 2; i++)
+    if (same_endpoint(c->dir[i].src, p->src, ports_only) &&
+        same_endpoint(c->dir[i].dst, p->dst, ports_only))
+      return !c->closed;
+  return false;
+}
+
+/* Finds the direction a segment belongs to, creating the connection if
+   needed. */
+static direction_t *find_direction(analysis_t *a, const packet_t *p,
+                                   connection_t **rconn) {
+  connection_t *c = a->cache;
+  int i;
+  if (c == NULL || !matches(c, p, a->ports_only))
+    for (c = a->conns; c && !matches(c, p, a->ports_only); c = c->next);
+
+  if (c == NULL) {
+    c = calloc(sizeof(connection_t), 1);
+    for (i = 0; i < 2; i++) {
+      c->dir[i].src = i == 0 ? p->src : p->dst;
+      c->dir[i].dst = i == 0 ? p->dst : p->src;
+      c->dir[i].flight_size = INITIAL_FLIGHT;
+      c->dir[i].flight = malloc(INITIAL_FLIGHT * sizeof(flight_t));
+      hist_init(&c->dir[i].rtt);
+    }
+    if (a->last_conn)
+      a->last_conn->next = c;
+    else
+      a->conns = c;
+    a->last_conn = c;
+  }
+
+  a->cache = c;
+  *rconn = c;
+  return same_endpoint(c->dir[0].src, p->src, a->ports_only) ? &c->dir[0] :
+         &c->dir[1];
+}
+
+static flight_t *flight_at(direction_t *d, size_t i) {
+  return &d->flight[(d->flight_head + i) & (d->flight_size - 1)];
+}
+
+static void flight_push(direction_t *d, uint32_t end, uint64_t now) {
+  if (d->flight_len == d->flight_size) {
+    flight_t *bigger = malloc(2 * d->flight_size * sizeof(flight_t));
+    size_t i;
+    for (i = 0; i < d->flight_len; i++)
+      bigger[i] = *flight_at(d, i);
+    free(d->flight);
+    d->flight = bigger;
+    d->flight_head = 0;
+    d->flight_size *= 2;
+  }
+  flight_t *f = flight_at(d, d->flight_len++);
+  f->end = end;
+  f->sent_us = now;
+  f->resent_us = 0;
+}
+
+/* Adds the time spent window-limited up to now. */
+static void account_limited(direction_t *d, uint64_t now) {
+  if (d->limited && now > d->limited_since) {
+    d->limited_us += now - d->limited_since;
+    d->iv_limited_us += now - d->limited_since;
+  }
+  d->limited_since = now;
+}
+
+static void update_limited(direction_t *d, uint64_t now) {
+  bool limited = d->rwnd > 0 && d->snd_max - d->snd_una >= d->rwnd;
+  if (limited != d->limited) {
+    account_limited(d, now);
+    d->limited = limited;
+  }
+}
+
+/* Data sent from d->src. */
+static void on_data(direction_t *d, uint32_t seqno, uint32_t len,
+                    uint64_t now) {
+  uint32_t end = seqno + len;
+  if (!d->started) {
+    d->started = true;
+    d->snd_una = d->snd_max = seqno;
+    d->first_us = d->last_us = now;
+  }
+
+  if (SEQ_LT(d->snd_max, end)) {
+    flight_push(d, end, now);
+    d->snd_max = end;
+    d->segments++;
+    d->iv_segments++;
+    d->bytes += len;
+  }
+  else {
+    d->retransmits++;
+    d->iv_retransmits++;
+    if (SEQ_LEQ(end, d->snd_una)) {
+      d->spurious++;
+    }
+    else {
+      size_t i;
+      for (i = 0; i < d->flight_len; i++) {
+        flight_t *f = flight_at(d, i);
+        if (SEQ_LT(seqno, f->end)) {
+          f->resent_us = now;
+          break;
+        }
+      }
+    }
+  }
+  update_limited(d, now);
+}
+
+/* ACK sent from d->dst for data from d->src. */
+static void on_ack(direction_t *d, uint32_t ackno, uint16_t window,
+                   uint64_t now) {
+  d->rwnd = window;
+  if (!d->started)
+    return;
+  if (!SEQ_LT(d->snd_una, ackno)) {
+    update_limited(d, now);
+    return;
+  }
+
+  /* Data missing from the file, e.g. with --log-sample. */
+  if (SEQ_LT(d->snd_max, ackno))
+    d->snd_max = ackno;
+
+  d->acked += ackno - d->snd_una;
+  d->iv_acked += ackno - d->snd_una;
+  d->snd_una = ackno;
+  d->last_us = now;
+
+  /* Take an RTT sample from segments sent once (Karn's rule). Check the
+     retransmitted ones for an ACK too early to be for the retransmission. */
+  while (d->flight_len > 0 && SEQ_LEQ(flight_at(d, 0)->end, ackno)) {
+    flight_t *f = flight_at(d, 0);
+    if (f->resent_us == 0) {
+      hist_record(&d->rtt, now - f->sent_us);
+      d->iv_rtt_sum += now - f->sent_us;
+      d->iv_rtt_count++;
+    }
+    else if (d->rtt.count > 0 && now - f->resent_us < d->rtt.min) {
+      d->spurious++;
+    }
+    d->flight_head = (d->flight_head + 1) & (d->flight_size - 1);
+    d->flight_len--;
+  }
+  update_limited(d, now);
+}
+
+/* Ends the current interval of every direction, writing it to the timeline. */
+static void end_interval(analysis_t *a, uint64_t end) {
+  double ms = a->interval_us / 1000.0;
+  connection_t *c;
+  int i;
+  for (c = a->conns; c; c = c->next) {
+    for (i = 0; i < 2; i++) {
+      direction_t *d = &c->dir[i];
+      account_limited(d, end);
+      if (d->iv_segments == 0 && d->iv_acked == 0 && d->iv_retransmits == 0 &&
+          d->iv_limited_us == 0)
+        continue;
+
+      double kbps = d->iv_acked * 8 / ms;
+      if (kbps > d->peak_kbps)
+        d->peak_kbps = kbps;
+      if (a->timeline) {
+        fprintf(a->timeline, "%s,%.3f,", a->path,
+                (end - a->interval_us - a->start_us) / 1000000.0);
+        print_endpoint(a->timeline, d->src);
+        fprintf(a->timeline, ",");
+        print_endpoint(a->timeline, d->dst);
+        fprintf(a->timeline, ",%.1f,%lu,%lu,", kbps,
+                (unsigned long) d->iv_segments,
+                (unsigned long) d->iv_retransmits);
+        if (d->iv_rtt_count > 0)
+          fprintf(a->timeline, "%.3f", d->iv_rtt_sum / 1000.0 /
+                  d->iv_rtt_count);
+        fprintf(a->timeline, ",%.3f\n", d->iv_limited_us / 1000.0 / ms);
+      }
+      d->iv_segments = d->iv_acked = d->iv_retransmits = 0;
+      d->iv_rtt_sum = d->iv_rtt_count = d->iv_limited_us = 0;
+    }
+  }
+}
+
+/* Moves the timeline up to a segment's time. */
+static void advance(analysis_t *a, uint64_t now) {
+  if (a->interval_start == 0)
+    a->interval_start = a->start_us = now;
+
+  while (now >= a->interval_start + a->interval_us) {
+    a->interval_start += a->interval_us;
+    end_interval(a, a->interval_start);
+
+    /* Skip over idle stretches, unless someone is waiting on the window. */
+    bool waiting = false;
+    connection_t *c;
+    for (c = a->conns; c && !waiting; c = c->next)
+      waiting = c->dir[0].limited || c->dir[1].limited;
+    if (!waiting && now >= a->interval_start + a->interval_us)
+      a->interval_start += (now - a->interval_start) / a->interval_us *
+                           a->interval_us;
+  }
+}
+
+/* Handles one segment. Sequence numbers in captures are made relative to the
+   sender's SYN, to match the logs. */
+static void on_packet(void *arg, packet_t *p) {
+  analysis_t *a = arg;
+  connection_t *c;
+  a->packets++;
+  a->ports_only = p->on_wire;
+  advance(a, p->time_us);
+
+  direction_t *d = find_direction(a, p, &c);
+  direction_t *r = d == &c->dir[0] ? &c->dir[1] : &c->dir[0];
+  if (p->on_wire) {
+    if (p->flags & TH_SYN) {
+      /* A new connection from the same address and port. */
+      if (!(p->flags & TH_ACK) && (d->started || r->started)) {
+        c->closed = true;
+        d = find_direction(a, p, &c);
+        r = &c->dir[1];
+      }
+      d->base = p->seqno;
+      d->have_base = true;
+      return;
+    }
+    if (!d->have_base) {
+      d->base = p->seqno - 1;
+      d->have_base = true;
+    }
+    if (!r->have_base && (p->flags & TH_ACK)) {
+      r->base = p->ackno - 1;
+      r->have_base = true;
+    }
+    p->seqno -= d->base;
+    p->ackno -= r->base;
+  }
+
+  uint32_t len = p->data_len + ((p->flags & TH_FIN) ? 1 : 0);
+  if (len > 0)
+    on_data(d, p->seqno, len, p->time_us);
+  if (p->flags & TH_ACK)
+    on_ack(r, p->ackno, p->window, p->time_us);
+}
+
+static void print_direction(const direction_t *d) {
+  double secs = (d->last_us - d->first_us) / 1000000.0;
+  print_endpoint(stdout, d->src);
+  printf(" -> ");
+  print_endpoint(stdout, d->dst);
+  printf(": %lu bytes acknowledged in %.3f s\n", (unsigned long) d->acked,
+         secs);
+  printf("  %-12s %.1f kbit/s average, %.1f kbit/s peak\n", "goodput",
+         secs > 0 ? d->acked * 8 / 1000.0 / secs : 0, d->peak_kbps);
+  printf("  %-12s %lu sent, %lu retransmitted (%.2f%%), %lu spurious\n",
+         "segments", (unsigned long) d->segments,
+         (unsigned long) d->retransmits, d->segments > 0 ?
+         100.0 * d->retransmits / d->segments : 0,
+         (unsigned long) d->spurious);
+  printf("  %-12s %.3f s (%.1f%%)\n", "win-limited", d->limited_us /
+         1000000.0, secs > 0 ? d->limited_us / 10000.0 / secs : 0);
+  hist_print(stdout, "rtt (us)", &d->rtt);
+}
+
+static void analyze(const char *path, uint64_t interval_us, FILE *timeline) {
+  analysis_t a;
+  memset(&a, 0, sizeof(a));
+  a.path = path;
+  a.interval_us = interval_us;
+  a.timeline = timeline;
+  if (!read_packets(path, false, on_packet, &a))
+    return;
+
+  /* Close the last interval, and any window-limited period still open. */
+  if (a.interval_start > 0)
+    end_interval(&a, a.interval_start + a.interval_us);
+
+  int conns = 0;
+  connection_t *c;
+  for (c = a.conns; c; c = c->next)
+    conns++;
+  printf("%s: %lu segments, %d connection%s\n", path,
+         (unsigned long) a.packets, conns, conns == 1 ? "" : "s");
+
+  while ((c = a.conns)) {
+    int i;
+    for (i = 0; i < 2; i++) {
+      if (c->dir[i].started)
+        print_direction(&c->dir[i]);
+      free(c->dir[i].flight);
+    }
+    a.conns = c->next;
+    free(c);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  double interval = DEFAULT_INTERVAL_MS;
+  FILE *timeline = NULL;
+
+  struct option o[] = {
+    { "interval", required_argument, NULL, 'i' },
+    { "timeline", required_argument, NULL, 't' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:t:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 't':
+      timeline = fopen(optarg, "w");
+      if (timeline == NULL) {
+        fprintf(stderr, "[ERROR] Cannot create %s\n", optarg);
+        return 1;
+      }
+      fprintf(timeline, "file,time_s,src,dst,goodput_kbps,segments,"
+              "retransmits,rtt_ms,window_limited\n");
+      break;
+    default:
+      usage(progname);
+      break;
+    }
+  }
+  if (optind == argc || interval * 1000 < 1)
+    usage(progname);
+
+  int i;
+  for (i = optind; i < argc; i++) {
+    if (i > optind)
+      printf("\n");
+    analyze(argv[i], interval * 1000, timeline);
+  }
+
+  if (timeline)
+    fclose(timeline);
+  return 0;
+}
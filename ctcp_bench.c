@@ -0,0 +1,691 @@
+/******************************************************************************
+ * ctcp_bench.c
+ * ------------
+ * Benchmark harness. Runs one transfer for every combination of window size,
+ * transfer size, loss rate and backend given, and reports goodput, CPU time
+ * per MB, retransmission ratio and RTT percentiles for each. Results are
+ * printed as a table and can also be written as CSV or JSON.
+ *
+ * Backends:
+ *   unix A ctcp server and client process pair on this machine, which talk
+ *        over a Unix socket. CPU time is what both processes used (from
+ *        wait4()), and retransmissions and RTTs come from the client's log
+ *        (-l).
+ *   sim  The in-process emulator on the virtual clock (see ctcp_emu.h). Times
+ *        are simulated, CPU time is what the simulation used.
+ *   loopback
+ *        The emulator in loopback mode: segments go straight from one state
+ *        to the other, with no link. Times are real, so this measures how
+ *        fast the protocol code itself runs. No link options apply and there
+ *        are no RTTs.
+ *
+ * The unix and sim backends apply the same link: --rate on the client to
+ * server direction, and half of --latency and Gilbert-Elliott loss at the
+ * given rate on each.
+ *
+ *****************************************************************************/
+
+#include <dirent.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "ctcp_emu.h"
+
+/** Most values in one list option. */
+#define MAX_LIST 16
+
+/** How long to give the server to bind before starting the client, in us. */
+#define SERVER_START_US 200000
+
+/** How long to wait for processes to exit after a transfer, in ms. */
+#define EXIT_WAIT_MS 2000
+
+/** Same pattern the emulator's clients send, so outputs can be checked. */
+#define PATTERN_LEN 251
+
+typedef enum {
+  BACKEND_UNIX,
+  BACKEND_SIM,
+  BACKEND_LOOPBACK,
+  NUM_BACKENDS
+} backend_t;
+
+static const char *backend_names[NUM_BACKENDS] = { "unix", "sim",
+                                                    "loopback" };
+
+/** One point in the matrix. */
+typedef struct {
+  backend_t backend;
+  int window;
+  uint64_t bytes;
+  double loss;                 /* Loss rate in each direction, in percent */
+  int run;                     /* Repetition, counting from 1 */
+} trial_t;
+
+/** Measurements for one trial. */
+typedef struct {
+  bool completed;              /* All data arrived intact before the timeout */
+  double seconds;              /* From the client starting to the last byte */
+  double goodput_kbps;
+  double cpu_ms_per_mb;
+  uint64_t segments;           /* Data segments the client sent */
+  uint64_t retransmits;        /* Of which were sent before */
+  double rtt_ms[3];            /* 50th, 90th and 99th percentile, -1 if none */
+} result_t;
+
+/** RTT samples, in microseconds. */
+typedef struct {
+  uint32_t *us;
+  unsigned int len;
+  unsigned int cap;
+} rtts_t;
+
+/** Segment waiting for an ACK while going through a log. */
+typedef struct {
+  uint32_t end;
+  uint64_t time_us;
+  bool retransmitted;
+} unacked_t;
+
+static const double percentiles[3] = { 0.5, 0.9, 0.99 };
+
+/* Options that apply to every trial. */
+static char *opt_ctcp = "./ctcp";
+static uint32_t opt_rate = 0;
+static double opt_latency = 0;
+static int opt_timeout = 60;
+static int opt_port = 20000;
+static uint32_t opt_seed = 1;
+static bool opt_log = true;
+
+
+static char pattern_byte(uint64_t offset) {
+  return 'a' + offset % PATTERN_LEN % 26;
+}
+
+static void rtts_add(rtts_t *rtts, uint32_t us) {
+  if (rtts->len == rtts->cap) {
+    rtts->cap = rtts->cap ? rtts->cap * 2 : 256;
+    rtts->us = realloc(rtts->us, rtts->cap * sizeof(uint32_t));
+  }
+  rtts->us[rtts->len++] = us;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Fills in the RTT percentiles of a result. Sorts the samples. */
+static void set_percentiles(result_t *r, uint32_t *us, unsigned int len) {
+  int i;
+  qsort(us, len, sizeof(uint32_t), cmp_u32);
+  for (i = 0; i < 3; i++) {
+    if (len == 0) {
+      r->rtt_ms[i] = -1;
+      continue;
+    }
+    unsigned int rank = (unsigned int) (percentiles[i] * len + 0.999999);
+    r->rtt_ms[i] = us[rank > 0 ? rank - 1 : 0] / 1000.0;
+  }
+}
+
+/* Parses a comma-separated list of numbers. Returns the count, or -1. */
+static int parse_list(char *s, double *vals) {
+  int n = 0;
+  char *tok;
+  for (tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+    if (n == MAX_LIST)
+      return -1;
+    vals[n++] = atof(tok);
+  }
+  return n;
+}
+
+static double timeval_ms(const struct timeval *tv) {
+  return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static double elapsed_s(const struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) +
+         (now.tv_nsec - start->tv_nsec) / 1000000000.0;
+}
+
+
+/////////////////////////////// UNIX BACKEND ////////////////////////////////
+
+/*
+ * Goes through a client log, counting data segments and retransmissions and
+ * taking RTT samples from the ACKs (skipping retransmitted segments, as in
+ * Karn's algorithm). Log timestamps are in milliseconds.
+ */
+static void parse_log(const char *path, int port, result_t *r, rtts_t *rtts) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return;
+
+  unacked_t *unacked = NULL;
+  unsigned int head = 0, len = 0, cap = 0;
+  uint32_t sent_end = 1;
+  char *line = NULL;
+  size_t line_cap = 0;
+
+  /* Skip the headers. */
+  getline(&line, &line_cap, f);
+
+  while (getline(&line, &line_cap, f) > 0) {
+    char *fields[9];
+    char *save, *tok = strtok_r(line, "\t", &save);
+    int n = 0;
+    for (; tok && n < 9; tok = strtok_r(NULL, "\t", &save))
+      fields[n++] = tok;
+    if (n < 9)
+      continue;
+
+    uint64_t time_us = strtoull(fields[0], NULL, 10) * 1000;
+    bool sent = atoi(fields[2]) == port;
+    uint32_t seqno = strtoul(fields[5], NULL, 10);
+    uint32_t ackno = strtoul(fields[6], NULL, 10);
+    int data_len = atoi(fields[7]) - (int) sizeof(ctcp_segment_t);
+
+    if (sent && data_len > 0) {
+      uint32_t end = seqno + data_len;
+      unsigned int i;
+      r->segments++;
+      if ((int32_t) (end - sent_end) <= 0) {
+        r->retransmits++;
+        for (i = head; i < len; i++) {
+          if (unacked[i].end == end)
+            unacked[i].retransmitted = true;
+        }
+      }
+      else {
+        if (len == cap) {
+          cap = cap ? cap * 2 : 64;
+          unacked = realloc(unacked, cap * sizeof(unacked_t));
+        }
+        unacked[len].end = end;
+        unacked[len].time_us = time_us;
+        unacked[len].retransmitted = false;
+        len++;
+        sent_end = end;
+      }
+    }
+    else if (!sent && strstr(fields[8], "ACK")) {
+      while (head < len && (int32_t) (unacked[head].end - ackno) <= 0) {
+        if (!unacked[head].retransmitted)
+          rtts_add(rtts, time_us - unacked[head].time_us);
+        head++;
+      }
+    }
+  }
+
+  free(line);
+  free(unacked);
+  fclose(f);
+}
+
+/* Removes a trial's directory, first looking for the client's log in it. */
+static void clean_dir(const char *dir, int client_port, result_t *r,
+                      rtts_t *rtts) {
+  char suffix[16], path[PATH_MAX];
+  snprintf(suffix, sizeof(suffix), "-%d.csv", client_port);
+
+  DIR *d = opendir(dir);
+  struct dirent *entry;
+  while (d && (entry = readdir(d))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+    size_t name_len = strlen(entry->d_name);
+    if (rtts && name_len > strlen(suffix) &&
+        strcmp(entry->d_name + name_len - strlen(suffix), suffix) == 0)
+      parse_log(path, client_port, r, rtts);
+    unlink(path);
+  }
+  if (d)
+    closedir(d);
+  rmdir(dir);
+}
+
+/* Starts ctcp in the given directory with the given descriptors as its
+   standard streams. */
+static pid_t spawn(const char *dir, char **argv, int in, int out) {
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+
+  int null = open("/dev/null", O_RDWR);
+  dup2(in >= 0 ? in : null, STDIN_FILENO);
+  dup2(out >= 0 ? out : null, STDOUT_FILENO);
+  dup2(null, STDERR_FILENO);
+  if (chdir(dir) < 0)
+    _exit(1);
+  execv(argv[0], argv);
+  _exit(1);
+}
+
+/* Waits for a process for up to EXIT_WAIT_MS, then kills it. Adds its CPU
+   time to cpu_ms. */
+static void reap(pid_t pid, double *cpu_ms) {
+  struct rusage usage;
+  int status, waited;
+  for (waited = 0; waited < EXIT_WAIT_MS; waited += 10) {
+    if (wait4(pid, &status, WNOHANG, &usage) == pid)
+      goto done;
+    usleep(10000);
+  }
+  kill(pid, SIGKILL);
+  wait4(pid, &status, 0, &usage);
+done:
+  *cpu_ms += timeval_ms(&usage.ru_utime) + timeval_ms(&usage.ru_stime);
+}
+
+static int run_unix(const trial_t *t, int index, result_t *r) {
+  char dir[] = "/tmp/ctcp_bench.XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    fprintf(stderr, "[ERROR] Could not create a directory for the trial\n");
+    return -1;
+  }
+
+  /* Input for the client. */
+  char in_path[PATH_MAX];
+  snprintf(in_path, sizeof(in_path), "%s/in", dir);
+  FILE *in = fopen(in_path, "w");
+  uint64_t i;
+  for (i = 0; i < t->bytes; i++)
+    putc(pattern_byte(i), in);
+  fclose(in);
+
+  /* Arguments. */
+  int server_port = opt_port + 2 * (index % 1000);
+  int client_port = server_port + 1;
+  char ctcp[PATH_MAX], sport[16], cport[16], server[32], window[16], seed[16];
+  char latency[32], loss[32], rate[16];
+  if (realpath(opt_ctcp, ctcp) == NULL) {
+    fprintf(stderr, "[ERROR] Could not find %s\n", opt_ctcp);
+    clean_dir(dir, client_port, r, NULL);
+    return -1;
+  }
+  snprintf(sport, sizeof(sport), "%d", server_port);
+  snprintf(cport, sizeof(cport), "%d", client_port);
+  snprintf(server, sizeof(server), "localhost:%d", server_port);
+  snprintf(window, sizeof(window), "%d", t->window);
+  snprintf(seed, sizeof(seed), "%u", opt_seed + index);
+  snprintf(latency, sizeof(latency), "%g", opt_latency / 2);
+  snprintf(loss, sizeof(loss), "%g", t->loss);
+  snprintf(rate, sizeof(rate), "%u", opt_rate);
+
+  char *server_argv[16] = { ctcp, "-s", "-p", sport, "-w", window,
+                            "--seed", seed };
+  char *client_argv[20] = { ctcp, "-c", server, "-p", cport, "-w", window,
+                            "--seed", seed };
+  int sargc = 8, cargc = 9;
+  if (opt_log) {
+    server_argv[sargc++] = "-l";
+    client_argv[cargc++] = "-l";
+  }
+  if (opt_latency > 0) {
+    server_argv[sargc++] = "--latency";
+    server_argv[sargc++] = latency;
+    client_argv[cargc++] = "--latency";
+    client_argv[cargc++] = latency;
+  }
+  if (t->loss > 0) {
+    server_argv[sargc++] = "--gemodel";
+    server_argv[sargc++] = loss;
+    client_argv[cargc++] = "--gemodel";
+    client_argv[cargc++] = loss;
+  }
+  if (opt_rate > 0) {
+    client_argv[cargc++] = "--rate";
+    client_argv[cargc++] = rate;
+  }
+
+  /* Server reads from a pipe held open until the transfer is done, so it
+     doesn't close its side early, and writes into a pipe read here. */
+  int to_server[2], from_server[2];
+  if (pipe(to_server) < 0 || pipe(from_server) < 0) {
+    fprintf(stderr, "[ERROR] Could not create pipes\n");
+    clean_dir(dir, client_port, r, NULL);
+    return -1;
+  }
+  pid_t server_pid = spawn(dir, server_argv, to_server[0], from_server[1]);
+  close(to_server[0]);
+  close(from_server[1]);
+  usleep(SERVER_START_US);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int client_in = open(in_path, O_RDONLY);
+  pid_t client_pid = spawn(dir, client_argv, client_in, -1);
+  close(client_in);
+
+  /* Count and check what comes out of the server. */
+  uint64_t received = 0;
+  bool intact = true;
+  char buf[4096];
+  struct pollfd pfd = { from_server[0], POLLIN, 0 };
+  while (received < t->bytes) {
+    int timeout = opt_timeout * 1000 - elapsed_s(&start) * 1000;
+    if (timeout <= 0 || poll(&pfd, 1, timeout) <= 0)
+      break;
+    ssize_t n = read(from_server[0], buf, sizeof(buf));
+    if (n <= 0)
+      break;
+    for (i = 0; i < n; i++)
+      intact &= buf[i] == pattern_byte(received + i);
+    received += n;
+  }
+  r->seconds = elapsed_s(&start);
+  r->completed = received == t->bytes && intact;
+
+  /* Let the server close its side, then collect both. */
+  close(to_server[1]);
+  double cpu_ms = 0;
+  reap(client_pid, &cpu_ms);
+  kill(server_pid, SIGTERM);
+  reap(server_pid, &cpu_ms);
+  close(from_server[0]);
+
+  rtts_t rtts = { NULL, 0, 0 };
+  clean_dir(dir, client_port, r, &rtts);
+  set_percentiles(r, rtts.us, rtts.len);
+  free(rtts.us);
+
+  r->goodput_kbps = received * 8 / 1000.0 / r->seconds;
+  r->cpu_ms_per_mb = received ? cpu_ms / (received / 1000000.0) : 0;
+  return 0;
+}
+
+
+////////////////////////// SIM AND LOOPBACK BACKENDS //////////////////////////
+
+static int run_sim(const trial_t *t, int index, result_t *r) {
+  bool loopback = t->backend == BACKEND_LOOPBACK;
+  emu_config_t cfg;
+  memset(&cfg, 0, sizeof(emu_config_t));
+  cfg.window = t->window;
+  cfg.seed = opt_seed + index;
+  cfg.loopback = loopback;
+  cfg.bottleneck.rate_kbps = opt_rate;
+  cfg.bottleneck.delay_us = opt_latency * 1000 / 2;
+  cfg.reverse.delay_us = cfg.bottleneck.delay_us;
+  if (t->loss > 0) {
+    char loss[32];
+    snprintf(loss, sizeof(loss), "%g", t->loss);
+    link_parse_gemodel(loss, &cfg.bottleneck);
+    link_parse_gemodel(loss, &cfg.reverse);
+  }
+
+  struct rusage before, after;
+  struct timespec start;
+  getrusage(RUSAGE_SELF, &before);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  emu_t *emu = emu_create(&cfg);
+  emu_add_flow(emu, 0, t->bytes);
+  const emu_flow_stats_t *stats = emu_flow_stats(emu, 0);
+
+  /* opt_timeout is in simulated time here. Loopback transfers take little
+     simulated time, so check on them more often. */
+  uint64_t step = loopback ? 1000 : 100000, until;
+  for (until = step; until <= opt_timeout * 1000000ULL; until += step) {
+    emu_run(emu, until);
+    if (stats->end_us != 0)
+      break;
+  }
+  getrusage(RUSAGE_SELF, &after);
+
+  uint64_t end = stats->end_us ? stats->end_us : emu_now(emu);
+  r->seconds = loopback ? elapsed_s(&start) :
+                          (end - stats->start_us) / 1000000.0;
+  r->completed = stats->end_us != 0 && stats->bytes_delivered == t->bytes &&
+                 !stats->corrupted;
+  r->goodput_kbps = stats->bytes_delivered * 8 / 1000.0 / r->seconds;
+  double cpu_ms = timeval_ms(&after.ru_utime) - timeval_ms(&before.ru_utime) +
+                  timeval_ms(&after.ru_stime) - timeval_ms(&before.ru_stime);
+  r->cpu_ms_per_mb = stats->bytes_delivered ?
+                     cpu_ms / (stats->bytes_delivered / 1000000.0) : 0;
+  r->segments = stats->segments_sent;
+  r->retransmits = stats->retransmits;
+
+  unsigned int count;
+  const uint32_t *samples = emu_flow_rtts(emu, 0, &count);
+  if (loopback)
+    count = 0;
+  uint32_t *sorted = malloc((count + 1) * sizeof(uint32_t));
+  memcpy(sorted, samples, count * sizeof(uint32_t));
+  set_percentiles(r, sorted, count);
+  free(sorted);
+
+  emu_destroy(emu);
+  return 0;
+}
+
+
+/////////////////////////////////// OUTPUT ///////////////////////////////////
+
+static double retx_ratio(const result_t *r) {
+  return r->segments ? (double) r->retransmits / r->segments : 0;
+}
+
+static void print_row(const trial_t *t, const result_t *r) {
+  printf("%-7s  %6d  %10lu  %5g  %3d  %8.3f  %12.1f  %9.2f  %6.2f  %7.1f  "
+         "%7.1f  %7.1f%s\n",
+         backend_names[t->backend], t->window, (unsigned long) t->bytes,
+         t->loss, t->run, r->seconds, r->goodput_kbps, r->cpu_ms_per_mb,
+         retx_ratio(r) * 100, r->rtt_ms[0], r->rtt_ms[1], r->rtt_ms[2],
+         r->completed ? "" : "  FAILED");
+  fflush(stdout);
+}
+
+static void write_csv(FILE *f, const trial_t *t, const result_t *r) {
+  fprintf(f, "%s,%d,%lu,%g,%d,%d,%.6f,%.3f,%.3f,%lu,%lu,%.6f,%.3f,%.3f,%.3f\n",
+          backend_names[t->backend], t->window, (unsigned long) t->bytes,
+          t->loss, t->run, r->completed, r->seconds, r->goodput_kbps,
+          r->cpu_ms_per_mb, (unsigned long) r->segments,
+          (unsigned long) r->retransmits, retx_ratio(r), r->rtt_ms[0],
+          r->rtt_ms[1], r->rtt_ms[2]);
+}
+
+static void write_json(FILE *f, const trial_t *t, const result_t *r,
+                       bool first) {
+  fprintf(f, "%s  {\"backend\": \"%s\", \"window\": %d, \"bytes\": %lu, "
+          "\"loss_pct\": %g, \"run\": %d, \"completed\": %s, "
+          "\"seconds\": %.6f, \"goodput_kbps\": %.3f, "
+          "\"cpu_ms_per_mb\": %.3f, \"segments\": %lu, \"retransmits\": %lu, "
+          "\"retx_ratio\": %.6f, \"rtt_p50_ms\": %.3f, \"rtt_p90_ms\": %.3f, "
+          "\"rtt_p99_ms\": %.3f}",
+          first ? "" : ",\n", backend_names[t->backend], t->window,
+          (unsigned long) t->bytes, t->loss, t->run,
+          r->completed ? "true" : "false", r->seconds, r->goodput_kbps,
+          r->cpu_ms_per_mb, (unsigned long) r->segments,
+          (unsigned long) r->retransmits, retx_ratio(r), r->rtt_ms[0],
+          r->rtt_ms[1], r->rtt_ms[2]);
+}
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [--backends unix,sim,loopback]\n"
+    "   [--windows n1,n2,...]\n"
+    "   [--sizes bytes1,bytes2,...]\n"
+    "   [--loss percent1,percent2,...]\n"
+    "   [--runs runs]\n"
+    "   [--rate kbps]\n"
+    "   [--latency ms]\n"
+    "   [--timeout seconds]\n"
+    "   [--port port]\n"
+    "   [--seed seed]\n"
+    "   [--ctcp path]\n"
+    "   [--no-log]\n"
+    "   [--csv file]\n"
+    "   [--json file]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  bool backends[NUM_BACKENDS] = { true, true, false };
+  double windows[MAX_LIST] = { 1 }, sizes[MAX_LIST] = { 1000000 };
+  double losses[MAX_LIST] = { 0 };
+  int num_windows = 1, num_sizes = 1, num_losses = 1, runs = 1;
+  char *csv_path = NULL, *json_path = NULL;
+
+  struct option o[] = {
+    { "backends", required_argument, NULL, 'k' },
+    { "windows", required_argument, NULL, 'w' },
+    { "sizes", required_argument, NULL, 'z' },
+    { "loss", required_argument, NULL, 'r' },
+    { "runs", required_argument, NULL, 'n' },
+    { "rate", required_argument, NULL, 'b' },
+    { "latency", required_argument, NULL, 'a' },
+    { "timeout", required_argument, NULL, 'T' },
+    { "port", required_argument, NULL, 'p' },
+    { "seed", required_argument, NULL, 'e' },
+    { "ctcp", required_argument, NULL, 'x' },
+    { "no-log", no_argument, NULL, 'L' },
+    { "csv", required_argument, NULL, 'o' },
+    { "json", required_argument, NULL, 'J' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt, b;
+  char *tok;
+  while ((opt = getopt_long(argc, argv, "w:n:p:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'k':
+      memset(backends, 0, sizeof(backends));
+      for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+        for (b = 0; b < NUM_BACKENDS && strcmp(tok, backend_names[b]); b++);
+        if (b == NUM_BACKENDS)
+          usage(progname);
+        backends[b] = true;
+      }
+      break;
+    case 'w':
+      num_windows = parse_list(optarg, windows);
+      break;
+    case 'z':
+      num_sizes = parse_list(optarg, sizes);
+      break;
+    case 'r':
+      num_losses = parse_list(optarg, losses);
+      break;
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'b':
+      opt_rate = atoi(optarg);
+      break;
+    case 'a':
+      opt_latency = atof(optarg);
+      break;
+    case 'T':
+      opt_timeout = atoi(optarg);
+      break;
+    case 'p':
+      opt_port = atoi(optarg);
+      break;
+    case 'e':
+      opt_seed = atoi(optarg);
+      break;
+    case 'x':
+      opt_ctcp = optarg;
+      break;
+    case 'L':
+      opt_log = false;
+      break;
+    case 'o':
+      csv_path = optarg;
+      break;
+    case 'J':
+      json_path = optarg;
+      break;
+    default:
+      usage(progname);
+      break;
+    }
+  }
+  if (num_windows <= 0 || num_sizes <= 0 || num_losses <= 0 || runs < 1 ||
+      opt_timeout < 1)
+    usage(progname);
+
+  FILE *csv = NULL, *json = NULL;
+  if (csv_path && (csv = fopen(csv_path, "w")) == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", csv_path);
+    return 1;
+  }
+  if (json_path && (json = fopen(json_path, "w")) == NULL) {
+    fprintf(stderr, "[ERROR] Could not open %s\n", json_path);
+    return 1;
+  }
+  if (csv)
+    fprintf(csv, "backend,window,bytes,loss_pct,run,completed,seconds,"
+            "goodput_kbps,cpu_ms_per_mb,segments,retransmits,retx_ratio,"
+            "rtt_p50_ms,rtt_p90_ms,rtt_p99_ms\n");
+  if (json)
+    fprintf(json, "[\n");
+
+  /* The server keeps writing after the transfer if it is killed late. */
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("backend  window       bytes   loss  run    time_s  goodput_kbps  "
+         "cpu_ms/MB   retx%%  rtt_p50  rtt_p90  rtt_p99\n");
+
+  int index = 0, failed = 0, w, z, l, n;
+  for (b = 0; b < NUM_BACKENDS; b++) {
+    if (!backends[b])
+      continue;
+    for (w = 0; w < num_windows; w++) {
+      for (z = 0; z < num_sizes; z++) {
+        for (l = 0; l < num_losses; l++) {
+          for (n = 1; n <= runs; n++, index++) {
+            trial_t t = { b, windows[w], sizes[z], losses[l], n };
+            result_t r;
+            memset(&r, 0, sizeof(result_t));
+
+            int rc = b == BACKEND_UNIX ? run_unix(&t, index, &r) :
+                                        run_sim(&t, index, &r);
+            if (rc < 0)
+              return 1;
+            failed += !r.completed;
+
+            print_row(&t, &r);
+            if (csv)
+              write_csv(csv, &t, &r);
+            if (json)
+              write_json(json, &t, &r, index == 0);
+          }
+        }
+      }
+    }
+  }
+
+  if (csv)
+    fclose(csv);
+  if (json) {
+    fprintf(json, "\n]\n");
+    fclose(json);
+  }
+  return failed ? 1 : 0;
+}
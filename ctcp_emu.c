@@ -0,0 +1,494 @@
+#include "ctcp_emu.h"
+#include "ctcp_linked_list.h"
+#include "ctcp_utils.h"
+
+/** Space reported by conn_bufspace(). Servers don't buffer their output, so
+    this never runs out. Same as the library's MAX_BUF_SPACE. */
+#define EMU_BUF_SPACE 8192
+
+/** Clients send this pattern over and over, so servers can check it. A prime
+    length keeps it from lining up with segment boundaries. */
+#define PATTERN_LEN 251
+
+/** Segment waiting to be received by an endpoint. The segment is allocated
+    on its own so it can be handed to ctcp_receive(), which frees it. */
+typedef struct emu_seg {
+  struct emu_seg *next;
+  size_t len;
+  ctcp_segment_t *segment;
+} emu_seg_t;
+
+/** Data segment the client sent that has not been acknowledged yet. */
+typedef struct {
+  uint32_t end;                /* Sequence number after its last byte */
+  uint64_t time;               /* When it was (last) sent */
+  bool retransmitted;          /* Sent more than once, so no RTT sample */
+} emu_unacked_t;
+
+/** One end of a flow. */
+struct conn {
+  emu_t *emu;
+  int flow;                    /* Flow this end belongs to */
+  bool is_client;
+  ctcp_state_t *state;         /* NULL until the flow starts and after
+                                  ctcp_destroy() */
+  struct conn *peer;           /* Other end of the flow */
+
+  bool removed;                /* ctcp_destroy() has been called */
+  bool read_eof;               /* conn_input() has returned EOF */
+  bool wrote_eof;              /* EOF has been output */
+  bool peer_fin;               /* A FIN has arrived from the other end */
+
+  emu_seg_t *inbox;            /* Segments that came out of the network */
+  emu_seg_t **inbox_tail;
+};
+
+/** A client/server pair. */
+typedef struct {
+  conn_t client;
+  conn_t server;
+  uint64_t bytes;              /* Bytes to send, 0 for no limit */
+  bool started;
+  uint32_t sent_end;           /* End of the highest data the client sent */
+  linked_list_t *unacked;      /* emu_unacked_t, in order */
+  uint32_t *rtts;              /* RTT samples, in microseconds */
+  unsigned int rtt_len;
+  unsigned int rtt_cap;
+  emu_flow_stats_t stats;
+} emu_flow_t;
+
+struct emu {
+  emu_config_t cfg;
+  uint64_t start;              /* Absolute time emu_create() was called */
+  link_t *fwd;                 /* Clients to servers */
+  link_t *rev;                 /* Servers to clients */
+  emu_flow_t **flows;
+  int num_flows;
+  uint64_t next_timer;         /* When ctcp_timer() is next due */
+};
+
+static unsigned char pattern[PATTERN_LEN + MAX_SEG_DATA_SIZE];
+
+static emu_flow_t *conn_flow(conn_t *conn);
+
+
+/* Absolute time, in the links' time base. This is the virtual clock in
+   simulation builds. */
+static uint64_t emu_clock(emu_t *emu) {
+  return current_time_us();
+}
+
+/* Waits until the given relative time. Simulation builds jump straight
+   there. */
+static void emu_wait(emu_t *emu, uint64_t until) {
+#ifdef CTCP_SIM
+  sim_set_time(emu->start + until);
+#else
+  uint64_t now = emu_now(emu);
+  if (until > now)
+    usleep(until - now);
+#endif
+}
+
+static void emu_deliver(void *arg, const void *addr, size_t addr_len,
+                        const void *buf, size_t len) {
+  conn_t *dst;
+  memcpy(&dst, addr, sizeof(dst));
+  if (dst->removed)
+    return;
+
+  emu_seg_t *seg = malloc(sizeof(emu_seg_t));
+  seg->next = NULL;
+  seg->len = len;
+  seg->segment = malloc(len);
+  memcpy(seg->segment, buf, len);
+  *dst->inbox_tail = seg;
+  dst->inbox_tail = &seg->next;
+}
+
+static void emu_conn_setup(emu_t *emu, conn_t *conn, int flow, bool is_client,
+                           conn_t *peer) {
+  conn->emu = emu;
+  conn->flow = flow;
+  conn->is_client = is_client;
+  conn->peer = peer;
+  conn->inbox_tail = &conn->inbox;
+}
+
+static void emu_conn_free(conn_t *conn) {
+  emu_seg_t *seg, *next;
+  for (seg = conn->inbox; seg; seg = next) {
+    next = seg->next;
+    free(seg->segment);
+    free(seg);
+  }
+  conn->inbox = NULL;
+  conn->inbox_tail = &conn->inbox;
+}
+
+static ctcp_state_t *emu_conn_init(emu_t *emu, conn_t *conn) {
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  cfg->recv_window = emu->cfg.window * MAX_SEG_DATA_SIZE;
+  cfg->send_window = emu->cfg.window * MAX_SEG_DATA_SIZE;
+  cfg->timer = EMU_TIMER_INTERVAL;
+  cfg->rt_timeout = EMU_RT_INTERVAL;
+  return ctcp_init(conn, cfg);
+}
+
+static void emu_start_flows(emu_t *emu, uint64_t now) {
+  int i;
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (flow->started || flow->stats.start_us > now)
+      continue;
+
+    flow->started = true;
+    flow->client.state = emu_conn_init(emu, &flow->client);
+    flow->server.state = emu_conn_init(emu, &flow->server);
+  }
+}
+
+/* Takes RTT samples from an ACK arriving at a client. Retransmitted segments
+   are skipped (Karn's algorithm). */
+static void emu_sample_rtt(emu_flow_t *flow, ctcp_segment_t *segment,
+                           uint64_t now) {
+  if (!(segment->flags & TH_ACK))
+    return;
+
+  uint32_t ackno = ntohl(segment->ackno);
+  ll_node_t *node;
+  while ((node = ll_front(flow->unacked))) {
+    emu_unacked_t *sent = node->object;
+    if ((int32_t) (sent->end - ackno) > 0)
+      break;
+
+    if (!sent->retransmitted) {
+      if (flow->rtt_len == flow->rtt_cap) {
+        flow->rtt_cap = flow->rtt_cap ? flow->rtt_cap * 2 : 256;
+        flow->rtts = realloc(flow->rtts, flow->rtt_cap * sizeof(uint32_t));
+      }
+      flow->rtts[flow->rtt_len++] = now - sent->time;
+    }
+    free(ll_remove(flow->unacked, node));
+  }
+}
+
+/* Hands segments that came out of the network to the student code. Returns
+   whether anything was received. */
+static bool emu_receive(conn_t *conn) {
+  emu_seg_t *seg;
+  bool received = false;
+
+  while (!conn->removed && (seg = conn->inbox)) {
+    conn->inbox = seg->next;
+    if (!conn->inbox)
+      conn->inbox_tail = &conn->inbox;
+
+    ctcp_segment_t *segment = seg->segment;
+    size_t len = seg->len;
+    free(seg);
+
+    if (segment->flags & TH_FIN)
+      conn->peer_fin = true;
+    if (conn->is_client)
+      emu_sample_rtt(conn_flow(conn), segment, emu_clock(conn->emu));
+    ctcp_receive(conn->state, segment, len);
+    received = true;
+  }
+  return received;
+}
+
+/* Does one round of work. Returns whether anything happened that might let
+   more work happen straight away. */
+static bool emu_step(emu_t *emu, uint64_t now) {
+  bool busy = false;
+  int i;
+
+  emu_start_flows(emu, now);
+  link_run(emu->fwd, emu->start + now);
+  link_run(emu->rev, emu->start + now);
+
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (!flow->started)
+      continue;
+    busy |= emu_receive(&flow->client);
+    busy |= emu_receive(&flow->server);
+  }
+
+  /* Input is always ready, like STDIN with a file behind it. */
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (!flow->started)
+      continue;
+    if (!flow->client.removed)
+      ctcp_read(flow->client.state);
+    if (!flow->server.removed)
+      ctcp_read(flow->server.state);
+  }
+
+  if (now >= emu->next_timer) {
+    ctcp_timer();
+    emu->next_timer = now + EMU_TIMER_INTERVAL * 1000;
+  }
+
+  for (i = 0; i < emu->num_flows; i++)
+    busy |= emu->flows[i]->client.inbox || emu->flows[i]->server.inbox;
+  return busy;
+}
+
+/* Relative time of the next thing that needs doing. */
+static uint64_t emu_next_event(emu_t *emu, uint64_t now, uint64_t until) {
+  uint64_t next = until < emu->next_timer ? until : emu->next_timer;
+  long wait;
+  int i;
+
+  if ((wait = link_next_event(emu->fwd, emu->start + now)) >= 0 &&
+      now + wait < next)
+    next = now + wait;
+  if ((wait = link_next_event(emu->rev, emu->start + now)) >= 0 &&
+      now + wait < next)
+    next = now + wait;
+
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (!flow->started && flow->stats.start_us < next)
+      next = flow->stats.start_us;
+  }
+  return next;
+}
+
+emu_t *emu_create(const emu_config_t *cfg) {
+  int i;
+  for (i = 0; i < sizeof(pattern); i++)
+    pattern[i] = 'a' + i % PATTERN_LEN % 26;
+
+  emu_t *emu = calloc(sizeof(emu_t), 1);
+  emu->cfg = *cfg;
+  if (emu->cfg.window == 0)
+    emu->cfg.window = 1;
+  emu->start = emu_clock(emu);
+
+  emu->fwd = link_create(&cfg->bottleneck, cfg->seed, emu_deliver, emu,
+                         emu->start);
+  emu->rev = link_create(&cfg->reverse, cfg->seed + 1, emu_deliver, emu,
+                         emu->start);
+  return emu;
+}
+
+void emu_destroy(emu_t *emu) {
+  int i;
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (flow->started && !flow->client.removed)
+      ctcp_destroy(flow->client.state);
+    if (flow->started && !flow->server.removed)
+      ctcp_destroy(flow->server.state);
+    emu_conn_free(&flow->client);
+    emu_conn_free(&flow->server);
+    while (ll_length(flow->unacked) > 0)
+      free(ll_remove(flow->unacked, ll_front(flow->unacked)));
+    ll_destroy(flow->unacked);
+    free(flow->rtts);
+    free(flow);
+  }
+  link_destroy(emu->fwd);
+  link_destroy(emu->rev);
+  free(emu->flows);
+  free(emu);
+}
+
+int emu_add_flow(emu_t *emu, uint64_t start_us, uint64_t bytes) {
+  emu_flow_t *flow = calloc(sizeof(emu_flow_t), 1);
+  int id = emu->num_flows++;
+
+  emu_conn_setup(emu, &flow->client, id, true, &flow->server);
+  emu_conn_setup(emu, &flow->server, id, false, &flow->client);
+  flow->bytes = bytes;
+  flow->stats.start_us = start_us;
+  flow->sent_end = 1;
+  flow->unacked = ll_create();
+
+  emu->flows = realloc(emu->flows, emu->num_flows * sizeof(emu_flow_t *));
+  emu->flows[id] = flow;
+  return id;
+}
+
+void emu_run(emu_t *emu, uint64_t until_us) {
+  uint64_t now;
+
+  while ((now = emu_now(emu)) < until_us) {
+    /* Virtual time only moves when told to, so charge for each round of
+       work. Otherwise segments going back and forth over a link with no
+       delay would never let time pass. */
+    if (emu_step(emu, now)) {
+#ifdef CTCP_SIM
+      emu_wait(emu, now + EMU_SIM_STEP_US);
+#endif
+      continue;
+    }
+    emu_wait(emu, emu_next_event(emu, now, until_us));
+  }
+}
+
+uint64_t emu_now(emu_t *emu) {
+  return emu_clock(emu) - emu->start;
+}
+
+bool emu_done(emu_t *emu) {
+  int i;
+  for (i = 0; i < emu->num_flows; i++) {
+    emu_flow_t *flow = emu->flows[i];
+    if (flow->bytes > 0 && !flow->stats.closed)
+      return false;
+  }
+  return true;
+}
+
+int emu_num_flows(emu_t *emu) {
+  return emu->num_flows;
+}
+
+const emu_flow_stats_t *emu_flow_stats(emu_t *emu, int flow) {
+  return &emu->flows[flow]->stats;
+}
+
+const uint32_t *emu_flow_rtts(emu_t *emu, int flow, unsigned int *count) {
+  *count = emu->flows[flow]->rtt_len;
+  return emu->flows[flow]->rtts;
+}
+
+link_t *emu_bottleneck(emu_t *emu) {
+  return emu->fwd;
+}
+
+
+/////////////////////////////// CONN_* FUNCTIONS //////////////////////////////
+
+static emu_flow_t *conn_flow(conn_t *conn) {
+  return conn->emu->flows[conn->flow];
+}
+
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  emu_flow_t *flow = conn_flow(conn);
+  if (conn->read_eof)
+    return -1;
+
+  /* Servers have nothing to say, and hang up once the client has, like a
+     program that exits at the end of its input. */
+  if (!conn->is_client) {
+    if (!conn->wrote_eof && !conn->peer_fin)
+      return 0;
+    conn->read_eof = true;
+    return -1;
+  }
+
+  uint64_t offset = flow->stats.bytes_read;
+  if (flow->bytes > 0) {
+    if (offset == flow->bytes) {
+      conn->read_eof = true;
+      return -1;
+    }
+    if (len > flow->bytes - offset)
+      len = flow->bytes - offset;
+  }
+  if (len > MAX_SEG_DATA_SIZE)
+    len = MAX_SEG_DATA_SIZE;
+
+  memcpy(buf, pattern + offset % PATTERN_LEN, len);
+  flow->stats.bytes_read += len;
+  return len;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  emu_t *emu = conn->emu;
+  emu_flow_t *flow = conn_flow(conn);
+
+  /* Count data segments from the client, and which ones are repeats. */
+  size_t data_len = ntohs(segment->len) - sizeof(ctcp_segment_t);
+  if (conn->is_client && data_len > 0) {
+    uint32_t end = ntohl(segment->seqno) + data_len;
+    flow->stats.segments_sent++;
+    if ((int32_t) (end - flow->sent_end) <= 0) {
+      flow->stats.retransmits++;
+      ll_node_t *node;
+      for (node = ll_front(flow->unacked); node; node = node->next) {
+        emu_unacked_t *sent = node->object;
+        if (sent->end == end) {
+          sent->retransmitted = true;
+          sent->time = emu_clock(emu);
+        }
+      }
+    }
+    else {
+      emu_unacked_t *sent = calloc(sizeof(emu_unacked_t), 1);
+      sent->end = end;
+      sent->time = emu_clock(emu);
+      ll_add(flow->unacked, sent);
+      flow->sent_end = end;
+    }
+  }
+
+  if (emu->cfg.loopback)
+    emu_deliver(emu, &conn->peer, sizeof(conn->peer), segment, len);
+  else
+    link_send(conn->is_client ? emu->fwd : emu->rev, segment, len,
+              &conn->peer, sizeof(conn->peer), emu_clock(emu));
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  emu_flow_t *flow = conn_flow(conn);
+  if (conn->wrote_eof)
+    return 0;
+
+  if (len == 0) {
+    conn->wrote_eof = true;
+    if (!conn->is_client && !flow->stats.end_us)
+      flow->stats.end_us = emu_now(conn->emu);
+    return 0;
+  }
+
+  /* Check the data arrived intact and in order. */
+  if (!conn->is_client) {
+    uint64_t offset = flow->stats.bytes_delivered;
+    size_t done = 0;
+    while (done < len) {
+      size_t chunk = len - done < MAX_SEG_DATA_SIZE ? len - done :
+                     MAX_SEG_DATA_SIZE;
+      if (memcmp(buf + done, pattern + (offset + done) % PATTERN_LEN, chunk))
+        flow->stats.corrupted = true;
+      done += chunk;
+    }
+    flow->stats.bytes_delivered += len;
+    if (flow->stats.bytes_delivered == flow->bytes && !flow->stats.end_us)
+      flow->stats.end_us = emu_now(conn->emu);
+  }
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn) {
+  return EMU_BUF_SPACE;
+}
+
+size_t conn_mss(conn_t *conn) {
+  return MAX_SEG_DATA_SIZE;
+}
+
+void conn_remove(conn_t *conn) {
+  emu_flow_t *flow = conn_flow(conn);
+  conn->removed = true;
+  conn->state = NULL;
+  emu_conn_free(conn);
+
+  if (flow->client.removed && flow->server.removed)
+    flow->stats.closed = true;
+}
+
+/* Flows have their own statistics (emu_flow_stats). */
+ctcp_stats_t *conn_stats(conn_t *conn) {
+  return NULL;
+}
+
+void end_client() {
+}
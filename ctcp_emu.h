@@ -0,0 +1,131 @@
+/******************************************************************************
+ * ctcp_emu.h
+ * ----------
+ * In-process network emulator. Runs any number of cTCP flows inside a single
+ * process, without sockets. Each flow is a client/server pair of
+ * ctcp_state_t. Clients send through a shared bottleneck link (see
+ * ctcp_link.h) to their servers, and ACKs come back over a reverse link.
+ *
+ * This file provides its own conn_input(), conn_send(), conn_output(),
+ * conn_bufspace(), conn_remove() and end_client(), so it replaces
+ * ctcp_sys_internal.c when linked with ctcp.c. Clients read generated data
+ * instead of STDIN, and servers check and count what they receive instead of
+ * writing to STDOUT.
+ *
+ * In loopback mode the links are skipped and segments go straight to the
+ * other end, so a pair of states can be driven as fast as the protocol code
+ * allows, to measure or profile it without the kernel in the way.
+ *
+ * Built with CTCP_SIM, the emulator runs on the virtual clock in ctcp_utils.h:
+ * instead of sleeping until the next event it jumps the clock there, so runs
+ * take as long as the work they do and the same seed always gives the same
+ * result.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_EMU_H
+#define CTCP_EMU_H
+
+#include "ctcp.h"
+#include "ctcp_link.h"
+
+/** Same timer values the library uses (see ctcp_sys_internal.h). */
+#define EMU_TIMER_INTERVAL 40
+#define EMU_RT_INTERVAL 200
+
+/** Virtual time charged for each round of work in simulation builds, in
+    microseconds. */
+#define EMU_SIM_STEP_US 1
+
+/** Emulator configuration. */
+typedef struct {
+  link_config_t bottleneck; /* Link from clients to servers */
+  link_config_t reverse;    /* Link from servers to clients */
+  uint16_t window;          /* Window size, in multiples of MAX_SEG_DATA_SIZE */
+  uint32_t seed;            /* Seed for the bottleneck */
+  bool loopback;            /* Skip both links and deliver segments to the
+                               other end straight away */
+} emu_config_t;
+
+/** Counters for one flow. */
+typedef struct {
+  uint64_t start_us;        /* When the flow started */
+  uint64_t end_us;          /* When the server got all the data or the EOF,
+                               0 if not yet */
+  uint64_t bytes_read;      /* Bytes the client read from its input */
+  uint64_t bytes_delivered; /* Bytes the server output, in order */
+  uint64_t segments_sent;   /* Segments the client sent with data */
+  uint64_t retransmits;     /* Data segments sent more than once */
+  bool corrupted;           /* Server output did not match client input */
+  bool closed;              /* Both sides have torn down */
+} emu_flow_stats_t;
+
+typedef struct emu emu_t;
+
+/**
+ * Creates an emulator. Free with emu_destroy().
+ *
+ * cfg: Configuration. Copied.
+ * returns: The emulator.
+ */
+emu_t *emu_create(const emu_config_t *cfg);
+
+/**
+ * Destroys an emulator. Any flows still open are torn down.
+ */
+void emu_destroy(emu_t *emu);
+
+/**
+ * Adds a flow. The client starts sending at the given time.
+ *
+ * emu: The emulator.
+ * start_us: When the flow starts, relative to emu_create().
+ * bytes: Bytes the client sends before closing, 0 to send until the emulator
+ *        is destroyed.
+ * returns: The flow's number, counting from 0.
+ */
+int emu_add_flow(emu_t *emu, uint64_t start_us, uint64_t bytes);
+
+/**
+ * Runs the emulator until the given time (relative to emu_create()).
+ */
+void emu_run(emu_t *emu, uint64_t until_us);
+
+/**
+ * Returns the current time, relative to emu_create().
+ */
+uint64_t emu_now(emu_t *emu);
+
+/**
+ * Returns whether every flow with a byte limit has closed.
+ */
+bool emu_done(emu_t *emu);
+
+/**
+ * Returns the number of flows.
+ */
+int emu_num_flows(emu_t *emu);
+
+/**
+ * Returns the counters for a flow.
+ */
+const emu_flow_stats_t *emu_flow_stats(emu_t *emu, int flow);
+
+/**
+ * Returns the round-trip times a flow's client has measured so far, in
+ * microseconds. Segments that were retransmitted are not sampled.
+ *
+ * emu: The emulator.
+ * flow: The flow.
+ * count: Return parameter, the number of samples.
+ * returns: The samples, in the order they were taken. Valid until the next
+ *          call to emu_run().
+ */
+const uint32_t *emu_flow_rtts(emu_t *emu, int flow, unsigned int *count);
+
+/**
+ * Returns the bottleneck link.
+ */
+link_t *emu_bottleneck(emu_t *emu);
+
+#endif /* CTCP_EMU_H */
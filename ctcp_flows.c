@@ -0,0 +1,309 @@
+/******************************************************************************
+ * ctcp_flows.c
+ * ------------
+ * Runs several cTCP flows over one emulated bottleneck (see ctcp_emu.h) and
+ * reports how fairly they share it: per-flow goodput over time, Jain's
+ * fairness index, and how long each flow took to converge to its fair share.
+ *
+ * Built as ctcp_sim (make sim), it runs on a virtual clock instead, as fast as
+ * the CPU allows and with the same result for the same seed.
+ *
+ *****************************************************************************/
+
+#include <getopt.h>
+#include "ctcp_emu.h"
+
+/** Intervals in a row the index must stay above the threshold to count as
+    converged. */
+#define CONVERGE_INTERVALS 3
+
+/** Goodput samples, one row per interval. */
+typedef struct {
+  double *kbps;                /* kbit/s per flow, -1 if the flow was idle */
+  int len;
+  int cap;
+  int num_flows;
+} samples_t;
+
+/* Jain's index over the flows active in a row, or -1 if none were. */
+static double jain(const double *kbps, int num_flows) {
+  double sum = 0, sum_sq = 0;
+  int n = 0, i;
+  for (i = 0; i < num_flows; i++) {
+    if (kbps[i] < 0)
+      continue;
+    sum += kbps[i];
+    sum_sq += kbps[i] * kbps[i];
+    n++;
+  }
+  if (n == 0)
+    return -1;
+  return sum_sq == 0 ? 1 : sum * sum / (n * sum_sq);
+}
+
+static double *samples_add(samples_t *s) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->kbps = realloc(s->kbps, s->cap * s->num_flows * sizeof(double));
+  }
+  return s->kbps + s->num_flows * s->len++;
+}
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-n flows]\n"
+    "   [-w window_size]\n"
+    "   [--duration seconds]\n"
+    "   [--stagger ms]\n"
+    "   [--bytes bytes]\n"
+    "   [--interval ms]\n"
+    "   [--threshold index]\n"
+    "   [--seed seed]\n"
+    "   [--rate kbps]\n"
+    "   [--latency ms]\n"
+    "   [--queue packets]\n"
+    "   [--aqm droptail|red|codel]\n"
+    "   [--jitter ms]\n"
+    "   [--gemodel p[,r[,1-h[,1-k]]]]\n"
+    "   [--csv file]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  int num_flows = 2;
+  double duration = 30;
+  double stagger = 0;
+  uint64_t bytes = 0;
+  double interval = 500;
+  double threshold = 0.9;
+  char *csv_path = NULL;
+  emu_config_t cfg;
+  memset(&cfg, 0, sizeof(emu_config_t));
+  cfg.window = 8;
+  cfg.seed = time(NULL);
+  cfg.bottleneck.rate_kbps = 10000;
+  cfg.bottleneck.delay_us = 10000;
+  cfg.reverse.delay_us = 10000;
+
+  struct option o[] = {
+    { "flows", required_argument, NULL, 'n' },
+    { "window", required_argument, NULL, 'w' },
+    { "duration", required_argument, NULL, 'T' },
+    { "stagger", required_argument, NULL, 'S' },
+    { "bytes", required_argument, NULL, 'B' },
+    { "interval", required_argument, NULL, 'i' },
+    { "threshold", required_argument, NULL, 'h' },
+    { "seed", required_argument, NULL, 'e' },
+    { "rate", required_argument, NULL, 'b' },
+    { "latency", required_argument, NULL, 'a' },
+    { "queue", required_argument, NULL, 'Q' },
+    { "aqm", required_argument, NULL, 'M' },
+    { "jitter", required_argument, NULL, 'j' },
+    { "gemodel", required_argument, NULL, 'g' },
+    { "csv", required_argument, NULL, 'o' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:w:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'n':
+      num_flows = atoi(optarg);
+      break;
+    case 'w':
+      cfg.window = atoi(optarg);
+      break;
+    case 'T':
+      duration = atof(optarg);
+      break;
+    case 'S':
+      stagger = atof(optarg);
+      break;
+    case 'B':
+      bytes = strtoull(optarg, NULL, 10);
+      break;
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 'h':
+      threshold = atof(optarg);
+      break;
+    case 'e':
+      cfg.seed = atoi(optarg);
+      break;
+    case 'b':
+      cfg.bottleneck.rate_kbps = atoi(optarg);
+      break;
+    /* Round-trip delay is split evenly between the two directions. */
+    case 'a':
+      cfg.bottleneck.delay_us = atof(optarg) * 1000 / 2;
+      cfg.reverse.delay_us = cfg.bottleneck.delay_us;
+      break;
+    case 'Q':
+      cfg.bottleneck.queue_limit = atoi(optarg);
+      break;
+    case 'M':
+      if (link_parse_aqm(optarg, &cfg.bottleneck.aqm) < 0)
+        usage(progname);
+      break;
+    case 'j':
+      cfg.bottleneck.jitter_us = atof(optarg) * 1000;
+      break;
+    case 'g':
+      if (link_parse_gemodel(optarg, &cfg.bottleneck) < 0)
+        usage(progname);
+      break;
+    case 'o':
+      csv_path = optarg;
+      break;
+    default:
+      usage(progname);
+      break;
+    }
+  }
+  if (num_flows < 1 || duration <= 0 || interval <= 0 || cfg.window < 1)
+    usage(progname);
+
+  FILE *csv = NULL;
+  if (csv_path) {
+    if ((csv = fopen(csv_path, "w")) == NULL) {
+      fprintf(stderr, "[ERROR] Could not open %s\n", csv_path);
+      return 1;
+    }
+    fprintf(csv, "time_ms,flow,goodput_kbps,jain\n");
+  }
+
+#ifdef CTCP_SIM
+  struct timespec wall_start, wall_end;
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+#endif
+
+  emu_t *emu = emu_create(&cfg);
+  int i;
+  for (i = 0; i < num_flows; i++)
+    emu_add_flow(emu, i * stagger * 1000, bytes);
+
+  /* Sample goodput every interval. */
+  samples_t samples = { NULL, 0, 0, num_flows };
+  uint64_t *last = calloc(num_flows, sizeof(uint64_t));
+  uint64_t step = interval * 1000;
+  uint64_t end = duration * 1000000;
+  uint64_t t;
+  for (t = step; t <= end; t += step) {
+    emu_run(emu, t);
+
+    double *row = samples_add(&samples);
+    for (i = 0; i < num_flows; i++) {
+      const emu_flow_stats_t *stats = emu_flow_stats(emu, i);
+      bool active = stats->start_us < t &&
+                    (stats->end_us == 0 || stats->end_us > t - step);
+      row[i] = active ? (stats->bytes_delivered - last[i]) * 8.0 / interval :
+               -1;
+      last[i] = stats->bytes_delivered;
+    }
+
+    if (csv) {
+      double index = jain(row, num_flows);
+      for (i = 0; i < num_flows; i++) {
+        if (row[i] >= 0)
+          fprintf(csv, "%.0f,%d,%.1f,%.4f\n", t / 1000.0, i + 1, row[i],
+                  index);
+      }
+    }
+    if (bytes > 0 && emu_done(emu))
+      break;
+  }
+  if (csv)
+    fclose(csv);
+
+  /* Per-flow summary. */
+  printf("flow  start_s  bytes        goodput_kbps  retransmits  segments\n");
+  for (i = 0; i < num_flows; i++) {
+    const emu_flow_stats_t *stats = emu_flow_stats(emu, i);
+    uint64_t stop = stats->end_us ? stats->end_us : emu_now(emu);
+    double secs = stop > stats->start_us ?
+                  (stop - stats->start_us) / 1000000.0 : 0;
+    printf("%-4d  %7.2f  %-11lu  %12.1f  %11lu  %8lu%s\n", i + 1,
+           stats->start_us / 1000000.0, (unsigned long) stats->bytes_delivered,
+           secs > 0 ? stats->bytes_delivered * 8 / 1000.0 / secs : 0,
+           (unsigned long) stats->retransmits,
+           (unsigned long) stats->segments_sent,
+           stats->corrupted ? "  CORRUPTED" : "");
+  }
+
+  /* Jain's index over the intervals where every flow was active. */
+  double *mean = calloc(num_flows, sizeof(double));
+  int full = 0, r;
+  for (r = 0; r < samples.len; r++) {
+    double *row = samples.kbps + r * num_flows;
+    for (i = 0; i < num_flows && row[i] >= 0; i++);
+    if (i < num_flows)
+      continue;
+    for (i = 0; i < num_flows; i++)
+      mean[i] += row[i];
+    full++;
+  }
+  if (full > 0)
+    printf("Jain's fairness index: %.4f (over %d intervals with all flows "
+           "active)\n", jain(mean, num_flows), full);
+  else
+    printf("Jain's fairness index: n/a (flows were never all active)\n");
+
+  /* Convergence: time from a flow's start until the index over the active
+     flows first stays at or above the threshold for CONVERGE_INTERVALS. */
+  for (i = 0; i < num_flows; i++) {
+    const emu_flow_stats_t *stats = emu_flow_stats(emu, i);
+    int run = 0;
+    for (r = 0; r < samples.len; r++) {
+      uint64_t sample_end = (r + 1) * step;
+      if (sample_end <= stats->start_us)
+        continue;
+      double index = jain(samples.kbps + r * num_flows, num_flows);
+      run = index >= threshold ? run + 1 : 0;
+      if (run == CONVERGE_INTERVALS)
+        break;
+    }
+    if (r < samples.len) {
+      uint64_t at = (r + 1 - CONVERGE_INTERVALS) * step;
+      printf("Flow %d converged after %.2f s\n", i + 1,
+             at > stats->start_us ? (at - stats->start_us) / 1000000.0 : 0);
+    }
+    else {
+      printf("Flow %d did not converge\n", i + 1);
+    }
+  }
+
+  const link_stats_t *ls = link_get_stats(emu_bottleneck(emu));
+  printf("Bottleneck: %lu delivered, %lu queue drops, %lu AQM drops\n",
+         (unsigned long) ls->delivered, (unsigned long) ls->dropped_queue,
+         (unsigned long) ls->dropped_aqm);
+
+#ifdef CTCP_SIM
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  printf("Simulated %.2f s in %.2f s\n", emu_now(emu) / 1000000.0,
+         (wall_end.tv_sec - wall_start.tv_sec) +
+         (wall_end.tv_nsec - wall_start.tv_nsec) / 1000000000.0);
+#endif
+
+  free(mean);
+  free(last);
+  free(samples.kbps);
+  emu_destroy(emu);
+  return 0;
+}
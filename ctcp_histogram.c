@@ -0,0 +1,100 @@
+#include "ctcp_histogram.h"
+
+#define HIST_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_LIMIT ((1ULL << HIST_MAX_BITS) - 1)
+
+static const double print_percentiles[] = { 50, 90, 99, 99.9 };
+
+/* Bucket a value falls in. */
+static unsigned int hist_index(uint64_t value) {
+  if (value < (1 << HIST_SUB_BITS))
+    return value;
+
+  int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS + 1;
+  return shift * HIST_HALF + (value >> shift);
+}
+
+/* Smallest value in a bucket. */
+static uint64_t hist_lowest(unsigned int index) {
+  if (index < (1 << HIST_SUB_BITS))
+    return index;
+
+  int shift = index / HIST_HALF - 1;
+  return (uint64_t) (index % HIST_HALF + HIST_HALF) << shift;
+}
+
+void hist_init(histogram_t *hist) {
+  memset(hist, 0, sizeof(histogram_t));
+  hist->min = UINT64_MAX;
+}
+
+void hist_record(histogram_t *hist, uint64_t value) {
+  if (value > HIST_LIMIT)
+    value = HIST_LIMIT;
+
+  hist->buckets[hist_index(value)]++;
+  hist->count++;
+  hist->sum += value;
+  if (value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+void hist_merge(histogram_t *dst, const histogram_t *src) {
+  unsigned int i;
+  if (src->count == 0)
+    return;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    dst->buckets[i] += src->buckets[i];
+  dst->count += src->count;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+uint64_t hist_percentile(const histogram_t *hist, double percentile) {
+  if (hist->count == 0)
+    return 0;
+
+  uint64_t rank = (uint64_t) (percentile / 100 * hist->count + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > hist->count)
+    rank = hist->count;
+
+  /* Middle of the bucket the rank falls in, kept within what was seen. */
+  uint64_t seen = 0;
+  unsigned int i;
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  uint64_t low = hist_lowest(i);
+  uint64_t value = low + (hist_lowest(i + 1) - low) / 2;
+  if (value < hist->min)
+    return hist->min;
+  if (value > hist->max)
+    return hist->max;
+  return value;
+}
+
+void hist_print(FILE *file, const char *name, const histogram_t *hist) {
+  unsigned int i;
+  fprintf(file, "  %-12s count %-8lu", name, (unsigned long) hist->count);
+  if (hist->count == 0) {
+    fprintf(file, "\n");
+    return;
+  }
+
+  fprintf(file, " mean %-8lu min %-8lu", (unsigned long) (hist->sum /
+          hist->count), (unsigned long) hist->min);
+  for (i = 0; i < sizeof(print_percentiles) / sizeof(double); i++)
+    fprintf(file, " p%g %-8lu", print_percentiles[i],
+            (unsigned long) hist_percentile(hist, print_percentiles[i]));
+  fprintf(file, " max %lu\n", (unsigned long) hist->max);
+}
@@ -0,0 +1,70 @@
+/******************************************************************************
+ * ctcp_histogram.h
+ * ----------------
+ * Latency histograms in the style of HdrHistogram. Values below
+ * 2^HIST_SUB_BITS are counted exactly; above that, each power of two is split
+ * into 2^(HIST_SUB_BITS - 1) equal buckets, so any value is known to within
+ * about 3%. Recording is a few shifts and an increment, and the histogram is a
+ * fixed size, so it can be kept per connection.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_HISTOGRAM_H
+#define CTCP_HISTOGRAM_H
+
+#include "ctcp_sys.h"
+
+/** Bits of precision kept for each value. */
+#define HIST_SUB_BITS 6
+
+/** Values are recorded up to 2^HIST_MAX_BITS - 1. Larger ones are clamped. */
+#define HIST_MAX_BITS 40
+
+/** Number of buckets. */
+#define HIST_BUCKETS \
+  ((HIST_MAX_BITS - HIST_SUB_BITS + 2) << (HIST_SUB_BITS - 1))
+
+/** A histogram. Initialize with hist_init(). */
+typedef struct {
+  uint64_t count;           /* Values recorded */
+  uint64_t min;             /* Smallest value recorded */
+  uint64_t max;             /* Largest value recorded */
+  uint64_t sum;             /* Sum of the values, for the mean */
+  uint64_t buckets[HIST_BUCKETS];
+} histogram_t;
+
+/**
+ * Empties a histogram.
+ */
+void hist_init(histogram_t *hist);
+
+/**
+ * Records a value.
+ */
+void hist_record(histogram_t *hist, uint64_t value);
+
+/**
+ * Adds all the values recorded in one histogram to another.
+ *
+ * dst: Histogram to add to.
+ * src: Histogram to add.
+ */
+void hist_merge(histogram_t *dst, const histogram_t *src);
+
+/**
+ * Returns the value at the given percentile (0 to 100), or 0 if the histogram
+ * is empty.
+ */
+uint64_t hist_percentile(const histogram_t *hist, double percentile);
+
+/**
+ * Prints a one-line summary of a histogram: count, mean, min, percentiles and
+ * max.
+ *
+ * file: Where to print.
+ * name: Name to start the line with.
+ * hist: The histogram.
+ */
+void hist_print(FILE *file, const char *name, const histogram_t *hist);
+
+#endif /* CTCP_HISTOGRAM_H */
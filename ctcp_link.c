@@ -0,0 +1,521 @@
+#include <math.h>
+
+#include "ctcp_link.h"
+
+/** Shape of the Pareto jitter distribution. */
+#define PARETO_SHAPE 3.0
+
+/**
+ * Packet inside the link. While queued, time is when it was queued. Once it
+ * has been through the bottleneck, time is when it comes out of the link.
+ */
+typedef struct link_pkt {
+  struct link_pkt *next;
+  uint64_t time;
+  size_t len;
+  size_t addr_len;
+  char addr[LINK_MAX_ADDR_SIZE];
+  char buf[];
+} link_pkt_t;
+
+struct link {
+  link_config_t cfg;
+  link_stats_t stats;
+  link_deliver_fn deliver;
+  void *arg;
+
+  uint64_t rng;             /* Random number generator state */
+  bool ge_bad;              /* Gilbert-Elliott model is in the bad state */
+
+  uint64_t tx_free;         /* When the bottleneck is free to send again */
+  uint64_t tx_rem;          /* Leftover from rounding serialization times */
+
+  uint64_t trace_base;      /* Start of the current pass through the trace */
+  unsigned int trace_next;  /* Next delivery opportunity in the trace */
+  size_t trace_sent;        /* Bytes of the head packet already sent */
+
+  link_pkt_t *queue;        /* Packets waiting for the bottleneck */
+  link_pkt_t **queue_tail;
+  unsigned int queue_len;
+
+  link_pkt_t *flight;       /* Packets past the bottleneck, by arrival time */
+  unsigned int flight_len;
+
+  double red_avg;           /* RED average queue length */
+  unsigned int red_count;   /* Packets since the last RED drop */
+
+  bool codel_dropping;      /* CoDel is in the dropping state */
+  uint64_t codel_first_above;/* When the delay will have been high too long */
+  uint64_t codel_drop_next; /* Next drop while in the dropping state */
+  unsigned int codel_count; /* Drops since entering the dropping state */
+  unsigned int codel_lastcount;
+};
+
+
+/* splitmix64. Small, fast and good enough for impairments. */
+static uint64_t link_rand(link_t *link) {
+  uint64_t z = (link->rng += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1). */
+static double link_uniform(link_t *link) {
+  return (link_rand(link) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static bool link_chance(link_t *link, double percent) {
+  return link_uniform(link) * 100 < percent;
+}
+
+static uint64_t link_jitter_delay(link_t *link) {
+  double delay = link->cfg.delay_us;
+  double jitter = link->cfg.jitter_us;
+  double u;
+
+  if (jitter > 0) {
+    switch (link->cfg.jitter_dist) {
+    case LINK_JITTER_UNIFORM:
+      delay += (2 * link_uniform(link) - 1) * jitter;
+      break;
+    case LINK_JITTER_NORMAL:
+      /* Box-Muller. */
+      u = 1 - link_uniform(link);
+      delay += jitter * sqrt(-2 * log(u)) * cos(2 * M_PI * link_uniform(link));
+      break;
+    case LINK_JITTER_PARETO:
+      /* Lomax (shifted Pareto) so the mean extra delay is the jitter. */
+      u = 1 - link_uniform(link);
+      delay += jitter * (PARETO_SHAPE - 1) * (pow(u, -1 / PARETO_SHAPE) - 1);
+      break;
+    }
+  }
+  return delay > 0 ? (uint64_t) delay : 0;
+}
+
+/* Time the bottleneck takes to send len bytes. */
+static uint64_t link_serialize(link_t *link, size_t len) {
+  if (link->cfg.rate_kbps == 0)
+    return 0;
+
+  uint64_t bits = (uint64_t) len * 8 * 1000 + link->tx_rem;
+  link->tx_rem = bits % link->cfg.rate_kbps;
+  return bits / link->cfg.rate_kbps;
+}
+
+/* Gilbert-Elliott loss. Moves the chain along, then decides for this packet. */
+static bool link_lose(link_t *link) {
+  if (link->cfg.ge_p <= 0)
+    return false;
+
+  if (link->ge_bad) {
+    if (link_chance(link, link->cfg.ge_r))
+      link->ge_bad = false;
+  }
+  else if (link_chance(link, link->cfg.ge_p)) {
+    link->ge_bad = true;
+  }
+  return link_chance(link, link->ge_bad ? link->cfg.ge_h : link->cfg.ge_k);
+}
+
+/* Jitter can reorder packets, so keep the in-flight list sorted. */
+static void link_fly(link_t *link, link_pkt_t *pkt) {
+  link_pkt_t **p = &link->flight;
+  while (*p && (*p)->time <= pkt->time)
+    p = &(*p)->next;
+  pkt->next = *p;
+  *p = pkt;
+  link->flight_len++;
+}
+
+/* Time of the next delivery opportunity in the trace. */
+static uint64_t link_trace_time(link_t *link) {
+  return link->trace_base + link->cfg.trace_us[link->trace_next];
+}
+
+static void link_trace_advance(link_t *link) {
+  if (++link->trace_next == link->cfg.trace_len) {
+    link->trace_next = 0;
+    link->trace_base += link->cfg.trace_us[link->cfg.trace_len - 1];
+  }
+}
+
+/* Takes the head packet off the queue and sends it on its way. */
+static link_pkt_t *link_dequeue(link_t *link) {
+  link_pkt_t *pkt = link->queue;
+  link->queue = pkt->next;
+  if (!link->queue)
+    link->queue_tail = &link->queue;
+  link->queue_len--;
+  return pkt;
+}
+
+/* Only packets queued by the given time can leave then. */
+static link_pkt_t *link_head(link_t *link, uint64_t now) {
+  return link->queue && link->queue->time <= now ? link->queue : NULL;
+}
+
+/* RED. Decides whether a packet arriving at the queue is dropped early. */
+static bool link_red_drop(link_t *link) {
+  link_config_t *cfg = &link->cfg;
+  link->red_avg += cfg->red_weight * (link->queue_len - link->red_avg);
+
+  if (link->red_avg < cfg->red_min) {
+    link->red_count = 0;
+    return false;
+  }
+  if (link->red_avg >= cfg->red_max) {
+    link->red_count = 0;
+    return true;
+  }
+
+  /* Spread drops out evenly by raising the probability with the number of
+     packets since the last drop. */
+  double pb = cfg->red_max_p * (link->red_avg - cfg->red_min) /
+              (cfg->red_max - cfg->red_min);
+  double pa = link->red_count * pb >= 1 ? 1 : pb / (1 - link->red_count * pb);
+  if (link_uniform(link) < pa) {
+    link->red_count = 0;
+    return true;
+  }
+  link->red_count++;
+  return false;
+}
+
+/* CoDel. Whether the head packet has been queued too long for too long. */
+static bool link_codel_ok_to_drop(link_t *link, uint64_t now) {
+  link_pkt_t *pkt = link_head(link, now);
+
+  if (pkt == NULL || now - pkt->time < link->cfg.codel_target_us ||
+      link->queue_len <= 1) {
+    link->codel_first_above = 0;
+    return false;
+  }
+  if (link->codel_first_above == 0) {
+    link->codel_first_above = now + link->cfg.codel_interval_us;
+    return false;
+  }
+  return now >= link->codel_first_above;
+}
+
+static uint64_t link_codel_control_law(link_t *link, uint64_t t) {
+  return t + link->cfg.codel_interval_us / sqrt(link->codel_count);
+}
+
+static void link_drop_head(link_t *link) {
+  free(link_dequeue(link));
+  link->stats.dropped_aqm++;
+}
+
+/* Returns the packet at the head of the queue that the bottleneck should
+   send at the given time, after CoDel has dropped what it wants to. */
+static link_pkt_t *link_aqm_head(link_t *link, uint64_t now) {
+  if (link->cfg.aqm != LINK_AQM_CODEL)
+    return link_head(link, now);
+
+  bool ok_to_drop = link_codel_ok_to_drop(link, now);
+  if (link->codel_dropping) {
+    if (!ok_to_drop)
+      link->codel_dropping = false;
+
+    while (link->codel_dropping && now >= link->codel_drop_next) {
+      link_drop_head(link);
+      link->codel_count++;
+      if (!link_head(link, now) || !link_codel_ok_to_drop(link, now))
+        link->codel_dropping = false;
+      else
+        link->codel_drop_next = link_codel_control_law(link,
+                                                       link->codel_drop_next);
+    }
+  }
+  else if (ok_to_drop) {
+    link_drop_head(link);
+    link->codel_dropping = true;
+
+    /* Go back to roughly the previous drop rate if the last dropping state
+       was recent. */
+    unsigned int delta = link->codel_count - link->codel_lastcount;
+    if (delta > 1 && now - link->codel_drop_next <
+        16 * (uint64_t) link->cfg.codel_interval_us)
+      link->codel_count = delta;
+    else
+      link->codel_count = 1;
+    link->codel_drop_next = link_codel_control_law(link, now);
+    link->codel_lastcount = link->codel_count;
+  }
+  return link_head(link, now);
+}
+
+/* Trace-driven bottleneck. Each opportunity can send LINK_TRACE_MTU bytes of
+   whatever was queued by then. Large packets take several opportunities, and
+   bytes not used at an opportunity are lost, like in Mahimahi. */
+static void link_serve_trace(link_t *link, uint64_t now) {
+  uint64_t period = link->cfg.trace_us[link->cfg.trace_len - 1];
+  link_pkt_t *pkt;
+
+  while ((pkt = link->queue) && link_trace_time(link) <= now) {
+    uint64_t t = link_trace_time(link);
+
+    /* Nothing queued yet at this opportunity. Skip whole passes through the
+       trace if the link sat idle for a while. */
+    if (pkt->time > t) {
+      if (pkt->time - t > period)
+        link->trace_base += (pkt->time - t) / period * period;
+      while (link_trace_time(link) < pkt->time)
+        link_trace_advance(link);
+      continue;
+    }
+
+    size_t budget = LINK_TRACE_MTU;
+    while (budget > 0) {
+      pkt = link->trace_sent == 0 ? link_aqm_head(link, t) : link->queue;
+      if (pkt == NULL)
+        break;
+
+      size_t left = pkt->len - link->trace_sent;
+      if (left > budget) {
+        link->trace_sent += budget;
+        break;
+      }
+
+      budget -= left;
+      link->trace_sent = 0;
+      link_dequeue(link);
+      pkt->time = t + link_jitter_delay(link);
+      link_fly(link, pkt);
+    }
+    link_trace_advance(link);
+  }
+}
+
+/* Puts every packet whose turn at the bottleneck has come through it. */
+static void link_serve(link_t *link, uint64_t now) {
+  link_pkt_t *pkt;
+
+  if (link->cfg.trace_us != NULL) {
+    link_serve_trace(link, now);
+    return;
+  }
+
+  while ((pkt = link->queue) && link->tx_free <= now) {
+    uint64_t start = pkt->time > link->tx_free ? pkt->time : link->tx_free;
+    if ((pkt = link_aqm_head(link, start)) == NULL)
+      continue;
+
+    link_dequeue(link);
+    link->tx_free = start + link_serialize(link, pkt->len);
+    pkt->time = link->tx_free + link_jitter_delay(link);
+    link_fly(link, pkt);
+  }
+}
+
+int link_parse_gemodel(const char *spec, link_config_t *cfg) {
+  double v[4] = { 0, -1, 100, 0 };
+  int n = sscanf(spec, "%lf,%lf,%lf,%lf", &v[0], &v[1], &v[2], &v[3]);
+  int i;
+
+  if (n < 1)
+    return -1;
+  if (n < 2)
+    v[1] = 100 - v[0];
+  for (i = 0; i < 4; i++) {
+    if (v[i] < 0 || v[i] > 100)
+      return -1;
+  }
+
+  cfg->ge_p = v[0];
+  cfg->ge_r = v[1];
+  cfg->ge_h = v[2];
+  cfg->ge_k = v[3];
+  return 0;
+}
+
+int link_load_trace(const char *path, link_config_t *cfg) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL)
+    return -1;
+
+  unsigned int size = 1024, len = 0;
+  uint64_t *trace = malloc(size * sizeof(uint64_t));
+  unsigned long ms;
+  while (fscanf(f, "%lu", &ms) == 1) {
+    if (len == size) {
+      size *= 2;
+      trace = realloc(trace, size * sizeof(uint64_t));
+    }
+    trace[len] = (uint64_t) ms * 1000;
+
+    /* Times have to be in order. */
+    if (len > 0 && trace[len] < trace[len - 1])
+      break;
+    len++;
+  }
+
+  bool ok = feof(f) && len > 0 && trace[len - 1] > 0;
+  fclose(f);
+  if (!ok) {
+    free(trace);
+    return -1;
+  }
+
+  cfg->trace_us = trace;
+  cfg->trace_len = len;
+  return 0;
+}
+
+int link_parse_aqm(const char *name, link_aqm_t *aqm) {
+  if (strcmp(name, "droptail") == 0)
+    *aqm = LINK_AQM_DROPTAIL;
+  else if (strcmp(name, "red") == 0)
+    *aqm = LINK_AQM_RED;
+  else if (strcmp(name, "codel") == 0)
+    *aqm = LINK_AQM_CODEL;
+  else
+    return -1;
+  return 0;
+}
+
+int link_parse_jitter_dist(const char *name, link_jitter_t *dist) {
+  if (strcmp(name, "uniform") == 0)
+    *dist = LINK_JITTER_UNIFORM;
+  else if (strcmp(name, "normal") == 0)
+    *dist = LINK_JITTER_NORMAL;
+  else if (strcmp(name, "pareto") == 0)
+    *dist = LINK_JITTER_PARETO;
+  else
+    return -1;
+  return 0;
+}
+
+link_t *link_create(const link_config_t *cfg, uint32_t seed,
+                    link_deliver_fn deliver, void *arg, uint64_t now) {
+  link_t *link = calloc(sizeof(link_t), 1);
+  link->cfg = *cfg;
+  if (link->cfg.queue_limit == 0)
+    link->cfg.queue_limit = LINK_DEFAULT_QUEUE;
+
+  /* Queue management defaults. */
+  link_config_t *c = &link->cfg;
+  if (c->red_min == 0)
+    c->red_min = c->queue_limit / 10 > 5 ? c->queue_limit / 10 : 5;
+  if (c->red_max <= c->red_min)
+    c->red_max = 3 * c->red_min < c->queue_limit ? 3 * c->red_min :
+                 c->queue_limit;
+  if (c->red_max <= c->red_min)
+    c->red_max = c->red_min + 1;
+  if (c->red_max_p <= 0)
+    c->red_max_p = LINK_RED_MAX_P;
+  if (c->red_weight <= 0)
+    c->red_weight = LINK_RED_WEIGHT;
+  if (c->codel_target_us == 0)
+    c->codel_target_us = LINK_CODEL_TARGET;
+  if (c->codel_interval_us == 0)
+    c->codel_interval_us = LINK_CODEL_INTERVAL;
+  link->deliver = deliver;
+  link->arg = arg;
+  link->rng = seed;
+  link->tx_free = now;
+  link->trace_base = now;
+  link->queue_tail = &link->queue;
+  return link;
+}
+
+void link_destroy(link_t *link) {
+  link_pkt_t *pkt, *next;
+  if (link == NULL)
+    return;
+
+  for (pkt = link->queue; pkt; pkt = next) {
+    next = pkt->next;
+    free(pkt);
+  }
+  for (pkt = link->flight; pkt; pkt = next) {
+    next = pkt->next;
+    free(pkt);
+  }
+  free(link);
+}
+
+int link_send(link_t *link, const void *buf, size_t len, const void *addr,
+              size_t addr_len, uint64_t now) {
+  assert(addr_len <= LINK_MAX_ADDR_SIZE);
+  link_run(link, now);
+
+  if (link_lose(link)) {
+    link->stats.dropped_loss++;
+    return -1;
+  }
+  if (link->cfg.aqm == LINK_AQM_RED && link_red_drop(link)) {
+    link->stats.dropped_aqm++;
+    return -1;
+  }
+  if (link->queue_len >= link->cfg.queue_limit) {
+    link->stats.dropped_queue++;
+    return -1;
+  }
+
+  link_pkt_t *pkt = malloc(sizeof(link_pkt_t) + len);
+  pkt->next = NULL;
+  pkt->time = now;
+  pkt->len = len;
+  pkt->addr_len = addr_len;
+  memcpy(pkt->addr, addr, addr_len);
+  memcpy(pkt->buf, buf, len);
+
+  *link->queue_tail = pkt;
+  link->queue_tail = &pkt->next;
+  link->queue_len++;
+  link->stats.enqueued++;
+
+  link_run(link, now);
+  return 0;
+}
+
+void link_run(link_t *link, uint64_t now) {
+  link_pkt_t *pkt;
+  link_serve(link, now);
+
+  while ((pkt = link->flight) && pkt->time <= now) {
+    link->flight = pkt->next;
+    link->flight_len--;
+
+    link->stats.delivered++;
+    link->stats.bytes_delivered += pkt->len;
+    link->deliver(link->arg, pkt->addr, pkt->addr_len, pkt->buf, pkt->len);
+    free(pkt);
+  }
+}
+
+long link_next_event(link_t *link, uint64_t now) {
+  uint64_t next = UINT64_MAX;
+
+  if (link->flight)
+    next = link->flight->time;
+  if (link->queue) {
+    uint64_t start;
+    if (link->cfg.trace_us != NULL)
+      start = link_trace_time(link);
+    else
+      start = link->queue->time > link->tx_free ?
+              link->queue->time : link->tx_free;
+    if (start < next)
+      next = start;
+  }
+
+  if (next == UINT64_MAX)
+    return -1;
+  return next <= now ? 0 : (long) (next - now);
+}
+
+unsigned int link_pending(link_t *link) {
+  return link->queue_len + link->flight_len;
+}
+
+unsigned int link_queue_length(link_t *link) {
+  return link->queue_len;
+}
+
+const link_stats_t *link_get_stats(link_t *link) {
+  return &link->stats;
+}
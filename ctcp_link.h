@@ -0,0 +1,221 @@
+/******************************************************************************
+ * ctcp_link.h
+ * -----------
+ * Emulated network link. Segments leaving a host can be passed through a link
+ * instead of going straight to the socket. The link models a bottleneck with a
+ * fixed rate, a bounded drop-tail queue, propagation delay with jitter, and
+ * Gilbert-Elliott bursty loss. All randomness comes from the link's own seeded
+ * generator, so runs with the same seed see the same impairments.
+ *
+ * Instead of a fixed rate, the bottleneck can also follow a recorded trace of
+ * delivery opportunities (in the Mahimahi format), which replays the capacity
+ * of a real cellular or Wi-Fi link.
+ *
+ * The queue in front of the bottleneck is drop-tail by default, or can be
+ * managed by RED or CoDel.
+ *
+ * All times are in microseconds and are passed in by the caller, so the link
+ * does not care where the clock comes from.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LINK_H
+#define CTCP_LINK_H
+
+#include "ctcp_sys.h"
+
+/** Default queue limit, in packets (same as netem). */
+#define LINK_DEFAULT_QUEUE 1000
+
+/** Largest destination address a link can hold for a packet. */
+#define LINK_MAX_ADDR_SIZE sizeof(struct sockaddr_storage)
+
+/** Bytes that can go through the link at each opportunity in a trace (the
+    packet size Mahimahi traces are recorded with). */
+#define LINK_TRACE_MTU 1504
+
+/** CoDel defaults (RFC 8289), in microseconds. */
+#define LINK_CODEL_TARGET 5000
+#define LINK_CODEL_INTERVAL 100000
+
+/** RED defaults. */
+#define LINK_RED_MAX_P 0.1
+#define LINK_RED_WEIGHT 0.002
+
+/** Queue management at the bottleneck. */
+typedef enum {
+  LINK_AQM_DROPTAIL,        /* Only drop when the queue is full */
+  LINK_AQM_RED,             /* Random Early Detection, on the average length */
+  LINK_AQM_CODEL            /* Controlled Delay, on the time spent queued */
+} link_aqm_t;
+
+/** Jitter distributions. */
+typedef enum {
+  LINK_JITTER_UNIFORM,      /* Uniform in [-jitter, +jitter] */
+  LINK_JITTER_NORMAL,       /* Normal with standard deviation jitter */
+  LINK_JITTER_PARETO        /* Pareto (heavy tail) extra delay, mean jitter */
+} link_jitter_t;
+
+/** Link configuration. A zeroed struct is a link that does nothing. */
+typedef struct {
+  uint32_t rate_kbps;       /* Bottleneck rate in kbit/s, 0 for unlimited */
+  uint32_t delay_us;        /* One-way propagation delay */
+  uint32_t jitter_us;       /* Delay variation, see jitter_dist */
+  link_jitter_t jitter_dist;/* Distribution of the delay variation */
+  uint32_t queue_limit;     /* Maximum packets waiting for the bottleneck,
+                               0 for LINK_DEFAULT_QUEUE */
+
+  /* Queue management. Parameters left at 0 get defaults: RED thresholds are
+     derived from the queue limit, CoDel uses the RFC 8289 values. */
+  link_aqm_t aqm;           /* Queue management algorithm */
+  uint32_t red_min;         /* RED minimum threshold, in packets */
+  uint32_t red_max;         /* RED maximum threshold, in packets */
+  double red_max_p;         /* RED drop probability at red_max */
+  double red_weight;        /* RED weight of the average queue length */
+  uint32_t codel_target_us; /* CoDel acceptable standing delay */
+  uint32_t codel_interval_us;/* CoDel window for the minimum delay */
+
+  /* Delivery trace. If set, the bottleneck sends LINK_TRACE_MTU bytes at each
+     of these times (relative to when the link was created) instead of running
+     at rate_kbps. The trace repeats once the last time is reached. */
+  uint64_t *trace_us;       /* Delivery opportunities, in order */
+  unsigned int trace_len;   /* Number of opportunities */
+
+  /* Gilbert-Elliott loss, in percent (as in netem's gemodel). Off if ge_p is
+     0. ge_h is the loss probability in the bad state (1-h), ge_k the loss
+     probability in the good state (1-k). */
+  double ge_p;              /* Good to bad transition probability */
+  double ge_r;              /* Bad to good transition probability */
+  double ge_h;              /* Loss probability in the bad state */
+  double ge_k;              /* Loss probability in the good state */
+} link_config_t;
+
+/** Counters kept by a link. */
+typedef struct {
+  uint64_t enqueued;        /* Packets accepted into the queue */
+  uint64_t delivered;       /* Packets handed to the deliver function */
+  uint64_t dropped_queue;   /* Packets dropped because the queue was full */
+  uint64_t dropped_loss;    /* Packets dropped by the loss model */
+  uint64_t dropped_aqm;     /* Packets dropped early by RED or CoDel */
+  uint64_t bytes_delivered; /* Bytes handed to the deliver function */
+} link_stats_t;
+
+/**
+ * Called by the link when a packet comes out the other end.
+ *
+ * arg: The argument given to link_create().
+ * addr: Destination address given to link_send().
+ * addr_len: Length of the destination address.
+ * buf: The packet.
+ * len: Length of the packet.
+ */
+typedef void (*link_deliver_fn)(void *arg, const void *addr, size_t addr_len,
+                                const void *buf, size_t len);
+
+typedef struct link link_t;
+
+/**
+ * Parses a Gilbert-Elliott loss specification of the form p[,r[,1-h[,1-k]]]
+ * (all in percent, like netem) into the given config. If r is left out it is
+ * 100 - p, 1-h defaults to 100 and 1-k to 0.
+ *
+ * spec: The specification string.
+ * cfg: Config to fill in.
+ * returns: 0 on success, -1 if the specification is invalid.
+ */
+int link_parse_gemodel(const char *spec, link_config_t *cfg);
+
+/**
+ * Loads a delivery trace into the given config. The file has one delivery
+ * opportunity per line, as a time in milliseconds (Mahimahi's format). Lines
+ * must be in order and the last time must be greater than 0, since it is the
+ * period of the trace. The trace is owned by the config's user and is not
+ * freed by link_destroy().
+ *
+ * path: Path to the trace file.
+ * cfg: Config to fill in.
+ * returns: 0 on success, -1 if the file cannot be read or is not a trace.
+ */
+int link_load_trace(const char *path, link_config_t *cfg);
+
+/**
+ * Parses the name of a queue management algorithm ("droptail", "red",
+ * "codel").
+ *
+ * name: Name of the algorithm.
+ * aqm: Return parameter.
+ * returns: 0 on success, -1 if the name is unknown.
+ */
+int link_parse_aqm(const char *name, link_aqm_t *aqm);
+
+/**
+ * Parses the name of a jitter distribution ("uniform", "normal", "pareto").
+ *
+ * name: Name of the distribution.
+ * dist: Return parameter.
+ * returns: 0 on success, -1 if the name is unknown.
+ */
+int link_parse_jitter_dist(const char *name, link_jitter_t *dist);
+
+/**
+ * Creates a link. Must be freed with link_destroy().
+ *
+ * cfg: Link configuration. Copied.
+ * seed: Seed for the link's random number generator.
+ * deliver: Function called for every packet leaving the link.
+ * arg: Passed to deliver.
+ * now: Current time.
+ * returns: The new link.
+ */
+link_t *link_create(const link_config_t *cfg, uint32_t seed,
+                    link_deliver_fn deliver, void *arg, uint64_t now);
+
+/**
+ * Destroys a link. Packets still in the link are dropped.
+ */
+void link_destroy(link_t *link);
+
+/**
+ * Puts a packet into the link. The packet and address are copied. It might be
+ * dropped by the loss model or because the queue is full, and might come out
+ * straight away (from within this call) if the link has no rate or delay.
+ *
+ * link: The link.
+ * buf: The packet.
+ * len: Length of the packet.
+ * addr: Destination address, handed back to the deliver function.
+ * addr_len: Length of addr. At most LINK_MAX_ADDR_SIZE.
+ * now: Current time.
+ * returns: 0 if the packet was queued, -1 if it was dropped.
+ */
+int link_send(link_t *link, const void *buf, size_t len, const void *addr,
+              size_t addr_len, uint64_t now);
+
+/**
+ * Moves the link forward to the given time, delivering every packet that has
+ * arrived by then.
+ */
+void link_run(link_t *link, uint64_t now);
+
+/**
+ * Returns the number of microseconds until the link next has something to do,
+ * 0 if it is overdue, or -1 if the link is empty.
+ */
+long link_next_event(link_t *link, uint64_t now);
+
+/**
+ * Returns the number of packets still inside the link (queued or in flight).
+ */
+unsigned int link_pending(link_t *link);
+
+/**
+ * Returns the number of packets waiting for the bottleneck.
+ */
+unsigned int link_queue_length(link_t *link);
+
+/**
+ * Returns the link's counters.
+ */
+const link_stats_t *link_get_stats(link_t *link);
+
+#endif /* CTCP_LINK_H */
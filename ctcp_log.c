@@ -0,0 +1,194 @@
+#include <pthread.h>
+
+#include "ctcp_log.h"
+#include "ctcp_utils.h"
+
+#define LOCALHOST_STR "localhost"
+
+/** Set in a process forked off after the writer thread started. Checked
+    instead of getpid(), which is a system call. */
+static bool forked = false;
+
+struct logger {
+  int file;
+  bool headers_only;
+  unsigned int sample;
+  uint64_t seen;               /* Segments offered, for sampling */
+  uint64_t dropped;
+  pthread_t thread;
+  bool stop;                   /* Tells the writer to finish up */
+
+  /* Written by the main loop, read by the writer, and the other way around.
+     Kept apart so they don't share a cache line. */
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  log_entry_t ring[LOG_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* Writes all of a buffer. */
+static void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w <= 0)
+      return;
+    buf += w;
+    len -= w;
+  }
+}
+
+void log_fill(log_entry_t *entry, in_addr_t ip_addr, int port,
+              in_addr_t other_ip, int other_port, ctcp_segment_t *segment,
+              bool is_sent_segment, bool is_unix_socket, bool with_data) {
+  entry->time = current_time();
+  entry->src_ip = is_sent_segment ? ip_addr : other_ip;
+  entry->src_port = is_sent_segment ? port : other_port;
+  entry->dst_ip = is_sent_segment ? other_ip : ip_addr;
+  entry->dst_port = is_sent_segment ? other_port : port;
+  entry->unix_socket = is_unix_socket;
+  entry->seqno = ntohl(segment->seqno);
+  entry->ackno = ntohl(segment->ackno);
+  entry->len = ntohs(segment->len);
+  entry->flags = segment->flags;
+  entry->window = ntohs(segment->window);
+  entry->cksum = segment->cksum;
+
+  int data_len = with_data ? entry->len - (int) sizeof(ctcp_segment_t) : 0;
+  if (data_len < 0)
+    data_len = 0;
+  entry->truncated = data_len > LOG_MAX_DATA;
+  if (entry->truncated)
+    data_len = LOG_MAX_DATA;
+  entry->data_len = data_len;
+  memcpy(entry->data, segment->data, data_len);
+}
+
+size_t log_format(const log_entry_t *entry, char *buf, bool with_data) {
+  static const char hex[] = "0123456789abcdef";
+  char src[INET_ADDRSTRLEN] = LOCALHOST_STR, dst[INET_ADDRSTRLEN] =
+    LOCALHOST_STR;
+  if (!entry->unix_socket) {
+    inet_ntop(AF_INET, &entry->src_ip, src, sizeof(src));
+    inet_ntop(AF_INET, &entry->dst_ip, dst, sizeof(dst));
+  }
+
+  int n = snprintf(buf, LOG_MAX_LINE, "%lu\t%s\t%d\t%s\t%d\t%d\t%d\t%d\t%s%s%s"
+                   "\t%d\t0x%x", entry->time, src, entry->src_port, dst,
+                   entry->dst_port, entry->seqno, entry->ackno, entry->len,
+                   (entry->flags & TH_SYN) ? "SYN " : "",
+                   (entry->flags & TH_ACK) ? "ACK " : "",
+                   (entry->flags & TH_FIN) ? "FIN " : "",
+                   entry->window, entry->cksum);
+  if (!with_data)
+    return n;
+
+  /* Data as hex. */
+  char *p = buf + n;
+  int i;
+  *p++ = '\t';
+  for (i = 0; i < entry->data_len; i++) {
+    *p++ = hex[entry->data[i] >> 4];
+    *p++ = hex[entry->data[i] & 0xf];
+    *p++ = ' ';
+  }
+  if (entry->truncated) {
+    memcpy(p, "...", 3);
+    p += 3;
+  }
+  *p++ = '\n';
+  *p = '\0';
+  return p - buf;
+}
+
+static void set_forked() {
+  forked = true;
+}
+
+static void watch_fork() {
+  pthread_atfork(NULL, NULL, set_forked);
+}
+
+/* Writer thread. Formats entries as they come and writes them out in
+   batches. */
+static void *logger_main(void *arg) {
+  logger_t *logger = arg;
+  char *batch = malloc(LOG_BATCH_SIZE);
+  uint64_t tail = logger->tail;
+
+  while (true) {
+    uint64_t head = __atomic_load_n(&logger->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+      if (__atomic_load_n(&logger->stop, __ATOMIC_ACQUIRE))
+        break;
+      usleep(LOG_IDLE_US);
+      continue;
+    }
+
+    size_t used = 0;
+    for (; tail != head; tail++) {
+      if (used + LOG_MAX_LINE > LOG_BATCH_SIZE) {
+        write_all(logger->file, batch, used);
+        used = 0;
+      }
+      used += log_format(&logger->ring[tail % LOG_RING_SIZE], batch + used,
+                         true);
+      __atomic_store_n(&logger->tail, tail + 1, __ATOMIC_RELEASE);
+    }
+    write_all(logger->file, batch, used);
+  }
+
+  free(batch);
+  return NULL;
+}
+
+logger_t *logger_create(int file, bool headers_only, unsigned int sample) {
+  logger_t *logger = calloc(sizeof(logger_t), 1);
+  logger->file = file;
+  logger->headers_only = headers_only;
+  logger->sample = sample > 0 ? sample : 1;
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, watch_fork);
+  pthread_create(&logger->thread, NULL, logger_main, logger);
+  return logger;
+}
+
+void logger_segment(logger_t *logger, in_addr_t ip_addr, int port,
+                    in_addr_t other_ip, int other_port,
+                    ctcp_segment_t *segment, bool is_sent_segment,
+                    bool is_unix_socket) {
+  if (logger->seen++ % logger->sample != 0)
+    return;
+
+  /* Forked process (see conn_send). Threads don't survive a fork. */
+  if (forked) {
+    log_entry_t entry;
+    char line[LOG_MAX_LINE];
+    log_fill(&entry, ip_addr, port, other_ip, other_port, segment,
+             is_sent_segment, is_unix_socket, !logger->headers_only);
+    write_all(logger->file, line, log_format(&entry, line, true));
+    return;
+  }
+
+  uint64_t head = logger->head;
+  if (head - __atomic_load_n(&logger->tail, __ATOMIC_ACQUIRE) ==
+      LOG_RING_SIZE) {
+    logger->dropped++;
+    return;
+  }
+  log_fill(&logger->ring[head % LOG_RING_SIZE], ip_addr, port, other_ip,
+           other_port, segment, is_sent_segment, is_unix_socket,
+           !logger->headers_only);
+  __atomic_store_n(&logger->head, head + 1, __ATOMIC_RELEASE);
+}
+
+uint64_t logger_dropped(logger_t *logger) {
+  return logger->dropped;
+}
+
+void logger_close(logger_t *logger) {
+  if (forked)
+    return;
+
+  __atomic_store_n(&logger->stop, true, __ATOMIC_RELEASE);
+  pthread_join(logger->thread, NULL);
+  free(logger);
+}
@@ -0,0 +1,121 @@
+/******************************************************************************
+ * ctcp_log.h
+ * ----------
+ * Segment logging (-l). Each segment is captured into a fixed-size binary
+ * entry, which is later formatted into a line of the log:
+ *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
+ *
+ * The logger keeps entries in a lock-free ring with one producer (the main
+ * loop) and one consumer (a writer thread), which formats them and writes them
+ * out in batches. Logging a segment is then a copy into the ring. If the ring
+ * is full, the segment is counted as dropped rather than waiting for the
+ * writer. Segments can also be sampled, or logged without their data.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LOG_H
+#define CTCP_LOG_H
+
+#include "ctcp_sys.h"
+
+/** Most data kept for a segment. Larger segments (see conn_mss()) have
+    their data cut short, and the data column of their line ends in "...".
+    Entries are this size whatever the connection's MSS, so the ring stays
+    small. */
+#define LOG_MAX_DATA 1440
+
+/** Longest line an entry formats to: the fields, plus 3 characters for each
+    byte of data. */
+#define LOG_MAX_LINE (256 + 3 * LOG_MAX_DATA)
+
+/** Entries in the ring. Must be a power of 2. */
+#define LOG_RING_SIZE 1024
+
+/** Size of the batches the writer thread writes out. */
+#define LOG_BATCH_SIZE (1 << 16)
+
+/** How long the writer sleeps when there is nothing to write, in
+    microseconds. */
+#define LOG_IDLE_US 1000
+
+/** A logged segment. */
+typedef struct {
+  long time;                   /* current_time() when it was logged */
+  in_addr_t src_ip;            /* Sender and receiver */
+  int src_port;
+  in_addr_t dst_ip;
+  int dst_port;
+  bool unix_socket;            /* Addresses are shown as localhost */
+  uint32_t seqno;              /* Header fields, in host order */
+  uint32_t ackno;
+  uint16_t len;
+  uint32_t flags;              /* As in the segment */
+  uint16_t window;
+  uint16_t cksum;              /* As in the segment */
+  uint16_t data_len;           /* Bytes of data kept */
+  bool truncated;              /* Data was cut short at LOG_MAX_DATA */
+  unsigned char data[LOG_MAX_DATA];
+} log_entry_t;
+
+/** Asynchronous logger. */
+typedef struct logger logger_t;
+
+/**
+ * Fills in an entry for a segment.
+ *
+ * entry: The entry.
+ * ip_addr, port: The logger's address and port.
+ * other_ip, other_port: The other end's address and port.
+ * segment: The segment, in network order.
+ * is_sent_segment: Whether or not the logger sent the segment.
+ * is_unix_socket: Whether or not the connection is via a Unix socket.
+ * with_data: Whether to keep the segment's data.
+ */
+void log_fill(log_entry_t *entry, in_addr_t ip_addr, int port,
+              in_addr_t other_ip, int other_port, ctcp_segment_t *segment,
+              bool is_sent_segment, bool is_unix_socket, bool with_data);
+
+/**
+ * Formats an entry as a line of the log.
+ *
+ * entry: The entry.
+ * buf: Buffer of at least LOG_MAX_LINE bytes.
+ * with_data: Whether to add the data column and the newline.
+ * returns: Length of the line.
+ */
+size_t log_format(const log_entry_t *entry, char *buf, bool with_data);
+
+/**
+ * Starts a logger and its writer thread.
+ *
+ * file: File to write to.
+ * headers_only: Log segments without their data.
+ * sample: Log one segment in this many (1 for every segment).
+ * returns: The logger.
+ */
+logger_t *logger_create(int file, bool headers_only, unsigned int sample);
+
+/**
+ * Logs a segment. Never blocks: if the ring is full, the segment is dropped
+ * from the log. A forked process has no writer thread, so it writes the line
+ * itself.
+ *
+ * Parameters are as for log_fill().
+ */
+void logger_segment(logger_t *logger, in_addr_t ip_addr, int port,
+                    in_addr_t other_ip, int other_port,
+                    ctcp_segment_t *segment, bool is_sent_segment,
+                    bool is_unix_socket);
+
+/**
+ * Returns the number of segments dropped because the ring was full.
+ */
+uint64_t logger_dropped(logger_t *logger);
+
+/**
+ * Writes out everything in the ring, stops the writer thread and frees the
+ * logger.
+ */
+void logger_close(logger_t *logger);
+
+#endif /* CTCP_LOG_H */
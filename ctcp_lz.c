@@ -0,0 +1,144 @@
+#include "ctcp_lz.h"
+
+static uint32_t read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash32(uint32_t v) {
+  return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Space a length of len past a nibble takes in extra bytes. */
+static size_t length_bytes(size_t len) {
+  return len < 15 ? 0 : (len - 15) / 255 + 1;
+}
+
+/* Writes the extra bytes of a length past its nibble. */
+static uint8_t *put_length(uint8_t *op, size_t len) {
+  if (len < 15)
+    return op;
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* Writes a sequence: the literals from anchor, then a match of match_len (0
+   for the last sequence) at offset. Returns the end, or NULL if it doesn't
+   fit. */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor,
+                             size_t lit_len, size_t offset, size_t match_len) {
+  size_t m = match_len ? match_len - LZ_MIN_MATCH : 0;
+  size_t need = 1 + length_bytes(lit_len) + lit_len +
+                (match_len ? 2 + length_bytes(m) : 0);
+  if (need > (size_t) (oend - op))
+    return NULL;
+
+  *op++ = (lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15);
+  op = put_length(op, lit_len);
+  memcpy(op, anchor, lit_len);
+  op += lit_len;
+  if (match_len) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    op = put_length(op, m);
+  }
+  return op;
+}
+
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t dst_len) {
+  uint16_t table[1 << LZ_HASH_BITS];
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_len;
+
+  if (len > LZ_MAX_BLOCK)
+    return 0;
+  memset(table, 0, sizeof(table));
+
+  while (ip + LZ_MIN_MATCH <= end) {
+    uint32_t v = read32(ip);
+    uint32_t h = hash32(v);
+    const uint8_t *ref = src + table[h];
+    table[h] = ip - src;
+    if (ref >= ip || read32(ref) != v) {
+      ip++;
+      continue;
+    }
+
+    const uint8_t *m = ip + LZ_MIN_MATCH;
+    ref += LZ_MIN_MATCH;
+    while (m < end && *m == *ref) {
+      m++;
+      ref++;
+    }
+    op = put_sequence(op, oend, anchor, ip - anchor, m - ref, m - ip);
+    if (op == NULL)
+      return 0;
+    ip = anchor = m;
+  }
+
+  op = put_sequence(op, oend, anchor, end - anchor, 0, 0);
+  return op ? op - dst : 0;
+}
+
+/* Reads the extra bytes of a length past its nibble. Returns -1 if they run
+   past the end. */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+  uint8_t b;
+  if (*len < 15)
+    return 0;
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                  size_t dst_len) {
+  const uint8_t *ip = src;
+  const uint8_t *iend = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + dst_len;
+
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t lit_len = token >> 4;
+    if (get_length(&ip, iend, &lit_len) < 0 ||
+        lit_len > (size_t) (iend - ip) || lit_len > (size_t) (oend - op))
+      return -1;
+    memcpy(op, ip, lit_len);
+    ip += lit_len;
+    op += lit_len;
+
+    /* The last sequence. */
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t match_len = token & 15;
+    if (get_length(&ip, iend, &match_len) < 0)
+      return -1;
+    match_len += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t) (op - dst) ||
+        match_len > (size_t) (oend - op))
+      return -1;
+
+    /* Byte by byte, since the match can overlap what it writes. */
+    const uint8_t *ref = op - offset;
+    while (match_len--)
+      *op++ = *ref++;
+  }
+  return op - dst;
+}
@@ -0,0 +1,59 @@
+/******************************************************************************
+ * ctcp_lz.h
+ * ---------
+ * A small LZ77 block codec in the style of LZ4, for --compress. Each block is
+ * compressed on its own, so blocks can be decompressed as they arrive.
+ *
+ * A block is a run of sequences. Each starts with a token byte: the high four
+ * bits are the number of literals, the low four the match length less
+ * LZ_MIN_MATCH. A nibble of 15 is followed by more bytes of length, each
+ * added on, up to the first that isn't 255. Then come the literals, then the
+ * match's offset back into the output as 2 bytes, least significant first.
+ * The last sequence has only literals.
+ *
+ * Matches are found through a hash table of the last position each 4 bytes
+ * were seen at, with no search beyond that, so compression is a single quick
+ * pass.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_LZ_H
+#define CTCP_LZ_H
+
+#include "ctcp_sys.h"
+
+/** Shortest match that is encoded. */
+#define LZ_MIN_MATCH 4
+
+/** Size of the hash table, as a power of two. */
+#define LZ_HASH_BITS 12
+
+/** Largest block that can be compressed, since offsets are 16 bits. */
+#define LZ_MAX_BLOCK 65535
+
+/**
+ * Compresses a block.
+ *
+ * src: The block.
+ * len: Its length, at most LZ_MAX_BLOCK.
+ * dst: Where to put the compressed block.
+ * dst_len: Space there. Pass less than len to only compress if it saves
+ *          something.
+ * returns: Length of the compressed block, or 0 if it doesn't fit.
+ */
+size_t lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                   size_t dst_len);
+
+/**
+ * Decompresses a block.
+ *
+ * src: The compressed block.
+ * len: Its length.
+ * dst: Where to put the block.
+ * dst_len: Space there.
+ * returns: Length of the block, or -1 if it is corrupt or doesn't fit.
+ */
+int lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                  size_t dst_len);
+
+#endif /* CTCP_LZ_H */
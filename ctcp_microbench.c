@@ -0,0 +1,407 @@
+/******************************************************************************
+ * ctcp_microbench.c
+ * -----------------
+ * Microbenchmarks for the functions every segment goes through: checksums,
+ * building and converting segments, logging, and the linked list. Reports
+ * ns/op and bytes/cycle for a range of payload sizes.
+ *
+ * Each benchmark is run with enough iterations to take --min-time, and that
+ * is repeated --reps times; the median is reported. The process is pinned to
+ * one CPU so the cycle counter and caches stay put.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <sched.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+/* Most of the library's helpers are static or defined in its header, and the
+   segment state is private to ctcp.c, so both are pulled in whole. The
+   library's main() is renamed out of the way. */
+#define main ctcp_sys_main
+#include "ctcp_sys_internal.c"
+#undef main
+#include "ctcp.c"
+
+/** Most payload sizes that can be given. */
+#define MAX_SIZES 16
+
+/** Elements in the list for the ll_find benchmark. */
+#define LL_FIND_LEN 64
+
+/** A benchmark. run() does iters operations on a payload of len bytes. */
+typedef struct {
+  const char *name;
+  bool sized;                  /* Whether the payload size matters */
+  void (*run)(size_t len, uint64_t iters);
+} bench_t;
+
+/** Keeps results alive so the work isn't optimized away. */
+static volatile uintptr_t sink;
+
+/* Fixtures shared by the benchmarks. */
+static struct config bench_config;
+static conn_t bench_conn;
+static ctcp_config_t bench_ctcp_cfg;
+static ctcp_state_t *bench_state;
+static char bench_data[MAX_LOCAL_SEG_DATA_SIZE];
+static int null_fd;
+
+
+/* A segment in network order, as handed to conn_send(). */
+static ctcp_segment_t *bench_segment(size_t len) {
+  bench_state->inputSize = len;
+  return make_segment(bench_state, len ? bench_data : NULL, ACK);
+}
+
+static void run_cksum(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  size_t seg_len = sizeof(ctcp_segment_t) + len;
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += cksum(segment, seg_len);
+  free(segment);
+}
+
+static void run_make_segment(size_t len, uint64_t iters) {
+  uint64_t i;
+  bench_state->inputSize = len;
+  for (i = 0; i < iters; i++) {
+    ctcp_segment_t *segment = make_segment(bench_state,
+                                           len ? bench_data : NULL, ACK);
+    sink += segment->cksum;
+    free(segment);
+  }
+}
+
+static void run_network_order(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    convert_to_network_order(segment);
+  sink += segment->seqno;
+  free(segment);
+}
+
+static void run_host_order(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    convert_to_host_order(segment);
+  sink += segment->seqno;
+  free(segment);
+}
+
+static void run_to_datagram(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  size_t seg_len = sizeof(ctcp_segment_t) + len;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    char *datagram = convert_to_datagram(&bench_conn, segment, seg_len);
+    sink += datagram[0];
+    free(datagram);
+  }
+  free(segment);
+}
+
+static void run_to_ctcp(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  char *datagram = convert_to_datagram(&bench_conn, segment,
+                                       sizeof(ctcp_segment_t) + len);
+  int datagram_len = FULL_HDR_SIZE + len;
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ctcp_segment_t *converted = convert_to_ctcp(&bench_conn, datagram,
+                                                datagram_len);
+    sink += converted->cksum;
+    free(converted);
+  }
+  free(datagram);
+  free(segment);
+}
+
+static void run_cksum_tcp(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  char *datagram = convert_to_datagram(&bench_conn, segment,
+                                       sizeof(ctcp_segment_t) + len);
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    sink += cksum_tcp((iphdr_t *) datagram, len);
+  free(datagram);
+  free(segment);
+}
+
+static void run_log_segment(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    log_segment(null_fd, bench_config.ip_addr, bench_config.port, &bench_conn,
+                segment, sizeof(ctcp_segment_t) + len, true, false);
+  free(segment);
+}
+
+/* What -l costs the main loop while the writer thread keeps up: filling in
+   the next entry of the ring. A real logger isn't used, as its writer can't
+   keep up with this loop; the ring would be full after LOG_RING_SIZE
+   iterations and the rest would time dropping segments instead. */
+static void run_logger_segment(size_t len, uint64_t iters) {
+  ctcp_segment_t *segment = bench_segment(len);
+  log_entry_t *ring = malloc(LOG_RING_SIZE * sizeof(log_entry_t));
+  uint64_t i;
+  for (i = 0; i < iters; i++)
+    log_fill(&ring[i % LOG_RING_SIZE], bench_config.ip_addr,
+             bench_config.port, bench_conn.ip_addr, bench_conn.port, segment,
+             true, false, true);
+  sink += ring[0].len;
+  free(ring);
+  free(segment);
+}
+
+/* One segment going through a queue: added at the back, removed at the
+   front. */
+static void run_ll_add_remove(size_t len, uint64_t iters) {
+  linked_list_t *list = ll_create();
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ll_add(list, bench_data);
+    sink += (uintptr_t) ll_remove(list, ll_front(list));
+  }
+  ll_destroy(list);
+}
+
+static void run_ll_add_front(size_t len, uint64_t iters) {
+  linked_list_t *list = ll_create();
+  uint64_t i;
+  for (i = 0; i < iters; i++) {
+    ll_add_front(list, bench_data);
+    sink += (uintptr_t) ll_remove(list, ll_back(list));
+  }
+  ll_destroy(list);
+}
+
+/* Finds the last of LL_FIND_LEN elements, the worst case for a search. */
+static void run_ll_find(size_t len, uint64_t iters) {
+  linked_list_t *list = ll_create();
+  uint64_t i;
+  for (i = 0; i < LL_FIND_LEN; i++)
+    ll_add(list, bench_data + i);
+  for (i = 0; i < iters; i++)
+    sink += (uintptr_t) ll_find(list, bench_data + LL_FIND_LEN - 1);
+  while (ll_length(list) > 0)
+    ll_remove(list, ll_front(list));
+  ll_destroy(list);
+}
+
+static const bench_t benches[] = {
+  { "cksum", true, run_cksum },
+  { "make_segment", true, run_make_segment },
+  { "convert_to_network_order", false, run_network_order },
+  { "convert_to_host_order", false, run_host_order },
+  { "convert_to_datagram", true, run_to_datagram },
+  { "convert_to_ctcp", true, run_to_ctcp },
+  { "cksum_tcp", true, run_cksum_tcp },
+  { "log_segment", true, run_log_segment },
+  { "logger_segment", true, run_logger_segment },
+  { "ll_add+ll_remove", false, run_ll_add_remove },
+  { "ll_add_front+ll_remove", false, run_ll_add_front },
+  { "ll_find", false, run_ll_find },
+};
+
+#define NUM_BENCHES (sizeof(benches) / sizeof(bench_t))
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t cycles() {
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+/* Sets up the fixtures the benchmarks share. */
+static void setup() {
+  memset(bench_data, 'x', sizeof(bench_data));
+  null_fd = open("/dev/null", O_WRONLY);
+
+  bench_config.ip_addr = htonl(INADDR_LOOPBACK);
+  bench_config.port = 12345;
+  config = &bench_config;
+
+  bench_ctcp_cfg.recv_window = MAX_SEG_DATA_SIZE;
+  bench_ctcp_cfg.send_window = MAX_SEG_DATA_SIZE;
+  bench_ctcp_cfg.timer = TIMER_INTERVAL;
+  bench_ctcp_cfg.rt_timeout = RT_INTERVAL;
+  ctcp_cfg = &bench_ctcp_cfg;
+
+  bench_conn.ip_addr = htonl(INADDR_LOOPBACK);
+  bench_conn.port = 9999;
+  bench_conn.init_seqno = 1000;
+  bench_conn.their_init_seqno = 2000;
+  bench_conn.mss = MAX_LOCAL_SEG_DATA_SIZE;
+  bench_state = ctcp_init(&bench_conn, &bench_ctcp_cfg);
+}
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void microbench_usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [--sizes bytes1,bytes2,...] (each at most %d)\n"
+    "   [--min-time ms]\n"
+    "   [--reps reps]\n"
+    "   [--cpu cpu]\n"
+    "   [--csv file]\n"
+    "   [name ...]\n\n",
+    progname, (int) MAX_LOCAL_SEG_DATA_SIZE
+  );
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  size_t sizes[MAX_SIZES] = { 0, 64, 256, 1024, MAX_SEG_DATA_SIZE };
+  int num_sizes = 5, reps = 5, cpu = 0;
+  double min_time = 50;
+  char *csv_path = NULL, *tok;
+
+  struct option o[] = {
+    { "sizes", required_argument, NULL, 'z' },
+    { "min-time", required_argument, NULL, 't' },
+    { "reps", required_argument, NULL, 'n' },
+    { "cpu", required_argument, NULL, 'u' },
+    { "csv", required_argument, NULL, 'o' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt;
+  while ((opt = getopt_long(argc, argv, "n:", o, NULL)) != -1) {
+    switch (opt) {
+    case 'z':
+      num_sizes = 0;
+      for (tok = strtok(optarg, ","); tok; tok = strtok(NULL, ",")) {
+        if (num_sizes == MAX_SIZES || atoi(tok) > MAX_LOCAL_SEG_DATA_SIZE)
+          microbench_usage(progname);
+        sizes[num_sizes++] = atoi(tok);
+      }
+      break;
+    case 't':
+      min_time = atof(optarg);
+      break;
+    case 'n':
+      reps = atoi(optarg);
+      break;
+    case 'u':
+      cpu = atoi(optarg);
+      break;
+    case 'o':
+      csv_path = optarg;
+      break;
+    default:
+      microbench_usage(progname);
+      break;
+    }
+  }
+  if (num_sizes == 0 || reps < 1 || min_time <= 0)
+    microbench_usage(progname);
+
+  /* Stay on one CPU. */
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(cpu_set_t), &set) < 0)
+    fprintf(stderr, "[INFO] Could not pin to CPU %d, running unpinned\n", cpu);
+
+  FILE *csv = NULL;
+  if (csv_path) {
+    if ((csv = fopen(csv_path, "w")) == NULL) {
+      fprintf(stderr, "[ERROR] Could not open %s\n", csv_path);
+      return 1;
+    }
+    fprintf(csv, "name,bytes,iterations,ns_per_op,cycles_per_op,"
+            "bytes_per_cycle\n");
+  }
+
+  setup();
+  printf("%-26s %6s %12s %10s %12s %12s\n", "name", "bytes", "iterations",
+         "ns/op", "cycles/op", "bytes/cycle");
+
+  double *ns = malloc(reps * sizeof(double));
+  double *cyc = malloc(reps * sizeof(double));
+  unsigned int b;
+  int z, r, a;
+  for (b = 0; b < NUM_BENCHES; b++) {
+    const bench_t *bench = &benches[b];
+
+    /* Only run the named benchmarks, if any are named. */
+    for (a = optind; a < argc && strcmp(argv[a], bench->name); a++);
+    if (optind < argc && a == argc)
+      continue;
+
+    for (z = 0; z < (bench->sized ? num_sizes : 1); z++) {
+      size_t len = bench->sized ? sizes[z] : 0;
+
+      /* Warm up, then find an iteration count that takes min_time. */
+      uint64_t iters = 1, start;
+      bench->run(len, 1000);
+      for (;;) {
+        start = now_ns();
+        bench->run(len, iters);
+        if (now_ns() - start >= min_time * 1000000)
+          break;
+        iters *= 2;
+      }
+
+      for (r = 0; r < reps; r++) {
+        uint64_t start_cycles = cycles();
+        start = now_ns();
+        bench->run(len, iters);
+        ns[r] = (double) (now_ns() - start) / iters;
+        cyc[r] = (double) (cycles() - start_cycles) / iters;
+      }
+      qsort(ns, reps, sizeof(double), cmp_double);
+      qsort(cyc, reps, sizeof(double), cmp_double);
+      double ns_op = ns[reps / 2], cyc_op = cyc[reps / 2];
+      double bytes_cycle = cyc_op > 0 ? len / cyc_op : 0;
+
+      if (bench->sized)
+        printf("%-26s %6zu %12lu %10.1f %12.1f %12.3f\n", bench->name, len,
+               (unsigned long) iters, ns_op, cyc_op, bytes_cycle);
+      else
+        printf("%-26s %6s %12lu %10.1f %12.1f %12s\n", bench->name, "-",
+               (unsigned long) iters, ns_op, cyc_op, "-");
+      fflush(stdout);
+      if (csv)
+        fprintf(csv, "%s,%zu,%lu,%.3f,%.3f,%.4f\n", bench->name, len,
+                (unsigned long) iters, ns_op, cyc_op, bytes_cycle);
+    }
+  }
+
+  free(ns);
+  free(cyc);
+  if (csv)
+    fclose(csv);
+  return 0;
+}
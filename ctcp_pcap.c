@@ -0,0 +1,92 @@
+#include <pthread.h>
+
+#include "ctcp_pcap.h"
+#include "ctcp_utils.h"
+
+/** Set in a process forked off after the capture was opened. Checked instead
+    of getpid(), which is a system call. */
+static bool forked = false;
+
+struct capture {
+  int fd;
+  size_t used;
+  long first_ms;            /* When the oldest buffered record was added */
+  char buf[CAPTURE_BUF_SIZE];
+};
+
+/* Writes all of a buffer, as the file is opened for appending and a forked
+   process may be writing to it too. */
+static void write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t w = write(fd, buf, len);
+    if (w <= 0)
+      return;
+    buf += w;
+    len -= w;
+  }
+}
+
+static void set_forked() {
+  forked = true;
+}
+
+capture_t *capture_open(const char *path) {
+  int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0666);
+  if (fd < 0)
+    return NULL;
+
+  pcap_file_header_t hdr = {
+    PCAP_MAGIC_NS, PCAP_VERSION_MAJOR, PCAP_VERSION_MINOR, 0, 0, PCAP_SNAPLEN,
+    PCAP_LINKTYPE_RAW
+  };
+  write_all(fd, (char *) &hdr, sizeof(hdr));
+
+  capture_t *cap = calloc(sizeof(capture_t), 1);
+  cap->fd = fd;
+  pthread_atfork(NULL, NULL, set_forked);
+  return cap;
+}
+
+void capture_packet(capture_t *cap, const void *buf, size_t len) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  size_t incl_len = len > PCAP_SNAPLEN ? PCAP_SNAPLEN : len;
+  pcap_record_header_t hdr = { ts.tv_sec, ts.tv_nsec, incl_len, len };
+
+  /* Forked process (see conn_send). Its copy of the buffer is the parent's,
+     so leave it alone and write this one record in a single write. */
+  if (forked) {
+    char record[sizeof(hdr) + PCAP_SNAPLEN];
+    memcpy(record, &hdr, sizeof(hdr));
+    memcpy(record + sizeof(hdr), buf, incl_len);
+    write_all(cap->fd, record, sizeof(hdr) + incl_len);
+    return;
+  }
+
+  if (cap->used + sizeof(hdr) + incl_len > CAPTURE_BUF_SIZE)
+    capture_flush(cap);
+  if (cap->used == 0)
+    cap->first_ms = current_time();
+
+  memcpy(cap->buf + cap->used, &hdr, sizeof(hdr));
+  memcpy(cap->buf + cap->used + sizeof(hdr), buf, incl_len);
+  cap->used += sizeof(hdr) + incl_len;
+}
+
+void capture_poll(capture_t *cap) {
+  if (cap->used > 0 && current_time() - cap->first_ms >= CAPTURE_FLUSH_MS)
+    capture_flush(cap);
+}
+
+void capture_flush(capture_t *cap) {
+  if (forked)
+    return;
+  write_all(cap->fd, cap->buf, cap->used);
+  cap->used = 0;
+}
+
+void capture_close(capture_t *cap) {
+  capture_flush(cap);
+  close(cap->fd);
+  free(cap);
+}
@@ -0,0 +1,99 @@
+/******************************************************************************
+ * ctcp_pcap.h
+ * -----------
+ * Packet capture in the pcap format, with nanosecond timestamps, so a run can
+ * be opened in Wireshark or read with tcpdump -r. Packets are the raw IPv4
+ * datagrams ctcp sends and receives (LINKTYPE_RAW).
+ *
+ * Records are copied into a buffer and written out when it fills, so capturing
+ * a packet costs a timestamp and a memcpy.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PCAP_H
+#define CTCP_PCAP_H
+
+#include "ctcp_sys.h"
+
+/** Magic number of a pcap file with nanosecond timestamps. */
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+
+/** Magic number of a pcap file with microsecond timestamps, as tcpdump
+    writes. */
+#define PCAP_MAGIC_US 0xa1b2c3d4
+
+/** Link type for packets that start with the IP header. */
+#define PCAP_LINKTYPE_RAW 101
+
+/** Longest packet captured in full. */
+#define PCAP_SNAPLEN 65535
+
+/** Size of the buffer records are collected in. Holds at least one record
+    of PCAP_SNAPLEN. */
+#define CAPTURE_BUF_SIZE (1 << 17)
+
+/** Longest time packets stay in the buffer when there is no other traffic, in
+    milliseconds. */
+#define CAPTURE_FLUSH_MS 1000
+
+/** File header. */
+typedef struct {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t network;
+} pcap_file_header_t;
+
+/** Header in front of each packet. */
+typedef struct {
+  uint32_t ts_sec;
+  uint32_t ts_nsec;         /* Microseconds in a PCAP_MAGIC_US file */
+  uint32_t incl_len;        /* Bytes of the packet in the file */
+  uint32_t orig_len;        /* Length of the packet */
+} pcap_record_header_t;
+
+/** A capture file. */
+typedef struct capture capture_t;
+
+/**
+ * Creates a capture file, replacing any file already there.
+ *
+ * path: Where to write it.
+ * returns: The capture, or NULL if the file could not be created.
+ */
+capture_t *capture_open(const char *path);
+
+/**
+ * Records a packet, timestamped now.
+ *
+ * Buffered records belong to the process that opened the capture. A forked
+ * process writes its packets straight to the file instead.
+ *
+ * cap: The capture.
+ * buf: The packet, starting with the IP header.
+ * len: Length of the packet.
+ */
+void capture_packet(capture_t *cap, const void *buf, size_t len);
+
+/**
+ * Writes out the buffer if it has held packets for CAPTURE_FLUSH_MS, so the
+ * file stays up to date when traffic is slow. Call this regularly.
+ */
+void capture_poll(capture_t *cap);
+
+/**
+ * Writes out everything in the buffer.
+ */
+void capture_flush(capture_t *cap);
+
+/**
+ * Flushes and closes the capture file.
+ */
+void capture_close(capture_t *cap);
+
+#endif /* CTCP_PCAP_H */
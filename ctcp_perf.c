@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "ctcp_perf.h"
+
+static const char *func_names[NUM_PERF_FUNCS] = {
+  "ctcp_receive", "ctcp_read", "ctcp_timer", "conn_send", "conn_drain"
+};
+
+/** Hardware events, in perf_event_t order. */
+static const uint64_t hw_events[NUM_PERF_EVENTS] = {
+  PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+struct perf {
+  int fd[NUM_PERF_EVENTS];     /* -1 if not available. fd[0] leads */
+  int index[NUM_PERF_EVENTS];  /* Position in a read of the group, or -1 */
+  int num_open;
+  bool task_clock;             /* PERF_CYCLES is task-clock ns */
+  pid_t pid;                   /* Process that opened them */
+  int depth;                   /* Counted calls in progress */
+  uint64_t calls[NUM_PERF_FUNCS];
+  uint64_t total[NUM_PERF_FUNCS][NUM_PERF_EVENTS];
+  uint64_t outer[NUM_PERF_EVENTS];  /* Outermost calls only */
+};
+
+static int open_event(uint32_t type, uint64_t config, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.disabled = group < 0;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+perf_t *perf_open(void) {
+  perf_t *perf = calloc(sizeof(perf_t), 1);
+  int i;
+
+  perf->fd[PERF_CYCLES] = open_event(PERF_TYPE_HARDWARE,
+                                     hw_events[PERF_CYCLES], -1);
+  if (perf->fd[PERF_CYCLES] < 0) {
+    perf->fd[PERF_CYCLES] = open_event(PERF_TYPE_SOFTWARE,
+                                       PERF_COUNT_SW_TASK_CLOCK, -1);
+    perf->task_clock = true;
+  }
+  if (perf->fd[PERF_CYCLES] < 0) {
+    fprintf(stderr, "[ERROR] Could not open performance counters: %s\n",
+            strerror(errno));
+    free(perf);
+    return NULL;
+  }
+  perf->index[PERF_CYCLES] = perf->num_open++;
+
+  for (i = PERF_CYCLES + 1; i < NUM_PERF_EVENTS; i++) {
+    perf->fd[i] = open_event(PERF_TYPE_HARDWARE, hw_events[i],
+                             perf->fd[PERF_CYCLES]);
+    perf->index[i] = perf->fd[i] >= 0 ? perf->num_open++ : -1;
+  }
+  if (perf->task_clock)
+    fprintf(stderr, "[INFO] No cycle counter, counting task-clock ns "
+            "instead\n");
+
+  ioctl(perf->fd[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(perf->fd[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  perf->pid = getpid();
+  return perf;
+}
+
+/* Reads the whole group at once. */
+static void read_counters(perf_t *perf, perf_sample_t *s) {
+  uint64_t buf[1 + NUM_PERF_EVENTS];
+  int i;
+  if (read(perf->fd[PERF_CYCLES], buf, sizeof(buf)) <
+      (ssize_t) ((1 + perf->num_open) * sizeof(uint64_t))) {
+    memset(s, 0, sizeof(*s));
+    return;
+  }
+  for (i = 0; i < NUM_PERF_EVENTS; i++)
+    s->value[i] = perf->index[i] >= 0 ? buf[1 + perf->index[i]] : 0;
+}
+
+void perf_begin(perf_t *perf, perf_sample_t *start) {
+  perf->depth++;
+  read_counters(perf, start);
+}
+
+void perf_end(perf_t *perf, perf_func_t func, const perf_sample_t *start) {
+  perf_sample_t end;
+  int i;
+  read_counters(perf, &end);
+
+  perf->calls[func]++;
+  for (i = 0; i < NUM_PERF_EVENTS; i++) {
+    uint64_t d = end.value[i] > start->value[i] ?
+                 end.value[i] - start->value[i] : 0;
+    perf->total[func][i] += d;
+    if (perf->depth == 1)
+      perf->outer[i] += d;
+  }
+  perf->depth--;
+}
+
+/* Prints a counter per call, or a dash if it isn't there. */
+static void print_per_call(perf_t *perf, FILE *file, perf_event_t event,
+                           uint64_t total, uint64_t calls, int width) {
+  if (perf->index[event] < 0 || calls == 0)
+    fprintf(file, " %*s", width, "-");
+  else
+    fprintf(file, " %*.1f", width, (double) total / calls);
+}
+
+static void print_ipc(perf_t *perf, FILE *file, const uint64_t *total) {
+  if (perf->task_clock || perf->index[PERF_INSTRUCTIONS] < 0 ||
+      total[PERF_CYCLES] == 0)
+    fprintf(file, " %5s", "-");
+  else
+    fprintf(file, " %5.2f", (double) total[PERF_INSTRUCTIONS] /
+            total[PERF_CYCLES]);
+}
+
+void perf_print(perf_t *perf, FILE *file) {
+  const char *unit = perf->task_clock ? "ns" : "cycles";
+  int i;
+  if (getpid() != perf->pid)
+    return;
+
+  fprintf(file, "[INFO] Performance counters (user space), per call:\n");
+  fprintf(file, "  %-12s %10s %10s %10s %5s %10s %10s\n", "function", "calls",
+          unit, "instrs", "IPC", "cache-miss", "br-miss");
+  for (i = 0; i < NUM_PERF_FUNCS; i++) {
+    uint64_t calls = perf->calls[i];
+    fprintf(file, "  %-12s %10lu", func_names[i], (unsigned long) calls);
+    print_per_call(perf, file, PERF_CYCLES, perf->total[i][PERF_CYCLES],
+                   calls, 10);
+    print_per_call(perf, file, PERF_INSTRUCTIONS,
+                   perf->total[i][PERF_INSTRUCTIONS], calls, 10);
+    print_ipc(perf, file, perf->total[i]);
+    print_per_call(perf, file, PERF_CACHE_MISSES,
+                   perf->total[i][PERF_CACHE_MISSES], calls, 10);
+    print_per_call(perf, file, PERF_BRANCH_MISSES,
+                   perf->total[i][PERF_BRANCH_MISSES], calls, 10);
+    fprintf(file, "\n");
+  }
+
+  /* Segments in and out. */
+  uint64_t segments = perf->calls[PERF_RECEIVE] + perf->calls[PERF_SEND];
+  if (segments > 0) {
+    fprintf(file, "[INFO] %.1f %s per segment over %lu segments received "
+            "and sent, IPC", (double) perf->outer[PERF_CYCLES] / segments,
+            unit, (unsigned long) segments);
+    print_ipc(perf, file, perf->outer);
+    fprintf(file, "\n");
+  }
+}
+
+void perf_close(perf_t *perf) {
+  int i;
+  for (i = 0; i < NUM_PERF_EVENTS; i++)
+    if (perf->fd[i] >= 0)
+      close(perf->fd[i]);
+  free(perf);
+}
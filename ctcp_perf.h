@@ -0,0 +1,101 @@
+/******************************************************************************
+ * ctcp_perf.h
+ * -----------
+ * Hardware performance counters around the functions every segment goes
+ * through (--perf). Cycles, instructions, cache misses and branch misses are
+ * read with perf_event_open() before and after each call, and added up for
+ * each function. At exit they are reported per call, with cycles per segment
+ * and instructions per cycle.
+ *
+ * The counters are opened as one group, for this thread and user space only,
+ * and read with one read() each time, so every bracketed call costs two
+ * system calls. Counters the CPU or kernel doesn't have are left out. Without
+ * a cycle counter at all (e.g. in most virtual machines), task-clock time in
+ * nanoseconds is counted in its place.
+ *
+ * Calls nest: ctcp_receive(), ctcp_read() and ctcp_timer() include the
+ * conn_send() calls they make. Totals per segment only count the outermost
+ * calls.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_PERF_H
+#define CTCP_PERF_H
+
+#include "ctcp_sys.h"
+
+/** Functions that are counted. */
+typedef enum {
+  PERF_RECEIVE,
+  PERF_READ,
+  PERF_TIMER,
+  PERF_SEND,
+  PERF_DRAIN,
+  NUM_PERF_FUNCS
+} perf_func_t;
+
+/** Counters. */
+typedef enum {
+  PERF_CYCLES,                 /* Or task-clock ns, if there are no cycles */
+  PERF_INSTRUCTIONS,
+  PERF_CACHE_MISSES,
+  PERF_BRANCH_MISSES,
+  NUM_PERF_EVENTS
+} perf_event_t;
+
+/** Counter values at one point. */
+typedef struct {
+  uint64_t value[NUM_PERF_EVENTS];
+} perf_sample_t;
+
+/** A set of counters. */
+typedef struct perf perf_t;
+
+/**
+ * Opens the counters for the calling thread.
+ *
+ * returns: The counters, or NULL if none could be opened (an error is
+ *          printed).
+ */
+perf_t *perf_open(void);
+
+/**
+ * Reads the counters before a call.
+ *
+ * perf: The counters.
+ * start: Where to put what they read.
+ */
+void perf_begin(perf_t *perf, perf_sample_t *start);
+
+/**
+ * Reads the counters after a call, and adds the difference from start to the
+ * function's totals.
+ */
+void perf_end(perf_t *perf, perf_func_t func, const perf_sample_t *start);
+
+/**
+ * Prints the totals per call for each function, then cycles per segment and
+ * IPC overall.
+ */
+void perf_print(perf_t *perf, FILE *file);
+
+/**
+ * Closes the counters and frees them.
+ */
+void perf_close(perf_t *perf);
+
+/** Runs call, counting it against func if perf is not NULL. */
+#define PERF_COUNT(perf, func, call)           \
+  do {                                         \
+    if (perf) {                                \
+      perf_sample_t perf_start_;               \
+      perf_begin(perf, &perf_start_);          \
+      call;                                    \
+      perf_end(perf, func, &perf_start_);      \
+    }                                          \
+    else {                                     \
+      call;                                    \
+    }                                          \
+  } while (0)
+
+#endif /* CTCP_PERF_H */
@@ -0,0 +1,180 @@
+#include "ctcp_pcap.h"
+#include "ctcp_reader.h"
+
+/* Parses an address as written in logs. Unix-socket connections show as
+   localhost. */
+static in_addr_t parse_ip(const char *s) {
+  in_addr_t ip;
+  if (inet_pton(AF_INET, s, &ip) != 1)
+    ip = htonl(INADDR_LOOPBACK);
+  return ip;
+}
+
+static int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+/* Decodes the data column, "xx " for each byte. Returns the bytes decoded. */
+static size_t parse_data(const char *s, unsigned char *data, size_t max) {
+  size_t n = 0;
+  int hi, lo;
+  while (n < max && (hi = hex_digit(s[0])) >= 0 &&
+         (lo = hex_digit(s[1])) >= 0) {
+    data[n++] = hi << 4 | lo;
+    s += 2;
+    if (*s == ' ')
+      s++;
+  }
+  return n;
+}
+
+/* Parses a line of a log. See ctcp_log.h for the format. */
+static bool parse_line(char *line, packet_t *p, unsigned char *data) {
+  char *fields[10];
+  int i;
+  for (i = 0; i < 10; i++) {
+    char *tab = strchr(line, '\t');
+    if (tab == NULL)
+      return false;
+    *tab = '\0';
+    fields[i] = line;
+    line = tab + 1;
+  }
+  if (fields[0][0] < '0' || fields[0][0] > '9')
+    return false;
+
+  p->time_us = strtoull(fields[0], NULL, 10) * 1000;
+  p->src.ip = parse_ip(fields[1]);
+  p->src.port = atoi(fields[2]);
+  p->dst.ip = parse_ip(fields[3]);
+  p->dst.port = atoi(fields[4]);
+  p->on_wire = false;
+  p->seqno = strtoul(fields[5], NULL, 10);
+  p->ackno = strtoul(fields[6], NULL, 10);
+  int len = atoi(fields[7]) - (int) sizeof(ctcp_segment_t);
+  p->data_len = len > 0 ? len : 0;
+  p->flags = (strstr(fields[8], "SYN") ? TH_SYN : 0) |
+             (strstr(fields[8], "ACK") ? TH_ACK : 0) |
+             (strstr(fields[8], "FIN") ? TH_FIN : 0);
+  p->window = atoi(fields[9]);
+
+  /* The data follows the checksum. Logs may have only part of it, or none
+     (--log-headers). */
+  p->data = NULL;
+  char *tab;
+  if (data && p->data_len > 0 && (tab = strchr(line, '\t')) &&
+      parse_data(tab + 1, data, p->data_len) == p->data_len)
+    p->data = data;
+  return true;
+}
+
+static bool read_log(FILE *f, bool with_data, packet_fn fn, void *arg) {
+  char *line = NULL;
+  size_t size = 0;
+  unsigned char *data = with_data ? malloc(PCAP_SNAPLEN) : NULL;
+  packet_t p;
+  while (getline(&line, &size, f) != -1) {
+    if (parse_line(line, &p, data))
+      fn(arg, &p);
+  }
+  free(data);
+  free(line);
+  return true;
+}
+
+/* Parses an IPv4 datagram carrying TCP. */
+static bool parse_datagram(const unsigned char *buf, size_t len, packet_t *p) {
+  const struct iphdr *ip = (const struct iphdr *) buf;
+  if (len < sizeof(struct iphdr) || ip->version != 4 ||
+      ip->protocol != IPPROTO_TCP)
+    return false;
+  size_t ip_len = ip->ihl * 4;
+  size_t tot_len = ntohs(ip->tot_len);
+  if (len < ip_len + sizeof(struct tcphdr))
+    return false;
+
+  const struct tcphdr *tcp = (const struct tcphdr *) (buf + ip_len);
+  size_t hdr_len = ip_len + tcp->th_off * 4;
+  p->src.ip = ip->saddr;
+  p->src.port = ntohs(tcp->th_sport);
+  p->dst.ip = ip->daddr;
+  p->dst.port = ntohs(tcp->th_dport);
+  p->on_wire = true;
+  p->seqno = ntohl(tcp->th_seq);
+  p->ackno = ntohl(tcp->th_ack);
+  p->data_len = tot_len > hdr_len ? tot_len - hdr_len : 0;
+  p->flags = tcp->th_flags;
+  p->window = ntohs(tcp->th_win);
+  p->data = hdr_len + p->data_len <= len ? buf + hdr_len : NULL;
+  return true;
+}
+
+static bool read_pcap(const char *path, FILE *f, packet_fn fn, void *arg) {
+  pcap_file_header_t hdr;
+  pcap_record_header_t rec;
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1)
+    return false;
+
+  bool swap = hdr.magic == __builtin_bswap32(PCAP_MAGIC_NS) ||
+              hdr.magic == __builtin_bswap32(PCAP_MAGIC_US);
+  uint32_t magic = swap ? __builtin_bswap32(hdr.magic) : hdr.magic;
+  uint32_t network = swap ? __builtin_bswap32(hdr.network) : hdr.network;
+  uint32_t frac_ns = magic == PCAP_MAGIC_NS ? 1 : 1000;
+  size_t skip;
+  if (network == PCAP_LINKTYPE_RAW || network == LINKTYPE_IPV4) {
+    skip = 0;
+  }
+  else if (network == LINKTYPE_ETHERNET) {
+    skip = ETHERNET_HDR_SIZE;
+  }
+  else {
+    fprintf(stderr, "[ERROR] %s: unsupported link type %u\n", path, network);
+    return false;
+  }
+
+  unsigned char *buf = malloc(PCAP_SNAPLEN);
+  packet_t p;
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (swap) {
+      rec.ts_sec = __builtin_bswap32(rec.ts_sec);
+      rec.ts_nsec = __builtin_bswap32(rec.ts_nsec);
+      rec.incl_len = __builtin_bswap32(rec.incl_len);
+    }
+    if (rec.incl_len > PCAP_SNAPLEN ||
+        fread(buf, 1, rec.incl_len, f) != rec.incl_len)
+      break;
+
+    if (rec.incl_len > skip && parse_datagram(buf + skip, rec.incl_len - skip,
+                                              &p)) {
+      p.time_us = rec.ts_sec * 1000000ULL + rec.ts_nsec * frac_ns / 1000;
+      fn(arg, &p);
+    }
+  }
+  free(buf);
+  return true;
+}
+
+bool read_packets(const char *path, bool with_data, packet_fn fn, void *arg) {
+  FILE *f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "[ERROR] Cannot open %s\n", path);
+    return false;
+  }
+  setvbuf(f, NULL, _IOFBF, READ_BUF_SIZE);
+
+  /* Captures start with a magic number; anything else is taken as a log. */
+  uint32_t magic = 0;
+  bool pcap = fread(&magic, sizeof(magic), 1, f) == 1 &&
+    (magic == PCAP_MAGIC_NS || magic == PCAP_MAGIC_US ||
+     magic == __builtin_bswap32(PCAP_MAGIC_NS) ||
+     magic == __builtin_bswap32(PCAP_MAGIC_US));
+  rewind(f);
+  bool ok = pcap ? read_pcap(path, f, fn, arg) : read_log(f, with_data, fn,
+                                                          arg);
+  fclose(f);
+  return ok;
+}
@@ -0,0 +1,64 @@
+/******************************************************************************
+ * ctcp_reader.h
+ * -------------
+ * Reads back what ctcp records: segment logs (-l, see ctcp_log.h) and packet
+ * captures (--pcap, see ctcp_pcap.h, or tcpdump's own). Files are read front
+ * to back in one pass, handing each TCP segment to a callback, so they can be
+ * much larger than memory.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_READER_H
+#define CTCP_READER_H
+
+#include "ctcp_sys.h"
+
+/** Link types of captures tcpdump may write, besides PCAP_LINKTYPE_RAW. */
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_IPV4 228
+#define ETHERNET_HDR_SIZE 14
+
+/** Size of the input buffer. */
+#define READ_BUF_SIZE (1 << 20)
+
+/** An address and port. */
+typedef struct {
+  in_addr_t ip;
+  int port;
+} endpoint_t;
+
+/** A segment read from a file. */
+typedef struct {
+  uint64_t time_us;
+  endpoint_t src;
+  endpoint_t dst;
+  bool on_wire;               /* From a capture: sequence numbers are as
+                                 sent, not relative to the SYN as in logs.
+                                 Over Unix sockets, ctcp's datagrams carry
+                                 placeholder addresses that differ between
+                                 the two directions. */
+  uint32_t seqno;
+  uint32_t ackno;
+  uint16_t data_len;
+  uint8_t flags;              /* TH_* */
+  uint16_t window;
+  const unsigned char *data;  /* data_len bytes, or NULL if the file does not
+                                 have them all. Valid during the callback. */
+} packet_t;
+
+/** Called for each segment read. */
+typedef void (*packet_fn)(void *arg, packet_t *packet);
+
+/**
+ * Reads a log or capture, telling them apart by the capture's magic number.
+ *
+ * path: The file.
+ * with_data: Whether to read the segments' data. Logs keep it as hex, which
+ *            takes most of the time to parse, so leave it out if not needed.
+ * fn: Called for each segment, in order.
+ * arg: Passed to fn.
+ * returns: false if the file could not be read (an error is printed).
+ */
+bool read_packets(const char *path, bool with_data, packet_fn fn, void *arg);
+
+#endif /* CTCP_READER_H */
@@ -0,0 +1,331 @@
+/******************************************************************************
+ * ctcp_replay.c
+ * -------------
+ * Replays the segments one end of a recorded connection received, from a log
+ * (-l) or capture (--pcap), straight into ctcp_receive(). This exercises the
+ * receive path on real traffic, reproducibly and without a peer, so it can be
+ * timed or profiled:
+ *
+ *    perf record -g ./ctcp_replay -n 100 capture.pcap
+ *
+ * Like ctcp_emu.c, this file provides its own conn_*() functions in place of
+ * ctcp_sys_internal.c. conn_send() only counts the segments that would have
+ * gone out, and output is thrown away.
+ *
+ * The segments are loaded before anything is timed. They are then fed in as
+ * fast as possible, or at the times they were recorded (--timing). Each pass
+ * (-n) starts from a new ctcp_state_t. The receiving end is the port given
+ * with -p, or else whichever end the first data segment went to; only the
+ * first connection to send data to it is replayed.
+ *
+ *****************************************************************************/
+
+#include "ctcp.h"
+#include "ctcp_reader.h"
+#include "ctcp_utils.h"
+
+/** Same timer interval the library uses (see ctcp_sys_internal.h). */
+#define REPLAY_TIMER_INTERVAL 40
+
+/** Same as the library's MAX_BUF_SPACE, or the MSS if larger. Output is
+    thrown away, so it never runs out. */
+#define REPLAY_BUF_SPACE 8192
+
+/** Most ports whose initial sequence numbers are tracked in a capture. */
+#define MAX_BASES 64
+
+/** A recorded segment. */
+typedef struct {
+  uint64_t time_us;
+  int src_port;
+  int dst_port;
+  ctcp_segment_t *segment;     /* In network order, checksummed */
+} recorded_t;
+
+/** The receiving end. */
+struct conn {
+  bool removed;                /* ctcp_destroy() has been called */
+  uint64_t sent;               /* Segments passed to conn_send() */
+  uint64_t output;             /* Bytes passed to conn_output() */
+  size_t mss;                  /* What conn_mss() returns */
+};
+
+/** Segments loaded from the file, and what is needed to load them. */
+typedef struct {
+  recorded_t *segs;
+  size_t len;
+  size_t size;
+  uint64_t missing_data;       /* Segments the file had no data for */
+  size_t max_data_len;         /* Most data in one segment */
+  struct {
+    int port;
+    uint32_t base;
+  } bases[MAX_BASES];          /* Captures: initial sequence number of each
+                                  port */
+  int num_bases;
+} recording_t;
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-p port]\n"
+    "   [-n passes]\n"
+    "   [-w window]\n"
+    "   [--timing]\n"
+    "   file\n\n",
+    progname
+  );
+  exit(1);
+}
+
+/* Initial sequence number of a port's side of a capture. Set by its SYN, or
+   else taken as just before the first sequence number seen. */
+static uint32_t *base_of(recording_t *r, int port, uint32_t first) {
+  int i;
+  for (i = 0; i < r->num_bases; i++)
+    if (r->bases[i].port == port)
+      return &r->bases[i].base;
+  if (r->num_bases == MAX_BASES)
+    return NULL;
+  r->bases[r->num_bases].port = port;
+  r->bases[r->num_bases].base = first - 1;
+  return &r->bases[r->num_bases++].base;
+}
+
+static void on_packet(void *arg, packet_t *p) {
+  recording_t *r = arg;
+
+  /* Make a capture's sequence numbers relative, as the library does. */
+  if (p->on_wire) {
+    uint32_t *base = base_of(r, p->src.port, p->seqno);
+    if (base == NULL)
+      return;
+    if (p->flags & TH_SYN) {
+      *base = p->seqno;
+      return;
+    }
+    p->seqno -= *base;
+    uint32_t *their_base = base_of(r, p->dst.port, p->ackno);
+    if (their_base)
+      p->ackno -= *their_base;
+  }
+
+  if (p->data_len > r->max_data_len)
+    r->max_data_len = p->data_len;
+  uint16_t len = sizeof(ctcp_segment_t) + p->data_len;
+  ctcp_segment_t *segment = calloc(len, 1);
+  segment->seqno = htonl(p->seqno);
+  segment->ackno = htonl(p->ackno);
+  segment->len = htons(len);
+  segment->flags = p->flags;
+  segment->window = htons(p->window);
+  if (p->data)
+    memcpy(segment->data, p->data, p->data_len);
+  else if (p->data_len > 0)
+    r->missing_data++;
+  segment->cksum = cksum(segment, len);
+
+  if (r->len == r->size) {
+    r->size = r->size ? r->size * 2 : 1024;
+    r->segs = realloc(r->segs, r->size * sizeof(recorded_t));
+  }
+  recorded_t *rec = &r->segs[r->len++];
+  rec->time_us = p->time_us;
+  rec->src_port = p->src.port;
+  rec->dst_port = p->dst.port;
+  rec->segment = segment;
+}
+
+/* Runs one pass. Returns how long it took, in us. */
+static uint64_t replay(recorded_t *segs, size_t len, int port, int peer_port,
+                       size_t mss, uint16_t window, bool timing,
+                       struct conn *conn, uint64_t *fed) {
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  cfg->recv_window = window * MAX_SEG_DATA_SIZE;
+  cfg->send_window = window * MAX_SEG_DATA_SIZE;
+  cfg->timer = REPLAY_TIMER_INTERVAL;
+  cfg->rt_timeout = 5 * REPLAY_TIMER_INTERVAL;
+  memset(conn, 0, sizeof(*conn));
+  conn->mss = mss;
+  ctcp_state_t *state = ctcp_init(conn, cfg);
+
+  uint64_t start = current_time_us();
+  uint64_t next_timer = start + REPLAY_TIMER_INTERVAL * 1000;
+  size_t i;
+  *fed = 0;
+  for (i = 0; i < len && !conn->removed; i++) {
+    recorded_t *rec = &segs[i];
+    if (rec->dst_port != port || rec->src_port != peer_port)
+      continue;
+
+    if (timing) {
+      uint64_t due = start + (rec->time_us - segs[0].time_us);
+      uint64_t now;
+      while ((now = current_time_us()) < due) {
+        if (now >= next_timer) {
+          ctcp_timer();
+          next_timer = now + REPLAY_TIMER_INTERVAL * 1000;
+          continue;
+        }
+        usleep((due < next_timer ? due : next_timer) - now);
+      }
+    }
+
+    size_t seg_len = ntohs(rec->segment->len);
+    ctcp_segment_t *segment = malloc(seg_len);
+    memcpy(segment, rec->segment, seg_len);
+    ctcp_receive(state, segment, seg_len);
+    (*fed)++;
+  }
+  uint64_t elapsed = current_time_us() - start;
+
+  if (!conn->removed)
+    ctcp_destroy(state);
+  return elapsed;
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  int port = 0;
+  int passes = 1;
+  int window = 1;
+  bool timing = false;
+
+  struct option o[] = {
+    { "port", required_argument, NULL, 'p' },
+    { "passes", required_argument, NULL, 'n' },
+    { "window", required_argument, NULL, 'w' },
+    { "timing", no_argument, NULL, 't' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt;
+  while ((opt = getopt_long(argc, argv, "p:n:w:t", o, NULL)) != -1) {
+    switch (opt) {
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'n':
+      passes = atoi(optarg);
+      break;
+    case 'w':
+      window = atoi(optarg);
+      break;
+    case 't':
+      timing = true;
+      break;
+    default:
+      usage(progname);
+      break;
+    }
+  }
+  if (optind != argc - 1 || passes < 1 || window < 1)
+    usage(progname);
+
+  recording_t r;
+  memset(&r, 0, sizeof(r));
+  if (!read_packets(argv[optind], true, on_packet, &r))
+    return 1;
+
+  /* Pick the connection: the first to send data to the receiving end. */
+  size_t i;
+  int peer_port = 0;
+  for (i = 0; i < r.len && peer_port == 0; i++) {
+    ctcp_segment_t *segment = r.segs[i].segment;
+    if (ntohs(segment->len) > sizeof(ctcp_segment_t) &&
+        (port == 0 || r.segs[i].dst_port == port)) {
+      port = r.segs[i].dst_port;
+      peer_port = r.segs[i].src_port;
+    }
+  }
+  if (peer_port == 0) {
+    fprintf(stderr, "[ERROR] No data segments to replay in %s\n",
+            argv[optind]);
+    return 1;
+  }
+  if (r.missing_data > 0)
+    fprintf(stderr, "[INFO] %lu segments have no data in the file (e.g. "
+            "--log-headers), so are replayed as zeros\n",
+            (unsigned long) r.missing_data);
+
+  /* Segments as large as the largest recorded, which may be more than cTCP's
+     default (e.g. --mss, or a capture with segmentation offload). */
+  size_t mss = r.max_data_len > MAX_SEG_DATA_SIZE ? r.max_data_len
+                                                  : MAX_SEG_DATA_SIZE;
+
+  printf("Replaying port %d to port %d from %s, %s\n", peer_port, port,
+         argv[optind], timing ? "at recorded timing" : "as fast as possible");
+  printf("%-6s %10s %10s %10s %12s %10s %10s\n", "pass", "segments", "acks",
+         "kB_out", "elapsed_ms", "ns/seg", "MB/s");
+
+  uint64_t best = 0;
+  int pass;
+  for (pass = 0; pass < passes; pass++) {
+    struct conn conn;
+    uint64_t fed;
+    uint64_t us = replay(r.segs, r.len, port, peer_port, mss, window, timing,
+                         &conn, &fed);
+    if (pass == 0 || us < best)
+      best = us;
+    printf("%-6d %10lu %10lu %10.1f %12.3f %10.1f %10.1f\n", pass + 1,
+           (unsigned long) fed, (unsigned long) conn.sent,
+           conn.output / 1000.0, us / 1000.0, fed ? us * 1000.0 / fed : 0,
+           us ? (double) conn.output / us : 0);
+  }
+  if (passes > 1)
+    printf("Fastest pass: %.3f ms\n", best / 1000.0);
+
+  for (i = 0; i < r.len; i++)
+    free(r.segs[i].segment);
+  free(r.segs);
+  return 0;
+}
+
+
+/////////////////////////////// CONN_* FUNCTIONS //////////////////////////////
+
+/* The recording is all the input there is. */
+int conn_input(conn_t *conn, void *buf, size_t len) {
+  return 0;
+}
+
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  conn->sent++;
+  return len;
+}
+
+int conn_output(conn_t *conn, const char *buf, size_t len) {
+  conn->output += len;
+  return len;
+}
+
+size_t conn_bufspace(conn_t *conn) {
+  return conn->mss > REPLAY_BUF_SPACE ? conn->mss : REPLAY_BUF_SPACE;
+}
+
+size_t conn_mss(conn_t *conn) {
+  return conn->mss;
+}
+
+void conn_remove(conn_t *conn) {
+  conn->removed = true;
+}
+
+ctcp_stats_t *conn_stats(conn_t *conn) {
+  return NULL;
+}
+
+void end_client() {
+}
@@ -0,0 +1,243 @@
+/******************************************************************************
+ * ctcp_stat.c
+ * -----------
+ * Shows the statistics of a running ctcp started with --stats (see
+ * ctcp_stats.h): totals for the process and a line for each open connection.
+ * Only reads the shared-memory region, so it can be left running without
+ * slowing ctcp down.
+ *
+ *****************************************************************************/
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "ctcp_stats.h"
+
+/** A consistent copy of a slot, and what it was at the last sample. */
+typedef struct {
+  bool valid;
+  uint32_t generation;
+  char name[STATS_NAME_SIZE];
+  uint64_t values[NUM_STATS];
+} sample_t;
+
+/**
+ * Prints out a usage message.
+ *
+ * progname: Name of the program.
+ */
+static void usage(char *progname) {
+  fprintf(stderr,
+    "\nUsage: %s\n"
+    "   [-i seconds]\n"
+    "   [-n count]\n"
+    "   [-l]\n"
+    "   [pid]\n\n",
+    progname
+  );
+  exit(1);
+}
+
+/* Calls fn for each process with a region, and returns how many there are. */
+static int find_regions(void (*fn)(int pid), int *last) {
+  DIR *dir = opendir("/dev/shm");
+  struct dirent *entry;
+  int n = 0;
+  if (dir == NULL)
+    return 0;
+
+  while ((entry = readdir(dir))) {
+    if (strncmp(entry->d_name, STATS_NAME_PREFIX,
+                strlen(STATS_NAME_PREFIX)) != 0)
+      continue;
+    int pid = atoi(entry->d_name + strlen(STATS_NAME_PREFIX));
+    if (fn)
+      fn(pid);
+    *last = pid;
+    n++;
+  }
+  closedir(dir);
+  return n;
+}
+
+static void print_region(int pid) {
+  const stats_region_t *r = stats_open(pid);
+  if (r == NULL)
+    return;
+  printf("%-8d %-7s %s\n", pid, r->server ? "server" : "client",
+         kill(pid, 0) < 0 && errno == ESRCH ? "exited" : "running");
+  munmap((void *) r, sizeof(stats_region_t));
+}
+
+/* Copies a slot. Fails if it is free or changed while being copied. */
+static bool read_slot(const stats_slot_t *slot, sample_t *s) {
+  int i;
+  s->valid = false;
+  uint32_t generation = __atomic_load_n(&slot->generation, __ATOMIC_ACQUIRE);
+  if ((generation & 1) || !__atomic_load_n(&slot->in_use, __ATOMIC_RELAXED))
+    return false;
+
+  memcpy(s->name, slot->name, STATS_NAME_SIZE);
+  s->name[STATS_NAME_SIZE - 1] = '\0';
+  for (i = 0; i < NUM_STATS; i++)
+    s->values[i] = stats_get(&slot->stats, i);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  if (__atomic_load_n(&slot->generation, __ATOMIC_RELAXED) != generation)
+    return false;
+  s->generation = generation;
+  s->valid = true;
+  return true;
+}
+
+/* Prints one line. Rates are since the previous sample, if there is one. */
+static void print_line(const char *name, const uint64_t *v,
+                       const uint64_t *prev, double secs, bool gauges) {
+  printf("%-21s %8lu %8lu %9.1f %9.1f %6lu %6lu %5lu %5lu %6lu %6lu %6lu %6lu "
+         "%6lu",
+         name, (unsigned long) v[STAT_SEGMENTS_SENT],
+         (unsigned long) v[STAT_SEGMENTS_RECEIVED],
+         v[STAT_BYTES_SENT] / 1000.0, v[STAT_BYTES_RECEIVED] / 1000.0,
+         (unsigned long) v[STAT_RETRANSMITS], (unsigned long) v[STAT_DUP_ACKS],
+         (unsigned long) v[STAT_CKSUM_FAILURES],
+         (unsigned long) v[STAT_OUT_OF_ORDER],
+         (unsigned long) v[STAT_WINDOW_STALLS],
+         (unsigned long) v[STAT_FEC_PARITY],
+         (unsigned long) v[STAT_FEC_RECOVERED],
+         (unsigned long) v[STAT_KEEPALIVES], (unsigned long) v[STAT_REAPED]);
+  if (gauges)
+    printf(" %6lu %8.2f %6lu %5lu", (unsigned long) v[STAT_CWND],
+           v[STAT_SRTT] / 1000.0, (unsigned long) v[STAT_OUT_QUEUE],
+           (unsigned long) v[STAT_FEC_K]);
+  else
+    printf(" %6s %8s %6s %5s", "-", "-", "-", "-");
+  if (prev && secs > 0)
+    printf(" %9.1f %9.1f",
+           (v[STAT_BYTES_SENT] - prev[STAT_BYTES_SENT]) * 8 / 1000.0 / secs,
+           (v[STAT_BYTES_RECEIVED] - prev[STAT_BYTES_RECEIVED]) * 8 / 1000.0 /
+           secs);
+  printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+  /* Get program name. */
+  char *progname = strrchr(argv[0], '/');
+  if (progname)
+    progname++;
+  else
+    progname = argv[0];
+
+  double interval = 0;
+  int count = 0;
+  bool list = false;
+
+  struct option o[] = {
+    { "interval", required_argument, NULL, 'i' },
+    { "count", required_argument, NULL, 'n' },
+    { "list", no_argument, NULL, 'l' },
+    { NULL, 0, NULL, 0 }
+  };
+
+  /* Parse command-line arguments. */
+  int opt;
+  while ((opt = getopt_long(argc, argv, "i:n:l", o, NULL)) != -1) {
+    switch (opt) {
+    case 'i':
+      interval = atof(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 'l':
+      list = true;
+      break;
+    default:
+      usage(progname);
+      break;
+    }
+  }
+  if (optind < argc - 1 || interval < 0 || count < 0)
+    usage(progname);
+
+  /* Without a PID, use the only ctcp running with --stats. */
+  int pid = 0;
+  if (list || optind == argc) {
+    int n = find_regions(NULL, &pid);
+    if (list || n != 1) {
+      if (n == 0) {
+        fprintf(stderr, "[ERROR] No ctcp is running with --stats\n");
+        return 1;
+      }
+      printf("%-8s %-7s %s\n", "pid", "role", "state");
+      find_regions(print_region, &pid);
+      return list ? 0 : 1;
+    }
+  }
+  else {
+    pid = atoi(argv[optind]);
+  }
+
+  const stats_region_t *r = stats_open(pid);
+  if (r == NULL) {
+    fprintf(stderr, "[ERROR] No statistics for process %d\n", pid);
+    return 1;
+  }
+
+  sample_t *prev = calloc(STATS_MAX_CONNS, sizeof(sample_t));
+  sample_t cur;
+  uint64_t total[NUM_STATS], prev_total[NUM_STATS];
+  struct timespec last = { 0, 0 }, now;
+  int samples, i;
+
+  for (samples = 0; count == 0 || samples < count; samples++) {
+    if (samples > 0) {
+      if (interval == 0)
+        break;
+      usleep(interval * 1000000);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = samples == 0 ? 0 : (now.tv_sec - last.tv_sec) +
+                  (now.tv_nsec - last.tv_nsec) / 1000000000.0;
+    last = now;
+
+    bool exited = kill(pid, 0) < 0 && errno == ESRCH;
+    int open = 0;
+    for (i = 0; i < STATS_MAX_CONNS; i++)
+      if (__atomic_load_n(&r->conns[i].in_use, __ATOMIC_RELAXED))
+        open++;
+    printf("%sctcp %d (%s), up %lu s, %d connection%s%s\n",
+           samples > 0 ? "\n" : "", pid, r->server ? "server" : "client",
+           (unsigned long) (time(NULL) - r->start_time), open,
+           open == 1 ? "" : "s", exited ? ", exited" : "");
+    printf("%-21s %8s %8s %9s %9s %6s %6s %5s %5s %6s %6s %6s %6s %6s %6s "
+           "%8s %6s %5s%s\n", "connection", "seg_tx", "seg_rx", "kB_tx",
+           "kB_rx", "retx", "dupack", "cksum", "ooo", "stalls", "parity",
+           "fec_rx", "kalive", "reaped", "cwnd", "srtt_ms", "outq", "fec_k",
+           samples > 0 ? "   tx_kbps   rx_kbps" : "");
+
+    for (i = 0; i < NUM_STATS; i++)
+      total[i] = stats_get(&r->total, i);
+    print_line("total", total, samples > 0 ? prev_total : NULL, secs, false);
+    memcpy(prev_total, total, sizeof(total));
+
+    for (i = 0; i < STATS_MAX_CONNS; i++) {
+      if (!read_slot(&r->conns[i], &cur)) {
+        prev[i].valid = false;
+        continue;
+      }
+      bool same = prev[i].valid && prev[i].generation == cur.generation;
+      print_line(cur.name, cur.values, same ? prev[i].values : NULL, secs,
+                 true);
+      prev[i] = cur;
+    }
+    fflush(stdout);
+
+    if (exited)
+      break;
+  }
+
+  free(prev);
+  munmap((void *) r, sizeof(stats_region_t));
+  return 0;
+}
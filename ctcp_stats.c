@@ -0,0 +1,122 @@
+#include <stddef.h>
+#include <sys/mman.h>
+
+#include "ctcp_stats.h"
+
+const char *stat_names[NUM_STATS] = {
+  "segments_sent", "bytes_sent", "segments_received", "bytes_received",
+  "retransmits", "dup_acks", "cksum_failures", "out_of_order",
+  "window_stalls", "fec_parity", "fec_recovered", "keepalives", "reaped",
+  "cwnd", "srtt_us", "out_queue", "fec_k"
+};
+
+ctcp_stats_t *stats_total = NULL;
+
+static stats_region_t *region = NULL;
+static char region_name[32];
+
+/* Where connections without a slot count. Never seen by readers. */
+static ctcp_stats_t overflow;
+
+int stats_create(bool server) {
+  snprintf(region_name, sizeof(region_name), STATS_NAME_FORMAT, getpid());
+  int fd = shm_open(region_name, O_CREAT | O_TRUNC | O_RDWR, 0644);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate(fd, sizeof(stats_region_t)) < 0) {
+    close(fd);
+    shm_unlink(region_name);
+    return -1;
+  }
+  region = mmap(NULL, sizeof(stats_region_t), PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, 0);
+  close(fd);
+  if (region == MAP_FAILED) {
+    region = NULL;
+    shm_unlink(region_name);
+    return -1;
+  }
+
+  region->version = STATS_VERSION;
+  region->pid = getpid();
+  region->start_time = time(NULL);
+  region->server = server;
+  stats_total = &region->total;
+
+  /* Readers check the magic number last. */
+  __atomic_store_n(&region->magic, STATS_MAGIC, __ATOMIC_RELEASE);
+  return 0;
+}
+
+void stats_destroy() {
+  /* Processes forked off by conn_send exit too, but the region isn't theirs
+     to remove. */
+  if (region == NULL || region->pid != getpid())
+    return;
+  stats_unlink();
+  munmap(region, sizeof(stats_region_t));
+  region = NULL;
+  stats_total = &overflow;
+}
+
+void stats_unlink() {
+  if (region != NULL && region->pid == getpid())
+    shm_unlink(region_name);
+}
+
+ctcp_stats_t *stats_claim(const char *name) {
+  int i;
+  if (region == NULL)
+    return NULL;
+
+  for (i = 0; i < STATS_MAX_CONNS; i++) {
+    stats_slot_t *slot = &region->conns[i];
+    if (slot->in_use)
+      continue;
+
+    __atomic_store_n(&slot->generation, slot->generation + 1,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memset(&slot->stats, 0, sizeof(ctcp_stats_t));
+    snprintf(slot->name, STATS_NAME_SIZE, "%s", name);
+    slot->in_use = 1;
+    __atomic_store_n(&slot->generation, slot->generation + 1,
+                     __ATOMIC_RELEASE);
+    return &slot->stats;
+  }
+  return &overflow;
+}
+
+void stats_release(ctcp_stats_t *stats) {
+  if (region == NULL || stats == NULL || stats == &overflow)
+    return;
+
+  stats_slot_t *slot = (stats_slot_t *)
+    ((char *) stats - offsetof(stats_slot_t, stats));
+  __atomic_store_n(&slot->generation, slot->generation + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  slot->in_use = 0;
+  __atomic_store_n(&slot->generation, slot->generation + 1, __ATOMIC_RELEASE);
+}
+
+const stats_region_t *stats_open(int pid) {
+  char name[32];
+  snprintf(name, sizeof(name), STATS_NAME_FORMAT, pid);
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  const stats_region_t *r = mmap(NULL, sizeof(stats_region_t), PROT_READ,
+                                 MAP_SHARED, fd, 0);
+  close(fd);
+  if (r == MAP_FAILED)
+    return NULL;
+
+  if (__atomic_load_n(&r->magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+      r->version != STATS_VERSION) {
+    munmap((void *) r, sizeof(stats_region_t));
+    return NULL;
+  }
+  return r;
+}
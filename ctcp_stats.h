@@ -0,0 +1,164 @@
+/******************************************************************************
+ * ctcp_stats.h
+ * ------------
+ * Connection statistics, published in a shared-memory region so ctcp_stat can
+ * read them while ctcp runs. The region holds totals for the whole process and
+ * a slot for each open connection.
+ *
+ * Only the ctcp process writes to the region, from its one thread, so counters
+ * are updated with plain relaxed atomic loads and stores: no locks and no
+ * locked instructions. Readers never write to it, so reading does not slow
+ * ctcp down.
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_STATS_H
+#define CTCP_STATS_H
+
+#include "ctcp_sys.h"
+
+/** Name of a process's region (under /dev/shm), given its PID. */
+#define STATS_NAME_FORMAT "/ctcp-stats.%d"
+#define STATS_NAME_PREFIX "ctcp-stats."
+
+#define STATS_MAGIC 0x6374637073746174ULL   /* "ctcpstat" */
+#define STATS_VERSION 3
+
+/** Room for a connection's name (address and port). */
+#define STATS_NAME_SIZE 32
+
+/** Connections that get their own slot. Connections beyond this still count
+    towards the totals. */
+#define STATS_MAX_CONNS 64
+
+/** Statistics kept. Counters only go up; gauges are the current value and are
+    not added up in the totals. */
+typedef enum {
+  STAT_SEGMENTS_SENT,          /* Segments sent, including retransmissions */
+  STAT_BYTES_SENT,             /* Payload bytes sent */
+  STAT_SEGMENTS_RECEIVED,
+  STAT_BYTES_RECEIVED,
+  STAT_RETRANSMITS,            /* Segments sent again */
+  STAT_DUP_ACKS,               /* Pure ACKs that didn't ACK anything new */
+  STAT_CKSUM_FAILURES,         /* Segments received with a bad checksum */
+  STAT_OUT_OF_ORDER,           /* Segments received past a gap */
+  STAT_WINDOW_STALLS,          /* Times input waited for the window to open */
+  STAT_FEC_PARITY,             /* Parity segments sent (--fec) */
+  STAT_FEC_RECOVERED,          /* Lost segments rebuilt from parity */
+  STAT_KEEPALIVES,             /* Keepalives sent (--keepalive) */
+  STAT_REAPED,                 /* Connections torn down for going quiet */
+  STAT_CWND,                   /* Gauge: congestion window, in bytes */
+  STAT_SRTT,                   /* Gauge: smoothed RTT, in microseconds */
+  STAT_OUT_QUEUE,              /* Gauge: bytes waiting to be output */
+  STAT_FEC_K,                  /* Gauge: data segments per parity segment */
+  NUM_STATS
+} stat_t;
+
+/** First gauge. Everything before it is a counter. */
+#define STAT_FIRST_GAUGE STAT_CWND
+
+/** Names of the statistics, for printing. */
+extern const char *stat_names[NUM_STATS];
+
+/** Statistics for a connection, or for the whole process. */
+struct ctcp_stats {
+  uint64_t values[NUM_STATS];
+};
+
+/** A connection's slot. generation is odd while the slot is being claimed or
+    released, so a reader can tell it saw a slot change under it. */
+typedef struct {
+  uint32_t generation;
+  uint32_t in_use;
+  char name[STATS_NAME_SIZE];  /* Other end of the connection */
+  ctcp_stats_t stats;
+} __attribute__((aligned(64))) stats_slot_t;
+
+/** The shared-memory region. */
+typedef struct {
+  uint64_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint64_t start_time;         /* When the process started (Unix time) */
+  bool server;
+  ctcp_stats_t total;          /* Counters for every connection, open or not */
+  stats_slot_t conns[STATS_MAX_CONNS];
+} stats_region_t;
+
+/** Totals in the region, or NULL if there is no region. */
+extern ctcp_stats_t *stats_total;
+
+/**
+ * Creates the region for this process. Its name is removed again by
+ * stats_destroy(), or by stats_unlink() from a signal handler.
+ *
+ * server: Whether this is the server.
+ * returns: 0 on success, -1 on error.
+ */
+int stats_create(bool server);
+
+/**
+ * Unmaps the region and removes its name.
+ */
+void stats_destroy();
+
+/**
+ * Removes the region's name, so it goes away when the process exits. Safe to
+ * call from a signal handler.
+ */
+void stats_unlink();
+
+/**
+ * Claims a slot for a new connection.
+ *
+ * name: What to show for the connection (its address and port).
+ * returns: The connection's statistics. If every slot is taken, these count
+ *          towards the totals but can't be seen on their own.
+ */
+ctcp_stats_t *stats_claim(const char *name);
+
+/**
+ * Releases a connection's slot. What it counted stays in the totals.
+ */
+void stats_release(ctcp_stats_t *stats);
+
+/**
+ * Maps another process's region, read-only.
+ *
+ * pid: The process.
+ * returns: The region, or NULL if it doesn't exist or isn't one ctcp_stat
+ *          understands.
+ */
+const stats_region_t *stats_open(int pid);
+
+/**
+ * Reads a statistic written by another process (or this one).
+ */
+static inline uint64_t stats_get(const ctcp_stats_t *stats, stat_t stat) {
+  return __atomic_load_n(&stats->values[stat], __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds to a counter for a connection and to the totals. Does nothing if stats
+ * is NULL, so callers don't need to check whether statistics are on.
+ */
+static inline void stats_add(ctcp_stats_t *stats, stat_t stat, uint64_t n) {
+  if (stats == NULL)
+    return;
+  __atomic_store_n(&stats->values[stat], stats->values[stat] + n,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&stats_total->values[stat], stats_total->values[stat] + n,
+                   __ATOMIC_RELAXED);
+}
+
+/**
+ * Sets a gauge for a connection. Does nothing if stats is NULL.
+ */
+static inline void stats_set(ctcp_stats_t *stats, stat_t stat,
+                             uint64_t value) {
+  if (stats == NULL)
+    return;
+  __atomic_store_n(&stats->values[stat], value, __ATOMIC_RELAXED);
+}
+
+#endif /* CTCP_STATS_H */
@@ -37,6 +37,9 @@
 typedef struct conn conn_t;
 struct conn;
 
+/** Connection statistics. Definition can be found in ctcp_stats.h. */
+typedef struct ctcp_stats ctcp_stats_t;
+
 /**
  * cTCP segment.
  *
@@ -121,6 +124,17 @@ int conn_output(conn_t *conn, const char *buf, size_t len);
  */
 size_t conn_bufspace(conn_t *conn);
 
+/**
+ * Returns the most data a segment on this connection can carry. The hosts
+ * agree on it in the handshake: MAX_SEG_DATA_SIZE over the network, and up to
+ * about 64 KB over a Unix socket. Use it instead of MAX_SEG_DATA_SIZE to size
+ * segments, buffers and the window.
+ *
+ * conn: The connection object.
+ * returns: The connection's maximum segment data size.
+ */
+size_t conn_mss(conn_t *conn);
+
 /**
  * Used to remove a connection object. This is already called on in the starter
  * code in ctcp_destroy(), so you do not need to add calls to it.
@@ -129,6 +143,17 @@ size_t conn_bufspace(conn_t *conn);
  */
 void conn_remove(conn_t *conn);
 
+/**
+ * Returns the statistics kept for a connection, so figures only your code
+ * knows (such as the congestion window) can be added to them with stats_add()
+ * and stats_set() from ctcp_stats.h.
+ *
+ * conn: The connection object.
+ * returns: The statistics, or NULL if they are not being kept (stats_add() and
+ *          stats_set() accept NULL).
+ */
+ctcp_stats_t *conn_stats(conn_t *conn);
+
 
 /** Whether or not the tester's debugging is turned on. You can ignore this. */
 bool test_debug_on;
@@ -14,11 +14,20 @@
 #include <poll.h>
 #include <pthread.h>
 #include <stddef.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "ctcp_sys_internal.h"
 #include "ctcp_sys.h"
+#include "ctcp_histogram.h"
+#include "ctcp_link.h"
+#include "ctcp_linked_list.h"
+#include "ctcp_lz.h"
+#include "ctcp_pcap.h"
+#include "ctcp_perf.h"
+#include "ctcp_stats.h"
+#include "ctcp_trace.h"
 
 #define ASSERT_CLIENT_ONLY (assert(!SERVER))
 #define ASSERT_SERVER_ONLY (assert(SERVER))
@@ -32,6 +41,8 @@ struct config {
   int socket;                  /* Socket to send and receive out of */
   in_addr_t ip_addr;           /* IP address */
   int port;                    /* Port */
+  int mtu;                     /* MTU of the interface (raw IP), 0 if not
+                                  known */
   struct sockaddr_in saddr;    /* Socket address */
   struct sockaddr_un sunaddr;  /* Unix socket */
 
@@ -57,11 +68,137 @@ static bool run_program = false;
 
 /** Options for unreliable communications. */
 static int seed = 144;
+
+/** Initial sequence number to use (--isn), or -1 for a random one. For
+    checking that sequence numbers wrap past 2^32. */
+static int64_t opt_isn = -1;
 static int opt_drop = false;
 static int opt_corrupt = false;
 static int opt_delay = false;
 static int opt_duplicate = false;
 
+/** Options for the emulated link. The link is only used if one is set. */
+static bool opt_link = false;
+static link_config_t link_cfg;
+
+/** Delivery traces for the emulated link. The client sends through the uplink
+    trace and the server through the downlink trace, so both hosts can be given
+    the same options. */
+static char *opt_uplink_trace = NULL;
+static char *opt_downlink_trace = NULL;
+
+/** Emulated link that segments go through on their way out, if any. */
+static link_t *emu_link = NULL;
+
+/** Packets that came out of the emulated link but couldn't be sent. */
+static uint64_t emu_link_send_failed = 0;
+
+/** Whether to keep latency histograms. */
+static bool opt_histograms = false;
+
+/** Tag one byte in every this many with its send time (--e2e-latency), or 0
+    not to. */
+static int opt_e2e_bytes = 0;
+
+/** Most segment data to offer (--mss), or 0 for what suits the transport. */
+static int opt_mss = 0;
+
+/** Seconds a connection is idle before keepalives are sent (--keepalive), or
+    0 not to, then seconds between them and how many go unanswered before it
+    is reaped. */
+static int opt_keepalive = 0;
+static int opt_keepalive_interval = KEEPALIVE_INTERVAL;
+static int opt_keepalive_count = KEEPALIVE_COUNT;
+
+/** Seconds of hearing nothing from the other end before a connection is
+    reaped (--idle-timeout), or 0 not to. */
+static int opt_idle_timeout = 0;
+
+/** Whether to offer to compress connections (--compress). */
+static bool opt_compress = false;
+
+/** Whether to offer forward error correction (--fec). */
+static bool opt_fec = false;
+
+/** Number of streams each connection carries (--streams). */
+static int opt_streams = 1;
+
+/** Whether to send data with the SYN once there is a cookie (--fast-open). */
+static bool opt_fast_open = false;
+
+/** Client: the server, as given with -c, and its fast open cookie if there is
+    one. */
+static char *fast_open_server = NULL;
+static uint8_t fast_open_cookie[FAST_OPEN_COOKIE_SIZE];
+static bool have_cookie = false;
+
+/** Server: secret the cookies are made with, and the SYNs whose data was
+    taken recently. */
+static uint64_t fast_open_key[2];
+static struct {
+  in_addr_t ip;
+  uint16_t port;
+  uint32_t seqno;
+} fast_open_seen[FAST_OPEN_SEEN];
+static int fast_open_next = 0;
+
+/** Whether to publish statistics for ctcp_stat. */
+static bool opt_stats = false;
+
+/** Packet capture (--pcap), if on. */
+static capture_t *capture = NULL;
+
+/** Hardware performance counters (--perf), if on. */
+static perf_t *perf = NULL;
+
+/** Set to SIGINT or SIGTERM when one arrives, if statistics, a capture, the
+    log or the counters need finishing before exiting. */
+static volatile sig_atomic_t exit_signal = 0;
+
+/** Latencies the library measures for each connection. */
+typedef enum {
+  LAT_RTT,                     /* Data first sent until it is ACKed */
+  LAT_INPUT,                   /* Input read until it is first sent */
+  LAT_REASSEMBLY,              /* Data received until it is output */
+  LAT_OUTPUT_QUEUE,            /* Output queued until STDOUT accepts it */
+  LAT_END_TO_END,              /* Read by the peer until written here */
+  NUM_LATENCIES
+} latency_t;
+
+static const char *latency_names[NUM_LATENCIES] = {
+  "rtt", "input_to_tx", "reassembly", "output_queue", "end_to_end"
+};
+
+/** A point in a connection's sequence space and when it got there. */
+typedef struct {
+  uint32_t end;                /* Sequence number after the last byte */
+  uint64_t time;
+  bool retransmitted;          /* Sent more than once, so no RTT sample */
+} seq_mark_t;
+
+/** Latency histograms for a connection, and what is needed to fill them. */
+struct conn_latency {
+  histogram_t hist[NUM_LATENCIES];
+  linked_list_t *unsent;       /* Input read but not sent, in order */
+  linked_list_t *unacked;      /* Data sent but not ACKed, in order */
+  linked_list_t *unoutput;     /* Data received but not output, in order */
+  linked_list_t *tags_out;     /* Tagged bytes read but not ACKed, in order */
+  linked_list_t *tags_in;      /* Peer's tagged bytes not yet written out,
+                                  with the peer's send times */
+  uint32_t read_end;           /* Sequence number after the last byte read */
+  uint32_t sent_end;           /* Sequence number after the last byte sent */
+  uint32_t output_end;         /* Sequence number after the last byte output */
+  uint32_t written_end;        /* Sequence number after the last byte written
+                                  to STDOUT or the program */
+  uint32_t next_tag;           /* Sequence number of the next byte to tag */
+};
+
+/** Histograms of connections that have been torn down. */
+static histogram_t closed_latency[NUM_LATENCIES];
+
+/** Set by SIGUSR1 to have the histograms printed. */
+static volatile sig_atomic_t dump_latency = 0;
+
 /** For tester, we only do the unreliability once, deterministically. This is
     set to true once it has occurred. */
 static bool tester_did_unreliable = false;
@@ -69,19 +206,22 @@ static bool tester_did_unreliable = false;
 /** Log file. */
 int log_file = -1;
 
-/** Port number of a new connection if a client just connected. Used to avoid
-    logging ACK segments in response to a SYN+ACK. */
-static int new_connection = 0;
+/** Writes the log from its own thread (unless the tester is reading it). */
+static logger_t *logger = NULL;
 
 /**
  * Polling configuration:
  *    0    STDIN
  *    1    STDOUT
  *    2    Network
- *    3... Program STDOUT/STDERR (if running as server)
+ *    3... Program STDOUT/STDERR (if running as server), and input for each
+ *         stream after the first (--streams), in the order they were opened
  */
 static struct pollfd *events;
 
+/** Number of entries in use after the first NUM_POLL. */
+static int num_polled = 0;
+
 /** When the last timer timeout occurred. */
 static struct timespec last_timeout;
 
@@ -96,6 +236,25 @@ static bool handling_resets = false;
 
 /////////////////////////////// HELPER FUNCTIONS //////////////////////////////
 
+/**
+ * Writes a connection's address and port into a buffer, for messages.
+ *
+ * conn: The connection.
+ * buf: Buffer to write into.
+ * len: Size of the buffer.
+ */
+void conn_name(conn_t *conn, char *buf, size_t len) {
+  char ip[INET_ADDRSTRLEN];
+  if (unix_socket)
+    strcpy(ip, LOCALHOST_STR);
+  else
+    inet_ntop(AF_INET, &conn->ip_addr, ip, sizeof(ip));
+  if (conn->stream)
+    snprintf(buf, len, "%s:%d#%d", ip, conn->port, conn->stream);
+  else
+    snprintf(buf, len, "%s:%d", ip, conn->port);
+}
+
 /**
  * Get the connections for the client or server.
  *
@@ -107,6 +266,24 @@ conn_t *get_connections() {
   else         return config->sconn;
 }
 
+/**
+ * Returns the most segment data this host takes, which it offers in its SYN
+ * or SYN-ACK: what --mss says, otherwise as much as an IP packet holds on a
+ * Unix socket, what fits the interface's MTU over raw IP, and
+ * MAX_SEG_DATA_SIZE if that isn't known or for the tester.
+ */
+uint16_t mss_offer() {
+  if (opt_mss)
+    return opt_mss;
+  if (test_debug_on || lab5_mode)
+    return MAX_SEG_DATA_SIZE;
+  if (unix_socket)
+    return MAX_LOCAL_SEG_DATA_SIZE;
+  if (config->mtu > (int) (FULL_HDR_SIZE + MAX_TCP_OPT_SIZE))
+    return config->mtu - FULL_HDR_SIZE;
+  return MAX_SEG_DATA_SIZE;
+}
+
 /**
  * Set up the configuration for this host:
  *   - Create raw socket to communicate.
@@ -127,6 +304,14 @@ int do_config(char *port) {
     return -1;
   }
 
+  /* Make room for a few of the largest segments. The kernel may give less,
+     which only means the sender waits sooner. */
+  if (mss_offer() > MAX_SEG_DATA_SIZE) {
+    int size = SOCKET_BUF_PACKETS * PACKET_SIZE(mss_offer());
+    setsockopt(s, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    setsockopt(s, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+
   /* Make sure kernel knows IP header is included in packet so it doesn't add its
      own. For non-Unix socket only. */
   if (!unix_socket) {
@@ -141,6 +326,7 @@ int do_config(char *port) {
       fprintf(stderr, "[ERROR] Could not determine IP address\n");
       return -1;
     }
+    config->mtu = mtu_of_self();
   }
 
   /* Other configuration. */
@@ -148,13 +334,6 @@ int do_config(char *port) {
   config->socket = s;
   config->connections = NULL;
 
-  /* Set up receive timeout. */
-  struct timeval tv;
-  tv.tv_sec = CONN_TIMEOUT;
-  tv.tv_usec = 0;
-  setsockopt(config->socket, SOL_SOCKET, SO_RCVTIMEO, (char *) &tv,
-             sizeof(struct timeval));
-
   /* Bind socket to port/name so host receives only relevant messages. */
   struct sockaddr *addr;
   size_t size;
@@ -181,6 +360,11 @@ int do_config(char *port) {
     return -1;
   }
 
+  /* A Unix socket was just bound to a fresh path, so nothing from an old
+     connection can be waiting on it. Start right away. */
+  if (unix_socket)
+    return 0;
+
   /* Handle if previous connection(s) have not ended. Send RSTs to those
      hosts in a different thread. First create the reset thread. */
   thread_main = pthread_self();
@@ -218,8 +402,8 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
   }
   server_port_str = strsep(&server, ":");
   server_port = atoi(server_port_str);
-  config->sconn = calloc(sizeof(conn_t), 1);
-  conn_add(config->sconn);
+  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn_add(conn);
 
   /* Get IP address of server. See if this is a server on the same machine. */
   in_addr_t dst_ip = ip_from_hostname(_server);
@@ -230,7 +414,9 @@ int do_config_server(char *server) { ASSERT_CLIENT_ONLY;
 
   /* Set up connection details. */
   int port = server_port == 0 ? DEFAULT_PORT : server_port;
-  conn_setup(config->sconn, dst_ip, port, unix_socket);
+  conn_setup(conn, dst_ip, port, unix_socket);
+  if (opt_isn >= 0)
+    conn->init_seqno = conn->next_seqno = opt_isn;
 
   return 0;
 }
@@ -273,20 +459,25 @@ char *create_tcp_rst(in_addr_t ip_dst, uint16_t port_src, uint16_t port_dst,
  *
  * dst: A conn_t containing details for the destination.
  * flags: TCP flags.
+ * opt: TCP options, padded to a multiple of 4 bytes, or NULL if none.
+ * opt_len: Length of the options.
  * data: Buffer containing the data payload.
  * len: Data length (should not include the size of the headers).
  *
  * returns: A TCP segment with the specified fields.
  */
-char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
-  uint16_t tcp_seg_len = TCP_HDR_SIZE + len;
+char *create_tcp_seg(conn_t *dst, uint8_t flags, const uint8_t *opt,
+                     uint16_t opt_len, char *data, uint16_t len) {
+  uint16_t tcp_seg_len = TCP_HDR_SIZE + opt_len + len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_seg_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
+  if (opt_len > 0)
+    memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opt, opt_len);
 
   /* Copy data over, if there is any. */
   if (len > 0 && data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opt_len);
     memcpy(payload, data, len);
   }
 
@@ -299,13 +490,13 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(dst->next_seqno);
   tcp_hdr->th_ack = htonl(dst->ackno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
   tcp_hdr->th_flags = flags;
   tcp_hdr->th_win = window;
   tcp_hdr->th_sum = 0;
 
   /* TCP checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, len);
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + len);
 
   /* Update sequence numbers. */
   dst->seqno = dst->next_seqno;
@@ -314,6 +505,33 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
   return datagram;
 }
 
+/**
+ * Finds a TCP option in a header.
+ *
+ * tcp_hdr: The TCP header.
+ * kind: Kind of option to look for.
+ * after: Option to look after, or NULL to look from the start.
+ * returns: The option (kind, length, then the rest), which fits in the
+ *          header, or NULL if there are no more of that kind.
+ */
+uint8_t *tcp_option(tcphdr_t *tcp_hdr, uint8_t kind, uint8_t *after) {
+  uint8_t *opt = after ? after + after[1] : (uint8_t *) tcp_hdr + TCP_HDR_SIZE;
+  uint8_t *opt_end = (uint8_t *) tcp_hdr + tcp_hdr->th_off * 4;
+
+  while (opt < opt_end && opt[0] != TCPOPT_EOL) {
+    if (opt[0] == TCPOPT_NOP) {
+      opt++;
+      continue;
+    }
+    if (opt + 1 >= opt_end || opt[1] < 2 || opt + opt[1] > opt_end)
+      return NULL;
+    if (opt[0] == kind)
+      return opt;
+    opt += opt[1];
+  }
+  return NULL;
+}
+
 /**
  * Converts a packet from a raw IP packet to a cTCP segment. If there is
  * padding, keep it. The resulting segment must be freed.
@@ -326,10 +544,12 @@ char *create_tcp_seg(conn_t *dst, uint8_t flags, char *data, uint16_t len) {
 ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
-  char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+  uint16_t opt_len = tcp_hdr->th_off * 4 - TCP_HDR_SIZE;
+  char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opt_len);
 
-  /* Get actual lengths and allocate cTCP segment of correct size. */
-  uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE;
+  /* Get actual lengths and allocate cTCP segment of correct size. Options
+     are left out. */
+  uint16_t data_len = ntohs(ip_hdr->tot_len) - FULL_HDR_SIZE - opt_len;
   uint16_t len = data_len + sizeof(ctcp_segment_t);
   ctcp_segment_t *segment = calloc(len, 1);
 
@@ -343,7 +563,11 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
   segment->cksum = 0;
   if (data_len > 0)
     memcpy(segment->data, payload, data_len);
-  segment->cksum = cksum(segment, len);
+
+  /* Sum the data once for both checksums. */
+  uint32_t data_sum = cksum_add(0, segment->data, data_len);
+  segment->cksum = cksum_finish(cksum_add(data_sum, segment,
+                                          sizeof(ctcp_segment_t)));
 
   /* Find the difference in the given TCP checksum and the correct one. This
      difference is the same difference that should be added to the cTCP one.
@@ -351,11 +575,254 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
      the student (see convert_to_datagram). */
   uint16_t sum = tcp_hdr->th_sum;
   tcp_hdr->th_sum = 0;
-  uint16_t correct_sum = cksum_tcp(ip_hdr, data_len);
+  uint16_t correct_sum = cksum_tcp_data(ip_hdr, opt_len, data_len, data_sum);
   segment->cksum += (correct_sum - sum);
   return segment;
 }
 
+/**
+ * Writes --e2e-latency options for a data segment, one for each tagged byte
+ * it carries that has not been ACKed, as many as fit. Retransmissions carry
+ * them again.
+ *
+ * dst: Connection the segment is sent on.
+ * seqno: Relative sequence number of the segment.
+ * data_len: Length of its data.
+ * opt: Where to write the options.
+ * space: Room there is for them.
+ * returns: Length of the options, or 0 if there are none.
+ */
+uint16_t e2e_option(conn_t *dst, uint32_t seqno, uint16_t data_len,
+                    uint8_t *opt, uint16_t space) {
+  if (opt_e2e_bytes == 0 || dst->latency == NULL || data_len == 0)
+    return 0;
+
+  ll_node_t *node;
+  uint16_t opt_len = 0;
+  for (node = ll_front(dst->latency->tags_out);
+       node && opt_len + E2E_OPT_SIZE <= space; node = node->next) {
+    seq_mark_t *mark = node->object;
+    uint32_t offset = mark->end - 1 - seqno;
+    if ((int32_t) offset < 0)
+      continue;
+    if (offset >= data_len)
+      break;
+
+    uint16_t exid = htons(E2E_OPT_EXID);
+    uint32_t tagged = htonl(mark->end - 1);
+    uint32_t time = htonl((uint32_t) mark->time);
+    opt[opt_len] = TCPOPT_EXPERIMENT;
+    opt[opt_len + 1] = E2E_OPT_SIZE;
+    memcpy(opt + opt_len + 2, &exid, sizeof(exid));
+    memcpy(opt + opt_len + 4, &tagged, sizeof(tagged));
+    memcpy(opt + opt_len + 8, &time, sizeof(time));
+    opt_len += E2E_OPT_SIZE;
+  }
+  return opt_len;
+}
+
+/**
+ * Writes the option giving a segment's stream (--streams), if it isn't on
+ * stream 0.
+ *
+ * dst: Connection or stream the segment is sent on.
+ * opt: Where to write the option.
+ * returns: Length of the option with its padding, or 0 if there is none.
+ */
+uint16_t stream_option(conn_t *dst, uint8_t *opt) {
+  if (dst->stream == 0)
+    return 0;
+
+  uint16_t exid = htons(STREAM_OPT_EXID);
+  uint16_t stream = htons(dst->stream);
+  opt[0] = TCPOPT_NOP;
+  opt[1] = TCPOPT_NOP;
+  opt[2] = TCPOPT_EXPERIMENT;
+  opt[3] = STREAM_OPT_SIZE;
+  memcpy(opt + 4, &exid, sizeof(exid));
+  memcpy(opt + 6, &stream, sizeof(stream));
+  return 2 + STREAM_OPT_SIZE;
+}
+
+/**
+ * Finds the stream a segment that arrived on a connection belongs to, from
+ * its --streams option.
+ *
+ * conn: The connection.
+ * tcp_hdr: The segment's TCP header.
+ * returns: The stream, the connection itself for stream 0, or NULL if the
+ *          connection has no such stream.
+ */
+conn_t *stream_of(conn_t *conn, tcphdr_t *tcp_hdr) {
+  uint8_t *opt = NULL;
+  while ((opt = tcp_option(tcp_hdr, TCPOPT_EXPERIMENT, opt))) {
+    uint16_t exid, stream;
+    if (opt[1] != STREAM_OPT_SIZE)
+      continue;
+    memcpy(&exid, opt + 2, sizeof(exid));
+    if (ntohs(exid) != STREAM_OPT_EXID)
+      continue;
+    memcpy(&stream, opt + 4, sizeof(stream));
+    stream = ntohs(stream);
+    return stream < MAX_STREAMS ? conn->streams[stream] : NULL;
+  }
+  return conn;
+}
+
+/**
+ * Finds an experimental option.
+ *
+ * tcp_hdr: The TCP header.
+ * exid: The option's ExID.
+ * size: Its length.
+ * returns: The option, or NULL if there isn't one.
+ */
+uint8_t *experiment_option(tcphdr_t *tcp_hdr, uint16_t exid, uint8_t size) {
+  uint8_t *opt = NULL;
+  while ((opt = tcp_option(tcp_hdr, TCPOPT_EXPERIMENT, opt))) {
+    uint16_t id;
+    if (opt[1] != size)
+      continue;
+    memcpy(&id, opt + 2, sizeof(id));
+    if (ntohs(id) == exid)
+      return opt;
+  }
+  return NULL;
+}
+
+/**
+ * Writes the option offering or agreeing to a feature (--compress, --fec) in
+ * a SYN or SYN-ACK.
+ *
+ * opt: Where to write the option.
+ * exid: The feature's ExID.
+ * returns: Length of the option.
+ */
+uint16_t offer_option(uint8_t *opt, uint16_t exid) {
+  exid = htons(exid);
+  opt[0] = TCPOPT_EXPERIMENT;
+  opt[1] = OFFER_OPT_SIZE;
+  memcpy(opt + 2, &exid, sizeof(exid));
+  return OFFER_OPT_SIZE;
+}
+
+/**
+ * Checks whether the other host offered or agreed to a feature in its SYN or
+ * SYN-ACK.
+ *
+ * tcp_hdr: The segment's TCP header.
+ * exid: The feature's ExID.
+ */
+bool has_offer(tcphdr_t *tcp_hdr, uint16_t exid) {
+  return experiment_option(tcp_hdr, exid, OFFER_OPT_SIZE) != NULL;
+}
+
+/**
+ * Writes the MSS option (RFC 9293) for a SYN or SYN-ACK, offering the most
+ * segment data this host takes.
+ *
+ * opt: Where to write the option.
+ * returns: Length of the option.
+ */
+uint16_t mss_option(uint8_t *opt) {
+  uint16_t mss = htons(mss_offer());
+  opt[0] = TCPOPT_MAXSEG;
+  opt[1] = TCPOLEN_MAXSEG;
+  memcpy(opt + 2, &mss, sizeof(mss));
+  return TCPOLEN_MAXSEG;
+}
+
+/**
+ * Works out the most segment data a connection carries from the other host's
+ * SYN or SYN-ACK: the smaller of the two offers. A host that doesn't send the
+ * option takes MAX_SEG_DATA_SIZE.
+ *
+ * tcp_hdr: The SYN or SYN-ACK.
+ * returns: The connection's MSS.
+ */
+uint16_t mss_agreed(tcphdr_t *tcp_hdr) {
+  uint16_t mss = MAX_SEG_DATA_SIZE;
+  uint8_t *opt = tcp_option(tcp_hdr, TCPOPT_MAXSEG, NULL);
+  if (opt && opt[1] == TCPOLEN_MAXSEG) {
+    memcpy(&mss, opt + 2, sizeof(mss));
+    mss = ntohs(mss);
+  }
+  if (mss == 0 || mss > mss_offer())
+    mss = mss_offer();
+  return mss;
+}
+
+/**
+ * Writes the --fec options for a segment: the report of what has been lost,
+ * and the data segment's tag, which fec_add() has just set up.
+ *
+ * dst: Connection the segment is sent on.
+ * data_len: Length of the segment's data.
+ * opt: Where to write the options.
+ * returns: Length of the options, or 0 if there are none.
+ */
+uint16_t fec_option(conn_t *dst, uint16_t data_len, uint8_t *opt) {
+  struct conn_fec *fec = dst->fec;
+  if (fec == NULL)
+    return 0;
+
+  uint16_t exid = htons(FEC_OPT_EXID);
+  uint16_t expected = htons(fec->received_expected);
+  uint16_t lost = htons(fec->received_lost);
+  opt[0] = TCPOPT_EXPERIMENT;
+  opt[1] = FEC_REPORT_SIZE;
+  memcpy(opt + 2, &exid, sizeof(exid));
+  memcpy(opt + 4, &expected, sizeof(expected));
+  memcpy(opt + 6, &lost, sizeof(lost));
+  if (data_len == 0)
+    return FEC_REPORT_SIZE;
+
+  opt += FEC_REPORT_SIZE;
+  opt[0] = TCPOPT_NOP;
+  opt[1] = TCPOPT_NOP;
+  opt[2] = TCPOPT_EXPERIMENT;
+  opt[3] = FEC_TAG_SIZE;
+  memcpy(opt + 4, &exid, sizeof(exid));
+  opt[6] = fec->group;
+  opt[7] = (fec->index - 1) << 4 | (fec->k - 1);
+  return FEC_REPORT_SIZE + 2 + FEC_TAG_SIZE;
+}
+
+/**
+ * Writes the option on a piece of a segment pmtu_send() is splitting, from
+ * the segment it has set up.
+ *
+ * dst: Connection the piece is sent on.
+ * seqno: Relative sequence number of the piece.
+ * opt: Where to write the option.
+ * returns: Length of the option, or 0 if no segment is being split.
+ */
+uint16_t piece_option(conn_t *dst, uint32_t seqno, uint8_t *opt) {
+  struct conn_pmtu *p = dst->pmtu;
+  if (p == NULL || p->whole_len == 0)
+    return 0;
+
+  uint16_t exid = htons(PIECE_OPT_EXID);
+  uint16_t offset = htons(seqno - p->whole_start);
+  uint16_t whole_len = htons(p->whole_len);
+  opt[0] = TCPOPT_EXPERIMENT;
+  opt[1] = PIECE_OPT_SIZE;
+  memcpy(opt + 2, &exid, sizeof(exid));
+  memcpy(opt + 4, &offset, sizeof(offset));
+  memcpy(opt + 6, &whole_len, sizeof(whole_len));
+  return PIECE_OPT_SIZE;
+}
+
+/**
+ * Returns the TCP flags a segment goes out with.
+ */
+uint8_t wire_flags(uint32_t flags) {
+  /* Need to add ACK to all segments if sending it to the web. */
+  if (!run_program && !unix_socket)
+    flags |= TH_ACK;
+  return flags;
+}
+
 /**
  * Converts a segment from a cTCP segment to a raw IP packet. The resulting
  * packet must be freed.
@@ -366,16 +833,25 @@ ctcp_segment_t *convert_to_ctcp(conn_t *src, char *datagram, int actual_len) {
  * returns: A raw IP packet, NULL if it has an incorrect checksum.
  */
 char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
+  uint8_t opt[MAX_TCP_OPT_SIZE];
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t opt_len = stream_option(dst, opt);
+  opt_len += fec_option(dst, data_len, opt + opt_len);
+  opt_len += piece_option(dst, ntohl(segment->seqno), opt + opt_len);
+  opt_len += e2e_option(dst, ntohl(segment->seqno), data_len, opt + opt_len,
+                        MAX_TCP_OPT_SIZE - opt_len);
+
   /* Create IP packet with TCP payload. */
-  uint16_t tcp_pkt_len = len - sizeof(ctcp_segment_t) + TCP_HDR_SIZE;
+  uint16_t tcp_pkt_len = TCP_HDR_SIZE + opt_len + data_len;
   char *datagram = create_datagram(config->ip_addr, dst->ip_addr, tcp_pkt_len);
   iphdr_t *ip_hdr = (iphdr_t *) datagram;
   tcphdr_t *tcp_hdr = (tcphdr_t *) (datagram + IP_HDR_SIZE);
+  if (opt_len > 0)
+    memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opt, opt_len);
 
   /* Copy data over, if there is any. */
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
   if (data_len > 0 && segment->data != NULL) {
-    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE);
+    char *payload = (char *)((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opt_len);
     memcpy(payload, segment->data, data_len);
   }
 
@@ -384,12 +860,8 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
   tcp_hdr->th_dport = htons(dst->port);
   tcp_hdr->th_seq = htonl(ntohl(segment->seqno) + dst->init_seqno);
   tcp_hdr->th_ack = htonl(ntohl(segment->ackno) + dst->their_init_seqno);
-  tcp_hdr->th_off = TCP_HDR_SIZE / 4;
-  tcp_hdr->th_flags = segment->flags;
-
-  /* Need to add ACK to all segments if sending it to the web. */
-  if (!run_program && !unix_socket)
-    tcp_hdr->th_flags |= TH_ACK;
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
+  tcp_hdr->th_flags = wire_flags(segment->flags);
   tcp_hdr->th_win = segment->window;
   tcp_hdr->th_sum = 0;
 
@@ -397,14 +869,16 @@ char *convert_to_datagram(conn_t *dst, ctcp_segment_t *segment, int len) {
      checksum. If the difference is 0, then they computed the checksum
      correctly. Otherwise, an incorrect cTCP checksum will result in an
      incorrect TCP checksum. */
+  uint32_t data_sum = cksum_add(0, segment->data, data_len);
   uint16_t sum = segment->cksum;
   segment->cksum = 0;
-  uint16_t correct_sum = cksum(segment, len);
+  uint16_t correct_sum = cksum_finish(cksum_add(data_sum, segment,
+                                                sizeof(ctcp_segment_t)));
   segment->cksum = sum;
 
   /* TCP checksum. Add on the difference between the correct checksum and the
-     student's checksum. */
-  tcp_hdr->th_sum = cksum_tcp(ip_hdr, data_len);
+     student's checksum. Sums the data only once, for both. */
+  tcp_hdr->th_sum = cksum_tcp_data(ip_hdr, opt_len, data_len, data_sum);
   tcp_hdr->th_sum += (correct_sum - sum);
   return datagram;
 }
@@ -431,9 +905,20 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   if (r < FULL_HDR_SIZE)
     return 0;
 
-  /* Is this packet to us? If not, ignore it. */
+  /* Ignore a packet that didn't fit in the buffer: it is larger than this
+     host offered to take. */
   iphdr_t *ip_hdr = (iphdr_t *) buf;
+  if (ntohs(ip_hdr->tot_len) > r)
+    return 0;
+
+  /* Ignore a packet whose TCP header is shorter than the fixed part or runs
+     past the end of the packet, before its options are looked at. */
   tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
+  if (tcp_hdr->th_off < TCP_HDR_SIZE / 4 ||
+      IP_HDR_SIZE + tcp_hdr->th_off * 4 > ntohs(ip_hdr->tot_len))
+    return 0;
+
+  /* Is this packet to us? If not, ignore it. */
   if (tcp_hdr->th_dport != htons(config->port))
     return 0;
 
@@ -443,9 +928,19 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
     exit(EXIT_FAILURE);
   }
 
-  /* Otherwise a SYN or SYN-ACK? */
-  if (tcp_hdr->th_flags & TH_SYN)
+  /* Otherwise a SYN or SYN-ACK? A client's SYN-ACK goes with the connection
+     it is setting up. */
+  if (tcp_hdr->th_flags & TH_SYN) {
+    conn_t *conn;
+    for (conn = get_connections(); conn && !SERVER; conn = conn->next) {
+      if (rconn && conn->connecting &&
+          conn->port == ntohs(tcp_hdr->th_sport))
+        *rconn = conn;
+    }
+    if (capture)
+      capture_packet(capture, buf, r);
     return r;
+  }
 
   /* Some other packet from somewhere where we've already established a
      connection. Must have the correct source IP, port, and a sequence
@@ -454,12 +949,14 @@ int recv_filter(int sockfd, void *buf, size_t len, int flags, conn_t **rconn) {
   while (conn != NULL) {
     if (conn->port == ntohs(tcp_hdr->th_sport) &&
         (unix_socket || (!unix_socket && conn->ip_addr == ip_hdr->saddr)) &&
-        ntohl(tcp_hdr->th_seq) >= conn->their_init_seqno &&
-        ntohl(tcp_hdr->th_ack) >= conn->init_seqno) {
+        (int32_t) (ntohl(tcp_hdr->th_seq) - conn->their_init_seqno) >= 0 &&
+        (int32_t) (ntohl(tcp_hdr->th_ack) - conn->init_seqno) >= 0) {
       /* Return associated connection. */
       if (rconn != NULL)
         *rconn = conn;
 
+      if (capture)
+        capture_packet(capture, buf, r);
       return r;
     }
     conn = conn->next;
@@ -493,9 +990,87 @@ int send_pkt(conn_t *dst, int sockfd, const void *buf, size_t len, int flags) {
     size = sizeof(dst->saddr);
   }
 
+  if (capture)
+    capture_packet(capture, buf, len);
   return sendto(config->socket, buf, len, flags, addr, size);
 }
 
+/**
+ * Called by the emulated link when a packet comes out of it.
+ *
+ * arg: Unused.
+ * addr: Socket address to send to.
+ * addr_len: Size of the socket address.
+ * buf: The packet.
+ * len: Length of the packet.
+ */
+void link_deliver(void *arg, const void *addr, size_t addr_len,
+                  const void *buf, size_t len) {
+  if (capture)
+    capture_packet(capture, buf, len);
+
+  /* Nothing is waiting on the result, so a packet that can't be sent is as
+     good as lost on the link. Count it for the summary. */
+  if (sendto(config->socket, buf, len, 0, (struct sockaddr *) addr,
+             addr_len) < 0) {
+    emu_link_send_failed++;
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Could not send a segment out of the link: "
+              "%s\n", strerror(errno));
+  }
+}
+
+/**
+ * Sends a packet through the emulated link. The packet is copied and will
+ * reach the socket once the link lets it out (see link_deliver).
+ *
+ * dst: Destination connection object.
+ * buf: Data to send.
+ * len: Length of data.
+ *
+ * returns: Number of bytes accepted. A packet dropped by the link still counts
+ *          as sent, like segments dropped by --drop.
+ */
+int send_pkt_link(conn_t *dst, const void *buf, size_t len) {
+  if (unix_socket) {
+    link_send(emu_link, buf, len, &dst->sunaddr, sizeof(dst->sunaddr),
+              current_time_us());
+  }
+  else {
+    link_send(emu_link, buf, len, &dst->saddr, sizeof(dst->saddr),
+              current_time_us());
+  }
+  return len;
+}
+
+/**
+ * Returns the number of milliseconds until the emulated link next needs to
+ * run, or -1 if there is no link or nothing in it.
+ */
+long need_link_in() {
+  if (emu_link == NULL)
+    return -1;
+
+  long next = link_next_event(emu_link, current_time_us());
+  if (next < 0)
+    return -1;
+  return (next + 999) / 1000;
+}
+
+/**
+ * Waits until every packet still in the emulated link has been sent.
+ */
+void flush_link() {
+  long next;
+  if (emu_link == NULL)
+    return;
+
+  while ((next = link_next_event(emu_link, current_time_us())) >= 0) {
+    usleep(next);
+    link_run(emu_link, current_time_us());
+  }
+}
+
 /**
  * Send resets to previous connections, if they exist. We can tell if there are
  * lots of RSTs or ACKs being sent to us.
@@ -539,6 +1114,21 @@ void *send_resets(void *args) {
   return NULL;
 }
 
+/**
+ * Sends a TCP-connection related segment with options and data (e.g. a fast
+ * open SYN). See create_tcp_seg().
+ *
+ * returns: -1 if error, 0 otherwise.
+ */
+int send_tcp_seg(conn_t *dst, int flags, const uint8_t *opt, uint16_t opt_len,
+                 char *data, uint16_t len) {
+  char *tcp_pkt = create_tcp_seg(dst, flags, opt, opt_len, data, len);
+  int r = send_pkt(dst, config->socket, tcp_pkt,
+                   FULL_HDR_SIZE + opt_len + len, 0);
+  free(tcp_pkt);
+  return r < 0 ? -1 : 0;
+}
+
 /**
  * Sends a TCP-connection related segment (SYN, FIN, etc.).
  *
@@ -548,11 +1138,7 @@ void *send_resets(void *args) {
  * returns: -1 if error, 0 otherwise.
  */
 int send_tcp_conn_seg(conn_t *dst, int flags) {
-  char *tcp_pkt = create_tcp_seg(dst, flags, NULL, 0);
-  int r = send_pkt(dst, config->socket, tcp_pkt, FULL_HDR_SIZE, 0);
-  free(tcp_pkt);
-
-  if (r < 0) {
+  if (send_tcp_seg(dst, flags, NULL, 0, NULL, 0) < 0) {
     fprintf(stderr, "[ERROR] Could not connect\n");
     return -1;
   }
@@ -581,157 +1167,672 @@ inline int send_synack(conn_t *dst) {
  * conn: The new conn_t to add.
  */
 void conn_add(conn_t *conn) {
-  conn_t *conn_list = get_connections();
+  conn_t **conn_list = SERVER ? &config->connections : &config->sconn;
 
-  if (conn != conn_list) {
-    conn->prev = &conn_list;
-    conn->next = conn_list;
+  if (conn != *conn_list) {
+    conn->prev = conn_list;
+    conn->next = *conn_list;
 
-    if (conn_list)
-      conn_list->prev = &conn->next;
+    if (*conn_list)
+      (*conn_list)->prev = &conn->next;
   }
   conn->out_queue_tail = &conn->out_queue;
+  *conn_list = conn;
+}
 
-  if (SERVER)
-    config->connections = conn;
-  else
-    config->sconn = conn;
+/**
+ * Returns the latency histograms for a connection, creating them if needed.
+ */
+struct conn_latency *latency_of(conn_t *conn) {
+  if (conn->latency == NULL) {
+    struct conn_latency *lat = calloc(sizeof(struct conn_latency), 1);
+    int i;
+    for (i = 0; i < NUM_LATENCIES; i++)
+      hist_init(&lat->hist[i]);
+    lat->unsent = ll_create();
+    lat->unacked = ll_create();
+    lat->unoutput = ll_create();
+    lat->tags_out = ll_create();
+    lat->tags_in = ll_create();
+    lat->read_end = lat->sent_end = lat->output_end = lat->written_end = 1;
+    lat->next_tag = 1;
+    conn->latency = lat;
+  }
+  return conn->latency;
 }
 
 /**
- * Checks how much space is available in STDOUT for output. conn_output can
- * only write as many bytes as reported by conn_bufspace.
+ * Adds a mark to a list kept in sequence order. Does nothing if there is
+ * already a mark for the same point.
  *
- * conn: The connection object.
- * returns: The number of bytes that can be written out.
+ * list: The list.
+ * end: Sequence number to mark.
+ * now: Current time.
  */
-size_t conn_bufspace(conn_t *conn) {
-  chunk_t *chunk;
-  size_t used = 0;
-
-  /* Count up how much output space already used. */
-  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
-    used += (chunk->size - chunk->used);
+void mark_insert(linked_list_t *list, uint32_t end, uint64_t now) {
+  ll_node_t *node;
+  for (node = ll_back(list); node; node = node->prev) {
+    seq_mark_t *mark = node->object;
+    if (mark->end == end)
+      return;
+    if ((int32_t) (mark->end - end) < 0)
+      break;
   }
-  return used > MAX_BUF_SPACE ? 0 : MAX_BUF_SPACE - used;
+
+  seq_mark_t *mark = calloc(sizeof(seq_mark_t), 1);
+  mark->end = end;
+  mark->time = now;
+  if (node)
+    ll_add_after(list, node, mark);
+  else
+    ll_add_front(list, mark);
 }
 
 /**
- * Drain the output queue.
+ * Removes the marks up to a sequence number, recording how long each one
+ * waited.
  *
- * conn: Associated connection object.
+ * list: The list.
+ * end: Sequence number reached.
+ * hist: Histogram to record in, or NULL not to.
+ * now: Current time.
  */
-void conn_drain(conn_t *conn) {
-  chunk_t *chunk;
-  int w;
-  bool outputted = false;
-  events[STDOUT_FILENO].events &= ~POLLOUT;
+void mark_reached(linked_list_t *list, uint32_t end, histogram_t *hist,
+                  uint64_t now) {
+  ll_node_t *node;
+  while ((node = ll_front(list))) {
+    seq_mark_t *mark = node->object;
+    if ((int32_t) (mark->end - end) > 0)
+      break;
+    if (hist && !mark->retransmitted)
+      hist_record(hist, now - mark->time);
+    free(ll_remove(list, node));
+  }
+}
 
-  /* Already wrote an error, can't write anymore. */
-  if (conn->wrote_err)
-    return;
+/**
+ * Records input read from STDIN or the program.
+ */
+void latency_input(conn_t *conn, size_t len) {
+  struct conn_latency *lat = latency_of(conn);
+  uint64_t now = current_time_us();
+  lat->read_end += len;
+  mark_insert(lat->unsent, lat->read_end, now);
+
+  /* Tag the bytes that are due for --e2e-latency. */
+  while (opt_e2e_bytes && (int32_t) (lat->next_tag - lat->read_end) < 0) {
+    mark_insert(lat->tags_out, lat->next_tag + 1, now);
+    lat->next_tag += opt_e2e_bytes;
+  }
+}
 
-  /* Drain the output queue. Output as many chunks as possible. */
-  while ((chunk = conn->out_queue)) {
-    if (run_program)
-      w = write(conn->stdin, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
-    else
-      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
-                chunk->size - chunk->used);
+/**
+ * Records a segment being sent, in network order.
+ */
+void latency_sent(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  struct conn_latency *lat = latency_of(conn);
+  uint64_t now = current_time_us();
+  uint32_t end = ntohl(segment->seqno) + len - sizeof(ctcp_segment_t);
+  if (len <= sizeof(ctcp_segment_t))
+    return;
 
-    if (w < 0) {
-      if (errno != EAGAIN)
-        conn->wrote_err = true;
-      break;
+  /* Retransmission. Its ACK can't be told apart from the original's. */
+  if ((int32_t) (end - lat->sent_end) <= 0) {
+    ll_node_t *node;
+    for (node = ll_front(lat->unacked); node; node = node->next) {
+      seq_mark_t *mark = node->object;
+      if (mark->end == end)
+        mark->retransmitted = true;
     }
-    outputted = true;
-    chunk->used += w;
+    return;
+  }
 
-    /* Could not complete one chunk. Stop after this. */
-    if (chunk->used < chunk->size) {
-      events[STDOUT_FILENO].events |= POLLOUT;
-      break;
-    }
-    conn->out_queue = chunk->next;
+  lat->sent_end = end;
+  mark_reached(lat->unsent, end, &lat->hist[LAT_INPUT], now);
+  mark_insert(lat->unacked, end, now);
+}
 
-    /* Update pointers. */
-    if (!conn->out_queue)
-      conn->out_queue_tail = &conn->out_queue;
-    free(chunk);
+/**
+ * Records a segment arriving, in network order.
+ */
+void latency_received(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  struct conn_latency *lat = latency_of(conn);
+  uint64_t now = current_time_us();
+
+  if (segment->flags & TH_ACK) {
+    mark_reached(lat->unacked, ntohl(segment->ackno), &lat->hist[LAT_RTT],
+                 now);
+    mark_reached(lat->tags_out, ntohl(segment->ackno), NULL, now);
   }
 
-  /* Error in outputting if already wrote EOF but still stuff in the output
-     queue. */
-  if (conn->wrote_eof && !conn->wrote_err && !conn->out_queue)
-    conn->wrote_err = true;
+  uint32_t end = ntohl(segment->seqno) + len - sizeof(ctcp_segment_t);
+  if (len > sizeof(ctcp_segment_t) && (int32_t) (end - lat->output_end) > 0)
+    mark_insert(lat->unoutput, end, now);
+}
 
-  /* Output queue has space. Call student code. */
-  if (outputted && !conn->delete_me)
-    ctcp_output(conn->state);
+/**
+ * Records data being output (queued or written).
+ */
+void latency_output(conn_t *conn, size_t len) {
+  struct conn_latency *lat = latency_of(conn);
+  lat->output_end += len;
+  mark_reached(lat->unoutput, lat->output_end, &lat->hist[LAT_REASSEMBLY],
+               current_time_us());
 }
 
 /**
- * Removes a connection object from the conn_t list.
- *
- * conn: The conn_t to free.
+ * Records the peer's send times for tagged bytes, from the --e2e-latency
+ * options of a segment that arrived. The times are taken to be within 2^31 us
+ * of now, on the same clock.
  */
-void conn_free(conn_t *conn) {
-  /* Free up chunks. */
-  chunk_t *chunk, *next_chunk;
-  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
-    next_chunk = chunk->next;
-    free(chunk);
+void latency_tagged(conn_t *conn, tcphdr_t *tcp_hdr) {
+  uint8_t *opt = NULL;
+  while ((opt = tcp_option(tcp_hdr, TCPOPT_EXPERIMENT, opt))) {
+    uint16_t exid;
+    if (opt[1] != E2E_OPT_SIZE)
+      continue;
+    memcpy(&exid, opt + 2, sizeof(exid));
+    if (ntohs(exid) != E2E_OPT_EXID)
+      continue;
+
+    struct conn_latency *lat = latency_of(conn);
+    uint64_t now = current_time_us();
+    uint32_t tagged, time;
+    memcpy(&tagged, opt + 4, sizeof(tagged));
+    memcpy(&time, opt + 8, sizeof(time));
+    tagged = ntohl(tagged);
+    if ((int32_t) (tagged + 1 - lat->written_end) > 0)
+      mark_insert(lat->tags_in, tagged + 1,
+                  now - (uint32_t) ((uint32_t) now - ntohl(time)));
   }
+}
+
+/**
+ * Records data being written to STDOUT or the program.
+ */
+void latency_written(conn_t *conn, size_t len) {
+  struct conn_latency *lat = latency_of(conn);
+  lat->written_end += len;
+  mark_reached(lat->tags_in, lat->written_end, &lat->hist[LAT_END_TO_END],
+               current_time_us());
+}
+
+/**
+ * Prints a set of latency histograms.
+ */
+void print_latency(const char *name, const histogram_t *hist) {
+  int i;
+  fprintf(stderr, "[INFO] Latency for %s, in microseconds:\n", name);
+  for (i = 0; i < NUM_LATENCIES; i++) {
+    if (i != LAT_END_TO_END || opt_e2e_bytes)
+      hist_print(stderr, latency_names[i], &hist[i]);
+  }
+}
+
+/**
+ * Prints the histograms for every connection still open, and for all
+ * connections together.
+ */
+void print_all_latency() {
+  histogram_t all[NUM_LATENCIES];
+  char name[INET_ADDRSTRLEN + 16];
+  conn_t *conn;
+  int i;
+
+  memcpy(all, closed_latency, sizeof(all));
+  for (conn = get_connections(); conn; conn = conn->next) {
+    int s;
+    for (s = 0; s < opt_streams; s++) {
+      conn_t *stream = s ? conn->streams[s] : conn;
+      if (stream == NULL || stream->latency == NULL)
+        continue;
+      for (i = 0; i < NUM_LATENCIES; i++)
+        hist_merge(&all[i], &stream->latency->hist[i]);
+      conn_name(stream, name, sizeof(name));
+      print_latency(name, stream->latency->hist);
+    }
+  }
+  print_latency("all connections", all);
+}
+
+/**
+ * Prints a connection's histograms and adds them to the totals, then frees
+ * them.
+ */
+void latency_free(conn_t *conn) {
+  struct conn_latency *lat = conn->latency;
+  char name[INET_ADDRSTRLEN + 16];
+  int i;
+
+  conn_name(conn, name, sizeof(name));
+  print_latency(name, lat->hist);
+  for (i = 0; i < NUM_LATENCIES; i++)
+    hist_merge(&closed_latency[i], &lat->hist[i]);
+
+  linked_list_t *lists[] = { lat->unsent, lat->unacked, lat->unoutput,
+                             lat->tags_out, lat->tags_in };
+  for (i = 0; i < 5; i++) {
+    while (ll_length(lists[i]) > 0)
+      free(ll_remove(lists[i], ll_front(lists[i])));
+    ll_destroy(lists[i]);
+  }
+  free(lat);
+  conn->latency = NULL;
+}
+
+/**
+ * Signal handler for SIGUSR1. The histograms are printed from the main loop.
+ */
+void handle_sigusr1(int sig) {
+  dump_latency = 1;
+}
+
+/**
+ * Returns the statistics for a connection, claiming a slot for it the first
+ * time. See ctcp_sys.h.
+ */
+ctcp_stats_t *conn_stats(conn_t *conn) {
+  if (opt_stats && conn->stats == NULL) {
+    char name[STATS_NAME_SIZE];
+    conn_name(conn, name, sizeof(name));
+    conn->stats = stats_claim(name);
+    conn->sent_end = conn->received_end = conn->last_ackno = 1;
+  }
+  return conn->stats;
+}
+
+/**
+ * Counts a segment being sent, in network order. A segment that doesn't go
+ * past what has already been sent is a retransmission. One segment at a time
+ * is timed for the smoothed RTT, and not if it is retransmitted (Karn's
+ * algorithm). Keepalives need how far it goes and what it ACKs too.
+ */
+void stats_sent(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  ctcp_stats_t *stats = conn_stats(conn);
+  size_t data_len = len - sizeof(ctcp_segment_t);
+  stats_add(stats, STAT_SEGMENTS_SENT, 1);
+  stats_add(stats, STAT_BYTES_SENT, data_len);
+  if (segment->flags & TH_ACK)
+    conn->sent_ackno = ntohl(segment->ackno);
+
+  /* A FIN takes up a sequence number. */
+  uint32_t end = ntohl(segment->seqno) + data_len +
+                 ((segment->flags & TH_FIN) ? 1 : 0);
+  if (end == ntohl(segment->seqno))
+    return;
+
+  if ((int32_t) (end - conn->sent_end) <= 0) {
+    stats_add(stats, STAT_RETRANSMITS, 1);
+    if (conn->rtt_start && (int32_t) (end - conn->rtt_end) >= 0)
+      conn->rtt_start = 0;
+    return;
+  }
+  conn->sent_end = end;
+  if (!conn->rtt_start) {
+    conn->rtt_end = end;
+    conn->rtt_start = current_time_us();
+  }
+}
+
+/**
+ * Counts a segment arriving, in network order. Nothing more is read into one
+ * whose checksum is wrong (corrupted).
+ */
+void stats_received(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                    bool corrupted) {
+  ctcp_stats_t *stats = conn_stats(conn);
+  size_t data_len = len - sizeof(ctcp_segment_t);
+  stats_add(stats, STAT_SEGMENTS_RECEIVED, 1);
+  stats_add(stats, STAT_BYTES_RECEIVED, data_len);
+  if (corrupted) {
+    stats_add(stats, STAT_CKSUM_FAILURES, 1);
+    return;
+  }
+
+  /* ACKs. A pure ACK for what was already ACKed, while there is data still
+     out, is a duplicate. */
+  uint32_t ackno = ntohl(segment->ackno);
+  if (segment->flags & TH_ACK) {
+    if (ackno == conn->last_ackno && data_len == 0 &&
+        !(segment->flags & TH_FIN) &&
+        (int32_t) (conn->sent_end - ackno) > 0)
+      stats_add(stats, STAT_DUP_ACKS, 1);
+    if ((int32_t) (ackno - conn->last_ackno) > 0)
+      conn->last_ackno = ackno;
+
+    if (stats && conn->rtt_start && (int32_t) (ackno - conn->rtt_end) >= 0) {
+      uint64_t rtt = current_time_us() - conn->rtt_start;
+      uint64_t srtt = stats_get(stats, STAT_SRTT);
+      stats_set(stats, STAT_SRTT, srtt ? srtt - srtt / 8 + rtt / 8 : rtt);
+      conn->rtt_start = 0;
+    }
+  }
+
+  /* Data that leaves a gap after what has arrived so far. */
+  uint32_t seqno = ntohl(segment->seqno);
+  uint32_t end = seqno + data_len + ((segment->flags & TH_FIN) ? 1 : 0);
+  if (end != seqno) {
+    if ((int32_t) (seqno - conn->received_end) > 0)
+      stats_add(stats, STAT_OUT_OF_ORDER, 1);
+    if ((int32_t) (end - conn->received_end) > 0)
+      conn->received_end = end;
+  }
+}
+
+/**
+ * Signal handler for SIGINT and SIGTERM when statistics, a capture, the log or
+ * the counters are on.
+ * Removes the statistics region straight away, and leaves the rest to
+ * exit_on_signal() from the main loop.
+ */
+void handle_exit_signal(int sig) {
+  stats_unlink();
+  exit_signal = sig;
+}
+
+/**
+ * Closes the capture at exit.
+ */
+void close_capture() {
+  if (capture)
+    capture_close(capture);
+  capture = NULL;
+}
+
+/**
+ * Writes out the rest of the log at exit.
+ */
+void close_logger() {
+  if (logger == NULL)
+    return;
+  if (logger_dropped(logger) > 0)
+    fprintf(stderr, "[INFO] Log dropped %lu segments (writer fell behind)\n",
+            (unsigned long) logger_dropped(logger));
+  logger_close(logger);
+  logger = NULL;
+}
+
+/**
+ * Frees the emulated link and its delivery trace at exit.
+ */
+void close_link() {
+  if (emu_link)
+    link_destroy(emu_link);
+  emu_link = NULL;
+  free(link_cfg.trace_us);
+  link_cfg.trace_us = NULL;
+}
+
+/**
+ * Reports the performance counters at exit.
+ */
+void close_perf() {
+  if (perf == NULL)
+    return;
+  perf_print(perf, stderr);
+  perf_close(perf);
+  perf = NULL;
+}
+
+/**
+ * Finishes the capture, log and counters after SIGINT or SIGTERM, then dies
+ * of the signal as it would have.
+ */
+void exit_on_signal() {
+  int sig = exit_signal;
+  close_capture();
+  close_logger();
+  close_perf();
+  signal(sig, SIG_DFL);
+  raise(sig);
+}
+
+/**
+ * Checks how much space is available in STDOUT for output. conn_output can
+ * only write as many bytes as reported by conn_bufspace.
+ *
+ * conn: The connection object.
+ * returns: The number of bytes that can be written out.
+ */
+size_t conn_bufspace(conn_t *conn) {
+  chunk_t *chunk;
+  size_t used = 0;
+
+  /* Count up how much output space already used. There is always room for
+     two of the connection's largest segments. */
+  size_t space = 2 * conn->mss > MAX_BUF_SPACE ? 2 * conn->mss : MAX_BUF_SPACE;
+  for (chunk = conn->out_queue; chunk; chunk = chunk->next) {
+    used += (chunk->size - chunk->used);
+  }
+  return used > space ? 0 : space - used;
+}
+
+/**
+ * Returns the most data a segment on this connection can carry, as agreed on
+ * in the handshake.
+ *
+ * conn: The connection object.
+ */
+size_t conn_mss(conn_t *conn) {
+  return conn->mss;
+}
+
+/**
+ * Passes an EOF the student code outputted on, once everything before it has
+ * been written: a program's input is closed so it sees the end of it (e.g. cat
+ * exits), as is a client's STDOUT, so whatever reads it needn't wait for the
+ * client to linger in TIME_WAIT. Nothing can be written after that.
+ *
+ * conn: Associated connection object.
+ */
+void output_eof(conn_t *conn) {
+  if (!conn->wrote_eof || conn->wrote_err || conn->out_queue)
+    return;
+  if (run_program || conn->parent) {
+    close(conn->stdin);
+    conn->stdin = -1;
+  }
+  else if (!SERVER) {
+    /* /dev/null in its place, so nothing else opened gets its number. */
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+  conn->wrote_err = true;
+}
+
+/**
+ * Drain the output queue.
+ *
+ * conn: Associated connection object.
+ */
+void conn_drain(conn_t *conn) {
+  chunk_t *chunk;
+  int w;
+  bool outputted = false;
+  events[STDOUT_FILENO].events &= ~POLLOUT;
+
+  /* Already wrote an error, can't write anymore. */
+  if (conn->wrote_err)
+    return;
+
+  /* Drain the output queue. Output as many chunks as possible. */
+  while ((chunk = conn->out_queue)) {
+    if (run_program || conn->parent)
+      w = write(conn->stdin, chunk->buf + chunk->used,
+                chunk->size - chunk->used);
+    else
+      w = write(STDOUT_FILENO, chunk->buf + chunk->used,
+                chunk->size - chunk->used);
+
+    if (w < 0) {
+      if (errno != EAGAIN)
+        conn->wrote_err = true;
+      break;
+    }
+    outputted = true;
+    chunk->used += w;
+    if (opt_e2e_bytes && !conn->compress)
+      latency_written(conn, w);
+    if (conn->stats)
+      stats_set(conn->stats, STAT_OUT_QUEUE,
+                stats_get(conn->stats, STAT_OUT_QUEUE) - w);
+
+    /* Could not complete one chunk. Stop after this. */
+    if (chunk->used < chunk->size) {
+      events[STDOUT_FILENO].events |= POLLOUT;
+      break;
+    }
+    conn->out_queue = chunk->next;
+    if (conn->latency)
+      hist_record(&conn->latency->hist[LAT_OUTPUT_QUEUE],
+                  current_time_us() - chunk->queued_us);
+
+    /* Update pointers. */
+    if (!conn->out_queue)
+      conn->out_queue_tail = &conn->out_queue;
+    free(chunk);
+  }
+
+  /* The queue ran out behind an EOF. */
+  output_eof(conn);
+
+  /* Output queue has space. Call student code. */
+  if (outputted && !conn->delete_me)
+    ctcp_output(conn->state);
+}
+
+/**
+ * Frees a connection's forward error correction state.
+ */
+void fec_free(struct conn_fec *fec) {
+  int i;
+  free(fec->parity.data);
+  for (i = 0; i < FEC_GROUPS; i++)
+    free(fec->groups[i].xor.data);
+  free(fec);
+}
+
+/**
+ * Removes a connection object from the conn_t list.
+ *
+ * conn: The conn_t to free.
+ */
+void conn_free(conn_t *conn) {
+  CTCP_TRACE(conn_destroy, conn, conn->ip_addr, conn->port);
+  if (conn->latency)
+    latency_free(conn);
+  stats_release(conn->stats);
+
+  free(conn->syn_data);
+  if (conn->compress) {
+    char name[INET_ADDRSTRLEN + 16];
+    conn_name(conn, name, sizeof(name));
+    fprintf(stderr, "[INFO] Compression for %s: sent %lu bytes as %lu, "
+            "received %lu as %lu\n", name,
+            (unsigned long) conn->compress->read,
+            (unsigned long) conn->compress->sent,
+            (unsigned long) conn->compress->written,
+            (unsigned long) conn->compress->received);
+    free(conn->compress);
+  }
+  if (conn->fec) {
+    char name[INET_ADDRSTRLEN + 16];
+    conn_name(conn, name, sizeof(name));
+    fprintf(stderr, "[INFO] FEC for %s: sent %lu parity segments, rebuilt %lu "
+            "lost segments", name, (unsigned long) conn->fec->parity_sent,
+            (unsigned long) conn->fec->recovered);
+    if (conn->fec->loss >= 0)
+      fprintf(stderr, ", %.1f%% loss reported", conn->fec->loss * 100);
+    fprintf(stderr, "\n");
+    fec_free(conn->fec);
+  }
+  if (conn->pmtu) {
+    char name[INET_ADDRSTRLEN + 16];
+    conn_name(conn, name, sizeof(name));
+    fprintf(stderr, "[INFO] Path MTU for %s: %d bytes, %lu of %lu probes "
+            "lost\n", name, conn->pmtu->size,
+            (unsigned long) conn->pmtu->probes_lost,
+            (unsigned long) conn->pmtu->probes);
+    free(conn->pmtu);
+  }
+  if (conn->pieces) {
+    free(conn->pieces->segment);
+    free(conn->pieces);
+  }
+
+  /* Free up chunks. */
+  chunk_t *chunk, *next_chunk;
+  for (chunk = conn->out_queue; chunk; chunk = next_chunk) {
+    next_chunk = chunk->next;
+    free(chunk);
+  }
+
+  /* Adjust pointers. A client's streams aren't in the list and don't take up
+     a slot. */
+  if (SERVER && !conn->parent)
+    num_connected--;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  if (conn->prev)
+    *conn->prev = conn->next;
 
-  /* Adjust pointers. */
-  if (conn->next)
-    conn->next->prev = conn->prev;
-  if (conn->prev)
-    *conn->prev = conn->next;
-
   if (conn == get_connections()) {
     if (SERVER)
-      config->connections = NULL;
+      config->connections = conn->next;
     else
-      config->sconn = NULL;
+      config->sconn = conn->next;
   }
 
   /* Close pipes to program, if it's running. */
-  if (run_program) {
+  if (run_program || conn->parent) {
     close(conn->stdin);
     close(conn->stdout);
   }
+
+  /* Its streams have finished too (see conn_done()). */
+  int s;
+  for (s = 1; s < opt_streams; s++) {
+    if (conn->streams[s])
+      conn_free(conn->streams[s]);
+  }
   free(conn);
 }
 
 /**
- * Reads input that then needs to be put into segments to send off. Reads up to
- * to len bytes.
+ * Returns whether a connection and all its streams have been removed, so it
+ * can be freed.
+ */
+bool conn_done(conn_t *conn) {
+  int s;
+  for (s = 1; s < opt_streams; s++) {
+    if (conn->streams[s] && !conn->streams[s]->delete_me)
+      return false;
+  }
+  return conn->delete_me;
+}
+
+/**
+ * Reads input from STDIN, the program or the stream's file descriptor. Reads
+ * up to len bytes.
  *
  * conn: The connection object.
  * buf: Buffer to read
  * len: Maximum number of bytes to read.
- * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
- *          no data is available, returns 0. The library will call ctcp_read
- *          again once data is available from conn_input.
+ * returns: -1 if error or EOF, otherwise the actual number of bytes read, 0
+ *          if none are available.
  */
-int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
+int read_input(conn_t *conn, void *buf, size_t len) {
   int r;
 
-  /* Check parameters. */
-  if (conn == NULL || buf == NULL) {
-    fprintf(stderr, "[ERROR] NULL parameters in conn_input\n");
-    return -1;
-  }
-
   /* Already read EOF. */
   if (conn->read_eof) {
     return -1;
   }
 
-  /* Read from the appropriate place (STOUT of the associated program). */
-  if (run_program)
+  /* Read from the appropriate place (STOUT of the associated program, or the
+     stream's own file descriptor). */
+  if (run_program || conn->parent)
     r = read(conn->stdout, buf, len);
   else if (unix_socket)
     r = read(STDIN_FILENO, buf, len);
@@ -756,10 +1857,154 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
   else if (r < 0 && errno == EAGAIN) {
     r = 0;
   }
+  return r;
+}
+
+/**
+ * Puts a block of input into a frame for --compress, compressed if that saves
+ * enough. After a block that doesn't compress, the next few aren't tried
+ * (see COMPRESS_MAX_SKIP), so incompressible input costs little.
+ *
+ * c: Compression state of the connection.
+ * block: The block.
+ * len: Its length, at most COMPRESS_BLOCK_SIZE.
+ */
+void compress_block(struct conn_compress *c, const uint8_t *block,
+                    uint16_t len) {
+  uint8_t *data = c->out + COMPRESS_HDR_SIZE;
+  size_t n = 0;
+
+  if (len >= COMPRESS_MIN_BLOCK && c->skip > 0) {
+    c->skip--;
+  }
+  else if (len >= COMPRESS_MIN_BLOCK) {
+    n = lz_compress(block, len, data, len - len / COMPRESS_MIN_SAVING);
+    if (n == 0) {
+      c->backoff = c->backoff ? c->backoff * 2 : 1;
+      if (c->backoff > COMPRESS_MAX_SKIP)
+        c->backoff = COMPRESS_MAX_SKIP;
+      c->skip = c->backoff;
+    }
+    else {
+      c->backoff = 0;
+    }
+  }
+
+  if (n == 0) {
+    memcpy(data, block, len);
+    n = len;
+  }
+  uint16_t frame_len = htons(n);
+  uint16_t block_len = htons(len);
+  c->out[0] = n < len ? COMPRESS_FRAME_LZ : COMPRESS_FRAME_RAW;
+  memcpy(c->out + 1, &frame_len, sizeof(frame_len));
+  memcpy(c->out + 3, &block_len, sizeof(block_len));
+  c->out_len = COMPRESS_HDR_SIZE + n;
+  c->out_used = 0;
+  c->read += len;
+  c->sent += c->out_len;
+}
+
+/**
+ * Reads input that then needs to be put into segments to send off. Reads up to
+ * to len bytes.
+ *
+ * conn: The connection object.
+ * buf: Buffer to read
+ * len: Maximum number of bytes to read.
+ * returns: -1 if error or EOF, otherwise the actual number of bytes read. If
+ *          no data is available, returns 0. The library will call ctcp_read
+ *          again once data is available from conn_input.
+ */
+int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
+  int r;
 
+  /* Check parameters. */
+  if (conn == NULL || buf == NULL) {
+    fprintf(stderr, "[ERROR] NULL parameters in conn_input\n");
+    return -1;
+  }
+
+  /* Input that was read early to go with the SYN (--fast-open). */
+  if (!SERVER && conn->syn_data_read < conn->syn_data_len) {
+    r = conn->syn_data_len - conn->syn_data_read;
+    if ((size_t) r > len)
+      r = len;
+    memcpy(buf, conn->syn_data + conn->syn_data_read, r);
+    conn->syn_data_read += r;
+    return r;
+  }
+
+  /* Compressed: hand out the frame of the last block read, then read the
+     next. */
+  struct conn_compress *c = conn->compress;
+  if (c == NULL) {
+    r = read_input(conn, buf, len);
+  }
+  else {
+    if (c->out_used == c->out_len) {
+      uint8_t block[COMPRESS_BLOCK_SIZE];
+      r = read_input(conn, block, sizeof(block));
+      if (r <= 0)
+        return r;
+      compress_block(c, block, r);
+    }
+    r = c->out_len - c->out_used;
+    if ((size_t) r > len)
+      r = len;
+    memcpy(buf, c->out + c->out_used, r);
+    c->out_used += r;
+  }
+
+  if (opt_histograms && r > 0)
+    latency_input(conn, r);
   return r;
 }
 
+/**
+ * Notes that something arrived from the other end of a connection, so it
+ * isn't idle (--keepalive, --idle-timeout).
+ *
+ * conn: The connection.
+ */
+void conn_heard(conn_t *conn) {
+  conn->heard_at = current_time_us();
+  conn->keepalives = 0;
+  conn->keepalive_due = conn->heard_at + opt_keepalive * 1000000ULL;
+}
+
+/**
+ * Tears down a connection whose other end has gone quiet or started over: the
+ * student code's state for it and its streams, and the program run for it,
+ * which is killed.
+ *
+ * conn: The connection.
+ * why: What to log as the reason.
+ */
+void conn_reap(conn_t *conn, const char *why) {
+  char name[INET_ADDRSTRLEN + 16];
+  conn_name(conn, name, sizeof(name));
+  fprintf(stderr, "[INFO] Reaping connection %s: %s\n", name, why);
+  stats_add(conn_stats(conn), STAT_REAPED, 1);
+
+  if (conn->pid > 0) {
+    kill(conn->pid, SIGKILL);
+    waitpid(conn->pid, NULL, 0);
+    conn->pid = 0;
+  }
+
+  /* Streams first: once the connection itself is gone, a client may exit
+     (see end_client()). */
+  int s;
+  for (s = 1; s < opt_streams; s++) {
+    conn_t *stream = conn->streams[s];
+    if (stream && !stream->delete_me)
+      ctcp_destroy(stream->state);
+  }
+  if (!conn->delete_me)
+    ctcp_destroy(conn->state);
+}
+
 /**
  * Schedules a connection object for removal.
  *
@@ -768,16 +2013,509 @@ int conn_input(conn_t *conn, void *buf, size_t len) { ASSERT_CONN;
 void conn_remove(conn_t *conn) {
   conn->delete_me = true;
 
-  /* Log to tester that this connection has been removed (as a result to a call
-     to ctcp_destroy). */
-  if (test_debug_on) {
-    fprintf(stderr, DEBUG_TEARDOWN);
+  /* Log to tester that this connection has been removed (as a result to a call
+     to ctcp_destroy). */
+  if (test_debug_on) {
+    fprintf(stderr, DEBUG_TEARDOWN);
+  }
+}
+
+/**
+ * Sets up forward error correction (--fec) for a connection.
+ *
+ * mss: The connection's MSS, which the blocks hold.
+ */
+struct conn_fec *fec_new(uint16_t mss) {
+  struct conn_fec *fec = calloc(sizeof(struct conn_fec), 1);
+  int i;
+  fec->k = FEC_INIT_K;
+  fec->mss = mss;
+  fec->loss = -1;
+  fec->parity.data = calloc(mss, 1);
+  for (i = 0; i < FEC_GROUPS; i++)
+    fec->groups[i].xor.data = calloc(mss, 1);
+  return fec;
+}
+
+/**
+ * Empties a block, keeping its data.
+ *
+ * b: The block.
+ * len: How much of its data has been used.
+ */
+void fec_block_clear(struct fec_block *b, size_t len) {
+  uint8_t *data = b->data;
+  memset(data, 0, len);
+  memset(b, 0, sizeof(*b));
+  b->data = data;
+}
+
+/**
+ * XORs a segment into a group's block.
+ *
+ * b: The block.
+ * segment: The segment, as it goes over the wire.
+ * len: Its length.
+ */
+void fec_xor(struct fec_block *b, ctcp_segment_t *segment, size_t len) {
+  size_t data_len = len - sizeof(ctcp_segment_t);
+  size_t i;
+  b->seqno ^= segment->seqno;
+  b->ackno ^= segment->ackno;
+  b->len ^= htons(len);
+  b->window ^= segment->window;
+  b->flags ^= segment->flags;
+  for (i = 0; i < data_len; i++)
+    b->data[i] ^= segment->data[i];
+}
+
+/**
+ * [Sending]
+ * Estimates the loss from the other end's reports, once they cover enough
+ * segments, and picks k for the next group from it.
+ */
+uint8_t fec_pick_k(struct conn_fec *fec) {
+  uint16_t expected = fec->expected - fec->expected_mark;
+  uint16_t lost = fec->lost - fec->lost_mark;
+  if (expected >= FEC_ADAPT_SEGMENTS) {
+    double sample = lost < expected ? (double) lost / expected : 1;
+    fec->loss = fec->loss < 0 ? sample : fec->loss * 7 / 8 + sample / 8;
+    fec->expected_mark = fec->expected;
+    fec->lost_mark = fec->lost;
+  }
+  if (fec->loss < 0)
+    return fec->k;
+
+  double k = 1 / (FEC_GROUP_LOSSES * fec->loss) - 1;
+  return k < 1 ? 1 : k > FEC_MAX_K ? FEC_MAX_K : (uint8_t) k;
+}
+
+/**
+ * [Sending]
+ * Adds a data segment to the group being sent, just before it is sent.
+ * fec_option() tags it from the same state.
+ *
+ * conn: Connection the segment is sent on.
+ * segment: The segment.
+ * len: Its length.
+ */
+void fec_add(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  struct conn_fec *fec = conn->fec;
+  if (opt_stats && fec->index == 0)
+    stats_set(conn_stats(conn), STAT_FEC_K, fec->k);
+
+  uint32_t flags = segment->flags;
+  segment->flags = wire_flags(flags);
+  fec_xor(&fec->parity, segment, len);
+  segment->flags = flags;
+  if (len - sizeof(ctcp_segment_t) > fec->parity_len)
+    fec->parity_len = len - sizeof(ctcp_segment_t);
+  fec->index++;
+}
+
+/**
+ * [Sending]
+ * Sends the parity segment of a group once all its data segments have been
+ * sent, and starts the next group. Parity segments are dropped by --drop like
+ * any other, but aren't logged, duplicated, delayed or corrupted.
+ *
+ * conn: Connection to send it on.
+ */
+void fec_send_parity(conn_t *conn) {
+  struct conn_fec *fec = conn->fec;
+  uint8_t opt[MAX_TCP_OPT_SIZE];
+  uint16_t opt_len = stream_option(conn, opt);
+  opt_len += fec_option(conn, 0, opt + opt_len);
+
+  uint16_t exid = htons(FEC_OPT_EXID);
+  uint8_t *p = opt + opt_len;
+  p[0] = TCPOPT_NOP;
+  p[1] = TCPOPT_EXPERIMENT;
+  p[2] = FEC_PARITY_SIZE;
+  memcpy(p + 3, &exid, sizeof(exid));
+  p[5] = fec->group;
+  p[6] = fec->k;
+  p[7] = fec->parity.flags;
+  memcpy(p + 8, &fec->parity.seqno, sizeof(uint32_t));
+  memcpy(p + 12, &fec->parity.ackno, sizeof(uint32_t));
+  memcpy(p + 16, &fec->parity.len, sizeof(uint16_t));
+  memcpy(p + 18, &fec->parity.window, sizeof(uint16_t));
+  opt_len += 1 + FEC_PARITY_SIZE;
+
+  /* Over raw IP, it isn't split up like data segments are (see pmtu_send()),
+     so leave off what doesn't fit the path. The receiver can't rebuild a
+     segment longer than what's left (see fec_recover()). */
+  uint16_t parity_len = fec->parity_len;
+  if (conn->pmtu &&
+      FULL_HDR_SIZE + opt_len + parity_len > conn->pmtu->size) {
+    if (conn->pmtu->size > FULL_HDR_SIZE + opt_len)
+      parity_len = conn->pmtu->size - FULL_HDR_SIZE - opt_len;
+    else
+      parity_len = 0;
+  }
+
+  /* The sequence and ACK numbers don't mean anything: the receiver takes it
+     out before the student code sees it. */
+  uint16_t tcp_len = TCP_HDR_SIZE + opt_len + parity_len;
+  char *pkt = create_datagram(config->ip_addr, conn->ip_addr, tcp_len);
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *tcp_hdr = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE, opt, opt_len);
+  memcpy((uint8_t *) tcp_hdr + TCP_HDR_SIZE + opt_len, fec->parity.data,
+         parity_len);
+  tcp_hdr->th_sport = htons(config->port);
+  tcp_hdr->th_dport = htons(conn->port);
+  tcp_hdr->th_seq = htonl(conn->next_seqno);
+  tcp_hdr->th_ack = htonl(conn->ackno);
+  tcp_hdr->th_off = (TCP_HDR_SIZE + opt_len) / 4;
+  tcp_hdr->th_flags = TH_ACK;
+  tcp_hdr->th_win = htons(ctcp_cfg->recv_window);
+  tcp_hdr->th_sum = 0;
+  tcp_hdr->th_sum = cksum_tcp(ip_hdr, opt_len + parity_len);
+
+  if (!test_debug_on && rand_percent(0) < opt_drop) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Dropping parity segment\n");
+  }
+  else {
+    if (emu_link != NULL)
+      send_pkt_link(conn, pkt, ntohs(ip_hdr->tot_len));
+    else
+      send_pkt(conn, config->socket, pkt, ntohs(ip_hdr->tot_len), 0);
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Sent parity segment for group %d\n",
+              fec->group);
+  }
+  free(pkt);
+  fec->parity_sent++;
+  if (opt_stats)
+    stats_add(conn_stats(conn), STAT_FEC_PARITY, 1);
+
+  /* Next group. */
+  fec->group++;
+  fec->index = 0;
+  fec_block_clear(&fec->parity, fec->parity_len);
+  fec->parity_len = 0;
+  fec->k = fec_pick_k(fec);
+}
+
+/**
+ * Turns a segment into an IP packet and sends it, through the emulated link
+ * if there is one.
+ *
+ * conn: Connection to send it on.
+ * segment: The segment.
+ * len: Its length.
+ * forked: Whether this is a process forked for --duplicate or --delay, which
+ *         can't wait on the emulated link.
+ * returns: The number of bytes of the segment sent, or -1 if there was an
+ *          error (with errno set).
+ */
+int send_datagram(conn_t *conn, ctcp_segment_t *segment, size_t len,
+                  bool forked) {
+  char *pkt = convert_to_datagram(conn, segment, len);
+  uint16_t total_len = ntohs(((iphdr_t *) pkt)->tot_len);
+  uint16_t hdr_len = total_len - (len - sizeof(ctcp_segment_t));
+  int n;
+  if (emu_link != NULL && !forked)
+    n = send_pkt_link(conn, pkt, total_len);
+  else
+    n = send_pkt(conn, config->socket, pkt, total_len, 0);
+  free(pkt);
+
+  /* The return value is the size of the TCP segment instead of the cTCP
+     segment, so subtract the difference. */
+  if (n >= (long int)TCP_HDR_SIZE)
+    return n - (hdr_len - sizeof(ctcp_segment_t));
+  return n;
+}
+
+/**
+ * Returns the room to leave for TCP options in a connection's segments, on
+ * top of the headers: none unless it sends any.
+ */
+uint16_t pmtu_room(conn_t *conn) {
+  if (conn->stream || conn->fec || (opt_e2e_bytes && conn->latency))
+    return MAX_TCP_OPT_SIZE;
+  return 0;
+}
+
+/**
+ * Sets up path MTU discovery for a connection over raw IP, once its MSS has
+ * been agreed on.
+ *
+ * conn: The connection.
+ */
+struct conn_pmtu *pmtu_new(conn_t *conn) {
+  struct conn_pmtu *p = calloc(sizeof(struct conn_pmtu), 1);
+  p->ceiling = FULL_HDR_SIZE + pmtu_room(conn) + conn->mss;
+  if (config->mtu > 0 && config->mtu < p->ceiling)
+    p->ceiling = config->mtu;
+  p->size = p->ceiling < PMTU_BASE ? p->ceiling : PMTU_BASE;
+  p->high = p->ceiling + 1;
+  return p;
+}
+
+/**
+ * Whether the search for a connection's path MTU is over for now.
+ */
+bool pmtu_done(struct conn_pmtu *p) {
+  return p->high - p->size <= PMTU_SEARCH_STEP;
+}
+
+/**
+ * Notes that the probe in flight was lost, so the path MTU is smaller.
+ *
+ * p: The connection's state.
+ */
+void pmtu_probe_lost(struct conn_pmtu *p) {
+  if (DEBUG)
+    fprintf(stderr, "[DEBUG] Lost a probe of %d bytes\n", p->probe);
+  p->high = p->probe;
+  p->probe = 0;
+  p->probes_lost++;
+  if (pmtu_done(p))
+    p->raise_at = current_time_us() + PMTU_RAISE_INTERVAL * 1000000ULL;
+}
+
+/**
+ * Notes an ACK that came in on a connection over raw IP. It may have
+ * confirmed the probe in flight.
+ *
+ * conn: The connection.
+ * ackno: The relative ACK number.
+ */
+void pmtu_acked(conn_t *conn, uint32_t ackno) {
+  struct conn_pmtu *p = conn->pmtu;
+  if ((int32_t) (ackno - p->acked) <= 0)
+    return;
+  p->acked = ackno;
+  p->retransmits = 0;
+
+  if (p->probe && (int32_t) (ackno - p->probe_end) >= 0) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Path takes %d bytes\n", p->probe);
+    p->size = p->probe;
+    p->probe = 0;
+    if (pmtu_done(p))
+      p->raise_at = current_time_us() + PMTU_RAISE_INTERVAL * 1000000ULL;
+  }
+}
+
+/**
+ * Sends a segment over raw IP, in pieces that fit the path MTU found so far.
+ * New data that doesn't fit goes out with a probe of a larger size as its
+ * first piece, if the search isn't over. A probe is lost if its data has to
+ * be sent again, or if the interface won't take it.
+ *
+ * conn: Connection to send it on.
+ * segment: The segment.
+ * len: Its length.
+ * forked: See send_datagram().
+ * returns: The number of bytes of the segment sent, or -1 if there was an
+ *          error.
+ */
+int pmtu_send(conn_t *conn, ctcp_segment_t *segment, size_t len,
+              bool forked) {
+  struct conn_pmtu *p = conn->pmtu;
+  uint32_t seqno = ntohl(segment->seqno);
+  uint16_t data_len = len - sizeof(ctcp_segment_t);
+  uint16_t hdr_room = FULL_HDR_SIZE + pmtu_room(conn);
+  bool resent = data_len > 0 && (int32_t) (seqno - p->sent_end) < 0;
+
+  if (data_len > 0 && (int32_t) (seqno + data_len - p->sent_end) > 0)
+    p->sent_end = seqno + data_len;
+
+  /* Data sent again covering the probe means the probe was lost. Data no
+     larger than the size found being sent again and again means the path
+     has shrunk. */
+  if (resent && p->probe && (int32_t) (seqno - p->probe_end) < 0) {
+    pmtu_probe_lost(p);
+  }
+  else if (resent && ++p->retransmits >= PMTU_BLACK_HOLE &&
+           p->size > PMTU_BASE) {
+    fprintf(stderr, "[INFO] Path no longer takes %d bytes, searching "
+            "again\n", p->size);
+    p->high = p->size;
+    p->size = PMTU_BASE;
+    p->retransmits = 0;
+  }
+
+  /* Search again after a while, in case the path has grown. */
+  if (pmtu_done(p) && p->size < p->ceiling &&
+      current_time_us() >= p->raise_at)
+    p->high = p->ceiling + 1;
+
+  if (data_len <= p->size - hdr_room)
+    return send_datagram(conn, segment, len, forked);
+
+  /* Probe with new data: the largest size of use first, then halfway. A
+     probe the whole segment fits in goes out as it is. */
+  uint16_t piece_room = hdr_room + (pmtu_room(conn) ? 0 : PIECE_OPT_SIZE);
+  uint16_t probe_len = 0;
+  if (!resent && !p->probe && !pmtu_done(p)) {
+    uint16_t size = p->high > p->ceiling ? p->ceiling :
+                    (p->size + p->high) / 2;
+    p->probe_start = seqno;
+    p->probes++;
+    if (data_len <= size - hdr_room) {
+      p->probe = data_len + hdr_room;
+      p->probe_end = seqno + data_len;
+      int r = send_datagram(conn, segment, len, forked);
+      if (r >= 0 || errno != EMSGSIZE)
+        return r;
+      pmtu_probe_lost(p);
+    }
+    else {
+      probe_len = size - piece_room;
+      p->probe = size;
+      p->probe_end = seqno + probe_len;
+    }
+  }
+
+  /* The pieces' checksums are off by as much as the segment's is, so a
+     corrupted segment stays corrupted. Each piece carries an option saying
+     where it goes (see piece_option()), so the receiver can put the segment
+     back together. */
+  uint16_t sum = segment->cksum;
+  segment->cksum = 0;
+  uint16_t off_by = cksum(segment, len) - sum;
+  segment->cksum = sum;
+
+  uint16_t piece_max = p->size - piece_room;
+  ctcp_segment_t *piece = malloc(sizeof(ctcp_segment_t) +
+                                 (probe_len > piece_max ? probe_len :
+                                  piece_max));
+  p->whole_start = seqno;
+  p->whole_len = data_len;
+  uint16_t done = 0;
+  while (done < data_len) {
+    uint16_t n = probe_len ? probe_len : piece_max;
+    if (n > data_len - done)
+      n = data_len - done;
+    uint16_t piece_len = sizeof(ctcp_segment_t) + n;
+
+    memcpy(piece, segment, sizeof(ctcp_segment_t));
+    memcpy(piece->data, segment->data + done, n);
+    piece->seqno = htonl(seqno + done);
+    piece->len = htons(piece_len);
+    if (done + n < data_len)
+      piece->flags &= ~TH_FIN;
+    piece->cksum = 0;
+    piece->cksum = cksum(piece, piece_len) - off_by;
+
+    /* The interface doesn't take the probe. Send its data again in pieces
+       that fit. */
+    if (send_datagram(conn, piece, piece_len, forked) < 0) {
+      if (errno != EMSGSIZE || !probe_len) {
+        p->whole_len = 0;
+        free(piece);
+        return -1;
+      }
+      pmtu_probe_lost(p);
+      probe_len = 0;
+      continue;
+    }
+    probe_len = 0;
+    done += n;
+  }
+  p->whole_len = 0;
+  free(piece);
+  return len;
+}
+
+/**
+ * Takes a segment that arrived on a connection. If it is a piece of a larger
+ * one (see pmtu_send()), it is kept until the rest of that segment arrives,
+ * and the segment is put back together, with a checksum as far off as the
+ * pieces' were.
+ *
+ * conn: Connection or stream it arrived on.
+ * tcp_hdr: Its TCP header.
+ * segment: The segment. Freed if it is a piece.
+ * len: Its length, updated if a whole segment is returned.
+ * returns: The segment to pass on, or NULL if there is none yet.
+ */
+ctcp_segment_t *piece_received(conn_t *conn, tcphdr_t *tcp_hdr,
+                               ctcp_segment_t *segment, int *len) {
+  uint8_t *opt = NULL;
+  while ((opt = tcp_option(tcp_hdr, TCPOPT_EXPERIMENT, opt))) {
+    uint16_t exid;
+    if (opt[1] != PIECE_OPT_SIZE)
+      continue;
+    memcpy(&exid, opt + 2, sizeof(exid));
+    if (ntohs(exid) == PIECE_OPT_EXID)
+      break;
+  }
+  if (opt == NULL)
+    return segment;
+
+  uint16_t offset, whole_len;
+  memcpy(&offset, opt + 4, sizeof(offset));
+  memcpy(&whole_len, opt + 6, sizeof(whole_len));
+  offset = ntohs(offset);
+  whole_len = ntohs(whole_len);
+  uint16_t n = *len - sizeof(ctcp_segment_t);
+  if (n == 0 || offset + n > whole_len || whole_len > conn->mss) {
+    free(segment);
+    return NULL;
+  }
+
+  /* A piece of another segment. The one being put back together won't be
+     finished; if it is sent again, it starts over. */
+  uint32_t seqno = ntohl(segment->seqno) - offset;
+  struct conn_pieces *pieces = conn->pieces;
+  if (pieces && (pieces->seqno != seqno || pieces->len != whole_len)) {
+    free(pieces->segment);
+    free(pieces);
+    pieces = NULL;
+  }
+  if (pieces == NULL) {
+    pieces = calloc(sizeof(struct conn_pieces) + whole_len, 1);
+    pieces->seqno = seqno;
+    pieces->len = whole_len;
+    pieces->segment = calloc(sizeof(ctcp_segment_t) + whole_len, 1);
+    conn->pieces = pieces;
+  }
+
+  uint16_t sum = segment->cksum;
+  segment->cksum = 0;
+  uint16_t off_by = cksum(segment, *len) - sum;
+  if (off_by != 0)
+    pieces->off_by = off_by;
+  if (segment->flags & TH_FIN)
+    pieces->fin = true;
+
+  int i;
+  for (i = offset; i < offset + n; i++) {
+    if (!pieces->got[i]) {
+      pieces->got[i] = 1;
+      pieces->have++;
+    }
   }
+  /* Take the latest ACK number and window along with the data. */
+  memcpy(pieces->segment, segment, sizeof(ctcp_segment_t));
+  memcpy(pieces->segment->data + offset, segment->data, n);
+  free(segment);
+  if (pieces->have < pieces->len)
+    return NULL;
+
+  segment = pieces->segment;
+  *len = sizeof(ctcp_segment_t) + pieces->len;
+  segment->seqno = htonl(pieces->seqno);
+  segment->len = htons(*len);
+  if (pieces->fin)
+    segment->flags |= TH_FIN;
+  segment->cksum = 0;
+  segment->cksum = cksum(segment, *len) - pieces->off_by;
+  free(pieces);
+  conn->pieces = NULL;
+  return segment;
 }
 
 /**
  * Sends a cTCP segment to a destination associated with the provided
- * connection object.
+ * connection object. See conn_send().
  *
  * conn: Connection object.
  * segment: Pointer to cTCP segment to send.
@@ -786,17 +2524,37 @@ void conn_remove(conn_t *conn) {
  * returns: The number of bytes actually sent, 0 if nothing was sent, -1 if
  *          there in an error.
  */
-int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
+int send_segment(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  ASSERT_CONN;
   /* Check parameters. */
   if (conn == NULL || segment == NULL) {
     fprintf(stderr, "[ERROR] NULL parameters in conn_send\n");
     return -1;
   }
+  CTCP_TRACE(segment_send, conn, ntohl(segment->seqno), ntohl(segment->ackno),
+             len - sizeof(ctcp_segment_t), segment->flags);
+
+  if (opt_histograms)
+    latency_sent(conn, segment, len);
+  if (opt_stats || opt_keepalive)
+    stats_sent(conn, segment, len);
+
+  /* The server already took this with the SYN (--fast-open). */
+  if (conn->syn_data_acked && ntohl(segment->seqno) == 1 &&
+      len - sizeof(ctcp_segment_t) == conn->syn_data_len) {
+    conn->syn_data_acked = false;
+    return len;
+  }
 
   /* Make a copy of the segment first. */
   ctcp_segment_t *segment_copy = calloc(len, 1);
   memcpy(segment_copy, segment, len);
 
+  /* Forward error correction. Counts the data segment in its group whether
+     or not it makes it, since the receiver counts it as lost if not. */
+  if (conn->fec && len > sizeof(ctcp_segment_t))
+    fec_add(conn, segment_copy, len);
+
   /* Fork process off in order to do unreliability. Keep track of whether we
      are forked or not. */
   int fork_level = 0;
@@ -868,160 +2626,923 @@ int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) { ASSERT_CONN;
       fprintf(stderr, "[DEBUG] Corrupting segment\n");
       print_hdr_ctcp(segment_copy);
     }
-    flipbit(segment_copy, rand_bit);
+    flipbit(segment_copy, rand_bit);
+  }
+
+  if (logger) {
+    logger_segment(logger, config->ip_addr, config->port, conn->ip_addr,
+                   conn->port, segment_copy, true, unix_socket);
+  }
+  else if (log_file != -1 || test_debug_on) {
+    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
+                len, true, unix_socket);
+  }
+
+  /* Convert from a cTCP segment to a real one and finally send the segment.
+     Forked processes exit straight after this, so they can't wait on the
+     emulated link. Over raw IP, it may go in pieces that fit the path. */
+  int n;
+  if (conn->pmtu)
+    n = pmtu_send(conn, segment_copy, len, am_i_forked);
+  else
+    n = send_datagram(conn, segment_copy, len, am_i_forked);
+  if (DEBUG) {
+    fprintf(stderr, "[DEBUG] Sent segment\n");
+    print_hdr_ctcp(segment_copy);
+  }
+  free(segment_copy);
+
+  /* Kill forked process. */
+  if (am_i_forked)
+    exit(0);
+
+  /* Return number of bytes sent. */
+  return n;
+}
+
+/**
+ * Sends a cTCP segment, counting it against conn_send if --perf is on.
+ */
+int conn_send(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  int r;
+  PERF_COUNT(perf, PERF_SEND, r = send_segment(conn, segment, len));
+  if (conn->fec && conn->fec->index == conn->fec->k)
+    fec_send_parity(conn);
+  return r;
+}
+
+/**
+ * Writes a buffer to STDOUT or the program associated with this connection,
+ * queueing what can't be written yet.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int write_output(conn_t *conn, const char *buf, size_t len) {
+  int left = len;
+  int w = 0;
+
+  /* Nothing in the output queue. Output immediately to the appropriate
+     interface. */
+  if (!conn->out_queue) {
+    if (run_program || conn->parent)
+      w = write(conn->stdin, buf, len);
+    else
+      w = write(STDOUT_FILENO, buf, len);
+
+    if (w < 0) {
+      if (errno != EAGAIN) {
+        if (run_program)
+          fprintf(stderr, "[INFO] Program exited\n");
+        conn->wrote_err = true;
+        return -1;
+      }
+    }
+    /* Write as much as possible. Keep track of how much was written. */
+    else {
+      buf += w;
+      left -= w;
+      if (opt_e2e_bytes && !conn->compress)
+        latency_written(conn, w);
+    }
+  }
+
+  if (opt_histograms && left == 0)
+    hist_record(&latency_of(conn)->hist[LAT_OUTPUT_QUEUE], 0);
+
+  /* Put the rest in an output queue. */
+  if (left > 0) {
+    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
+    chunk->next = NULL;
+    chunk->size = left;
+    chunk->used = 0;
+    chunk->queued_us = current_time_us();
+    memcpy(chunk->buf, buf, left);
+    if (opt_stats)
+      stats_set(conn_stats(conn), STAT_OUT_QUEUE,
+                stats_get(conn_stats(conn), STAT_OUT_QUEUE) + left);
+
+    /* Update pointers. */
+    *conn->out_queue_tail = chunk;
+    conn->out_queue_tail = &chunk->next;
+    CTCP_TRACE(output_queue_full, conn, left);
+  }
+
+  /* If there is stuff in the queue, create an event. */
+  if (conn->out_queue) {
+    if (run_program)
+      events[conn->stdin].events |= POLLOUT;
+    else
+      events[STDOUT_FILENO].events |= POLLOUT;
+  }
+  return len;
+}
+
+/**
+ * Takes compressed output (--compress) and writes out the blocks in it as
+ * each frame is complete.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise len.
+ */
+int decompress_output(conn_t *conn, const char *buf, size_t len) {
+  struct conn_compress *c = conn->compress;
+  size_t used = 0;
+
+  while (used < len) {
+    /* The header first. */
+    size_t need;
+    if (c->in_len < COMPRESS_HDR_SIZE) {
+      need = COMPRESS_HDR_SIZE - c->in_len;
+      if (need > len - used)
+        need = len - used;
+      memcpy(c->in + c->in_len, buf + used, need);
+      c->in_len += need;
+      used += need;
+      continue;
+    }
+
+    /* Then the rest of the frame. */
+    uint16_t frame_len, block_len;
+    memcpy(&frame_len, c->in + 1, sizeof(frame_len));
+    memcpy(&block_len, c->in + 3, sizeof(block_len));
+    frame_len = ntohs(frame_len);
+    block_len = ntohs(block_len);
+    if (c->in[0] > COMPRESS_FRAME_LZ || frame_len > COMPRESS_BLOCK_SIZE ||
+        block_len > COMPRESS_BLOCK_SIZE ||
+        (c->in[0] == COMPRESS_FRAME_RAW && frame_len != block_len))
+      goto corrupt;
+    need = COMPRESS_HDR_SIZE + frame_len - c->in_len;
+    if (need > len - used)
+      need = len - used;
+    memcpy(c->in + c->in_len, buf + used, need);
+    c->in_len += need;
+    used += need;
+    if (c->in_len < COMPRESS_HDR_SIZE + frame_len)
+      continue;
+
+    /* A whole frame. */
+    uint8_t block[COMPRESS_BLOCK_SIZE];
+    const uint8_t *out = c->in + COMPRESS_HDR_SIZE;
+    if (c->in[0] == COMPRESS_FRAME_LZ) {
+      if (lz_decompress(out, frame_len, block, block_len) != block_len)
+        goto corrupt;
+      out = block;
+    }
+    if (write_output(conn, (const char *) out, block_len) < 0)
+      return -1;
+    if (opt_e2e_bytes)
+      latency_written(conn, c->in_len);
+    c->received += c->in_len;
+    c->written += block_len;
+    c->in_len = 0;
+  }
+  return len;
+
+corrupt:
+  fprintf(stderr, "[ERROR] Compressed data from the other host is corrupt\n");
+  conn->wrote_err = true;
+  return -1;
+}
+
+/**
+ * Writes a buffer to STDOUT or the program associated with this connection.
+ * If called with a length of 0, an EOF is recorded.
+ *
+ * conn: The associated connection object.
+ * buf: The buffer to output.
+ * len: Number of bytes to write out.
+ * returns: -1 if error, otherwise the number of bytes written out.
+ */
+int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
+  /* If already wrote EOF, can't write more. */
+  if (conn->wrote_eof)
+    return 0;
+
+  /* Writing EOF. */
+  if (len == 0) {
+    conn->wrote_eof = true;
+    output_eof(conn);
+    return 0;
+  }
+
+  /* If already wrote out an error, can't continue writing. */
+  if (conn->wrote_err) {
+    fprintf(stderr, "[ERROR] Attempting to write after error\n");
+    return -1;
+  }
+
+  /* See if there is actually room to output. */
+  if (!conn_bufspace(conn))
+    return 0;
+
+  if (opt_histograms)
+    latency_output(conn, len);
+  if (conn->compress)
+    return decompress_output(conn, buf, len);
+  return write_output(conn, buf, len);
+}
+
+/**
+ * Passes a segment that arrived to the student code, logging and measuring it
+ * on the way.
+ *
+ * conn: Connection it arrived on.
+ * segment: The segment, in network order. The student code frees it.
+ * len: Length of the segment.
+ */
+void receive_segment(conn_t *conn, ctcp_segment_t *segment, size_t len) {
+  /* Student code sizes its buffers by conn_mss(), so a segment with more data
+     than was agreed on is dropped, as it would be by TCP. */
+  if (len - sizeof(ctcp_segment_t) > conn->mss) {
+    if (DEBUG)
+      fprintf(stderr, "[DEBUG] Dropped a segment of %d bytes of data, larger "
+              "than the MSS\n", (int) (len - sizeof(ctcp_segment_t)));
+    free(segment);
+    return;
+  }
+
+  if (logger) {
+    logger_segment(logger, config->ip_addr, config->port, conn->ip_addr,
+                   conn->port, segment, false, unix_socket);
+  }
+  else if (log_file != -1 || test_debug_on) {
+    log_segment(log_file, config->ip_addr, config->port, conn, segment, len,
+                false, unix_socket);
+  }
+
+  /* A corrupted segment tells nothing about when data arrived or was
+     ACKed. Its checksum is checked once for both. */
+  bool corrupted = false;
+  if (opt_histograms || opt_stats || opt_keepalive) {
+    uint16_t sum = segment->cksum;
+    segment->cksum = 0;
+    corrupted = cksum(segment, len) != sum;
+    segment->cksum = sum;
+  }
+  if (opt_histograms && !corrupted)
+    latency_received(conn, segment, len);
+  if (opt_stats || opt_keepalive)
+    stats_received(conn, segment, len, corrupted);
+  CTCP_TRACE(segment_receive, conn, ntohl(segment->seqno),
+             ntohl(segment->ackno), len - sizeof(ctcp_segment_t),
+             segment->flags);
+  PERF_COUNT(perf, PERF_RECEIVE, ctcp_receive(conn->state, segment, len));
+
+  /* Input already read into a frame (--compress) won't wake up poll(), so
+     offer it again now that an ACK may have made room for it. */
+  struct conn_compress *c = conn->compress;
+  if (c && c->out_used < c->out_len && !conn->delete_me)
+    PERF_COUNT(perf, PERF_READ, ctcp_read(conn->state));
+}
+
+/**
+ * [Receiving]
+ * Finds the slot for a group that a segment belongs to. A newer group takes
+ * over the slot of the one FEC_GROUPS before it, which is given up on and
+ * counted towards what the next report says was lost.
+ *
+ * fec: The connection's state.
+ * id: The group.
+ * k: Its k.
+ * returns: The slot, or NULL if the group was already given up on.
+ */
+struct fec_group *fec_group_of(struct conn_fec *fec, uint8_t id, uint8_t k) {
+  struct fec_group *g = &fec->groups[id % FEC_GROUPS];
+  if (g->used && g->id == id)
+    return g;
+  if (g->used && (int8_t) (id - g->id) < 0)
+    return NULL;
+
+  /* Groups in between that never showed up lost everything. */
+  if (g->used) {
+    fec->received_expected += g->k + 1;
+    fec->received_lost += g->k + 1 - g->arrived;
+    uint8_t skipped = id - g->id;
+    for (; skipped > FEC_GROUPS; skipped -= FEC_GROUPS) {
+      fec->received_expected += k + 1;
+      fec->received_lost += k + 1;
+    }
+  }
+  struct fec_block xor = g->xor;
+  fec_block_clear(&xor, fec->mss);
+  memset(g, 0, sizeof(*g));
+  g->xor = xor;
+  g->used = true;
+  g->id = id;
+  g->k = k;
+  return g;
+}
+
+/**
+ * [Receiving]
+ * Rebuilds the one missing data segment of a group from the others and its
+ * parity, and passes it on as if it had arrived. It can't be rebuilt if it
+ * is longer than the parity, which may have been cut to fit the path.
+ *
+ * conn: Connection or stream the group is on.
+ * g: The group, with its parity and all but one of its data segments.
+ */
+void fec_recover(conn_t *conn, struct fec_group *g) {
+  uint16_t len = ntohs(g->xor.len);
+  g->done = true;
+  if (len < sizeof(ctcp_segment_t) ||
+      len > sizeof(ctcp_segment_t) + g->parity_len)
+    return;
+
+  ctcp_segment_t *segment = calloc(len, 1);
+  segment->seqno = g->xor.seqno;
+  segment->ackno = g->xor.ackno;
+  segment->len = htons(len);
+  segment->flags = g->xor.flags;
+  segment->window = g->xor.window;
+  memcpy(segment->data, g->xor.data, len - sizeof(ctcp_segment_t));
+  segment->cksum = cksum(segment, len);
+
+  conn->fec->recovered++;
+  if (opt_stats)
+    stats_add(conn_stats(conn), STAT_FEC_RECOVERED, 1);
+  if (DEBUG)
+    fprintf(stderr, "[DEBUG] Rebuilt a segment of group %d\n", g->id);
+  receive_segment(conn, segment, len);
+}
+
+/**
+ * [Receiving]
+ * Handles the --fec options of a segment that arrived: notes the other end's
+ * report, adds a data segment to its group, and takes a parity segment out.
+ * Rebuilds a lost segment once its group has everything else.
+ *
+ * conn: Connection or stream the segment arrived on.
+ * tcp_hdr: Its TCP header.
+ * segment: The segment.
+ * len: Its length.
+ * returns: Whether the segment was a parity segment, and has been freed.
+ */
+bool fec_received(conn_t *conn, tcphdr_t *tcp_hdr, ctcp_segment_t *segment,
+                  size_t len) {
+  struct conn_fec *fec = conn->fec;
+  struct fec_group *g = NULL;
+  bool parity = false;
+  uint16_t field;
+  uint8_t *opt;
+
+  if ((opt = experiment_option(tcp_hdr, FEC_OPT_EXID, FEC_REPORT_SIZE))) {
+    memcpy(&field, opt + 4, sizeof(field));
+    fec->expected = ntohs(field);
+    memcpy(&field, opt + 6, sizeof(field));
+    fec->lost = ntohs(field);
+  }
+
+  /* Parity. */
+  if ((opt = experiment_option(tcp_hdr, FEC_OPT_EXID, FEC_PARITY_SIZE))) {
+    parity = true;
+    if (opt[5] >= 1 && opt[5] <= FEC_MAX_K)
+      g = fec_group_of(fec, opt[4], opt[5]);
+    if (g && !g->has_parity && g->k == opt[5]) {
+      struct fec_block header;
+      memcpy(&header.seqno, opt + 7, sizeof(header.seqno));
+      memcpy(&header.ackno, opt + 11, sizeof(header.ackno));
+      memcpy(&header.len, opt + 15, sizeof(header.len));
+      memcpy(&header.window, opt + 17, sizeof(header.window));
+      g->xor.seqno ^= header.seqno;
+      g->xor.ackno ^= header.ackno;
+      g->xor.len ^= header.len;
+      g->xor.window ^= header.window;
+      g->xor.flags ^= opt[6];
+      size_t i, data_len = len - sizeof(ctcp_segment_t);
+      for (i = 0; i < data_len && i < fec->mss; i++)
+        g->xor.data[i] ^= segment->data[i];
+      g->parity_len = i;
+      g->has_parity = true;
+      g->arrived++;
+    }
+    free(segment);
+  }
+
+  /* Data. Leave out a corrupted one, so it can be rebuilt. */
+  else if ((opt = experiment_option(tcp_hdr, FEC_OPT_EXID, FEC_TAG_SIZE))) {
+    uint8_t index = opt[5] >> 4;
+    uint8_t k = (opt[5] & 0xf) + 1;
+    uint16_t sum = segment->cksum;
+    segment->cksum = 0;
+    bool corrupted = cksum(segment, len) != sum;
+    if (index < k)
+      g = fec_group_of(fec, opt[4], k);
+    if (g && !corrupted && g->k == k && !(g->received & (1 << index)) &&
+        len - sizeof(ctcp_segment_t) <= fec->mss) {
+      fec_xor(&g->xor, segment, len);
+      g->received |= 1 << index;
+      g->arrived++;
+    }
+    segment->cksum = sum;
+  }
+
+  /* Everything but one data segment. It goes to the student code ahead of
+     this one, which is likely to come after it. */
+  if (g && g->has_parity && !g->done) {
+    int n = __builtin_popcount(g->received);
+    if (n == g->k)
+      g->done = true;
+    else if (n == g->k - 1)
+      fec_recover(conn, g);
+  }
+  return parity;
+}
+
+/**
+ * Returns the next entry to poll after the first NUM_POLL.
+ */
+struct pollfd *poll_slot() {
+  return &events[NUM_POLL + num_polled++];
+}
+
+/**
+ * Makes the configuration the student code gets for a connection. The windows
+ * are given in multiples of MAX_SEG_DATA_SIZE, so they are scaled to the
+ * connection's MSS, up to what the 16-bit window field holds.
+ *
+ * conn: The connection, once its MSS has been agreed on.
+ * returns: The configuration, which the student code frees.
+ */
+ctcp_config_t *conn_config(conn_t *conn) {
+  ctcp_config_t *cfg = calloc(sizeof(ctcp_config_t), 1);
+  memcpy(cfg, ctcp_cfg, sizeof(ctcp_config_t));
+  uint32_t recv_window = (uint32_t) cfg->recv_window * conn->mss /
+                         MAX_SEG_DATA_SIZE;
+  uint32_t send_window = (uint32_t) cfg->send_window * conn->mss /
+                         MAX_SEG_DATA_SIZE;
+  cfg->recv_window = recv_window > UINT16_MAX ? UINT16_MAX : recv_window;
+  cfg->send_window = send_window > UINT16_MAX ? UINT16_MAX : send_window;
+  return cfg;
+}
+
+/**
+ * Opens a connection's streams after the first (--streams), each with its
+ * own student state, so each has its own sequence numbers, retransmissions
+ * and window and a segment lost on one doesn't hold up the others. They all
+ * go over the connection's ports. A client reads and writes them on
+ * STREAM_IN_FD() and STREAM_OUT_FD(); a server's are set up with its program
+ * by execute_program().
+ *
+ * conn: The connection, once the handshake is done.
+ */
+void streams_open(conn_t *conn) {
+  int s;
+  for (s = 1; s < opt_streams; s++) {
+    conn_t *stream = calloc(sizeof(conn_t), 1);
+    conn_setup(stream, conn->ip_addr, conn->port, unix_socket);
+    stream->init_seqno = conn->init_seqno;
+    stream->their_init_seqno = conn->their_init_seqno;
+    stream->out_queue_tail = &stream->out_queue;
+    stream->stream = s;
+    stream->parent = conn;
+    stream->mss = conn->mss;
+    if (conn->compress)
+      stream->compress = calloc(sizeof(struct conn_compress), 1);
+    if (conn->fec)
+      stream->fec = fec_new(stream->mss);
+    if (conn->pmtu)
+      stream->pmtu = pmtu_new(stream);
+    conn->streams[s] = stream;
+
+    if (!SERVER) {
+      stream->stdout = STREAM_IN_FD(s);
+      stream->stdin = STREAM_OUT_FD(s);
+      async(stream->stdout);
+      async(stream->stdin);
+      stream->poll_fd = poll_slot();
+      stream->poll_fd->fd = stream->stdout;
+      stream->poll_fd->events = POLLIN | POLLHUP;
+    }
+
+    stream->state = ctcp_init(stream, conn_config(stream));
+    if (stream->state == NULL)
+      stream->delete_me = true;
+  }
+}
+
+/**
+ * Mixes the bits of a 64-bit value (the finalizer of splitmix64).
+ */
+uint64_t mix64(uint64_t z) {
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * [Server only]
+ * Picks the secret fast open cookies are made with, from /dev/urandom if
+ * possible. Cookies handed out by an earlier run are no good after this.
+ */
+void fast_open_new_key() {
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0 ||
+      read(fd, fast_open_key, sizeof(fast_open_key)) != sizeof(fast_open_key)) {
+    fast_open_key[0] = mix64(((uint64_t) rand() << 32) ^ current_time_us());
+    fast_open_key[1] = mix64(fast_open_key[0] ^ getpid());
+  }
+  if (fd >= 0)
+    close(fd);
+}
+
+/**
+ * [Server only]
+ * Makes the fast open cookie for a client's address: a keyed hash of it, so
+ * only a client that has had a SYN-ACK at that address knows it. This stops
+ * blind spoofing, but is no MAC against someone who can watch cookies being
+ * handed out.
+ *
+ * addr: The client's IP address or, over Unix sockets, its port (which names
+ *       its socket).
+ * cookie: Where to put the cookie.
+ */
+void fast_open_make_cookie(uint64_t addr, uint8_t *cookie) {
+  uint64_t h = mix64(mix64(fast_open_key[0] ^ addr) ^ fast_open_key[1]);
+  memcpy(cookie, &h, FAST_OPEN_COOKIE_SIZE);
+}
+
+/**
+ * Writes a fast open option, after two NOPs to pad it.
+ *
+ * opt: Where to write it.
+ * cookie: The cookie, or NULL to ask for one.
+ * returns: Length of what was written.
+ */
+uint16_t fast_open_option(uint8_t *opt, const uint8_t *cookie) {
+  opt[0] = opt[1] = TCPOPT_NOP;
+  opt[2] = TCPOPT_FASTOPEN;
+  if (cookie == NULL) {
+    opt[3] = 2;
+    return 4;
+  }
+  opt[3] = FAST_OPEN_OPT_SIZE;
+  memcpy(opt + 4, cookie, FAST_OPEN_COOKIE_SIZE);
+  return 4 + FAST_OPEN_COOKIE_SIZE;
+}
+
+/**
+ * [Client only]
+ * Looks up the cookie for fast_open_server in FAST_OPEN_COOKIE_FILE.
+ *
+ * returns: Whether there is one.
+ */
+bool fast_open_load() {
+  char server[256];
+  char hex[2 * FAST_OPEN_COOKIE_SIZE + 1];
+  bool found = false;
+  int i;
+
+  FILE *f = fopen(FAST_OPEN_COOKIE_FILE, "r");
+  if (f == NULL)
+    return false;
+  while (!found && fscanf(f, "%255s %16s", server, hex) == 2)
+    found = strcmp(server, fast_open_server) == 0 &&
+            strlen(hex) == 2 * FAST_OPEN_COOKIE_SIZE;
+  fclose(f);
+
+  for (i = 0; found && i < FAST_OPEN_COOKIE_SIZE; i++)
+    found = sscanf(hex + 2 * i, "%2hhx", &fast_open_cookie[i]) == 1;
+  return found;
+}
+
+/**
+ * [Client only]
+ * Stores the cookie for fast_open_server in FAST_OPEN_COOKIE_FILE, in place of
+ * the one it had.
+ */
+void fast_open_save() {
+  size_t server_len = strlen(fast_open_server);
+  char line[512];
+  int i;
+
+  /* Keep the other servers' cookies. */
+  char *others = NULL;
+  size_t others_len = 0;
+  FILE *out = open_memstream(&others, &others_len);
+  FILE *f = fopen(FAST_OPEN_COOKIE_FILE, "r");
+  if (f) {
+    while (fgets(line, sizeof(line), f)) {
+      if (strncmp(line, fast_open_server, server_len) != 0 ||
+          line[server_len] != ' ')
+        fputs(line, out);
+    }
+    fclose(f);
+  }
+  fclose(out);
+
+  f = fopen(FAST_OPEN_COOKIE_FILE, "w");
+  if (f == NULL) {
+    fprintf(stderr, "[ERROR] Cannot write %s\n", FAST_OPEN_COOKIE_FILE);
+    free(others);
+    return;
+  }
+  fputs(others, f);
+  fprintf(f, "%s ", fast_open_server);
+  for (i = 0; i < FAST_OPEN_COOKIE_SIZE; i++)
+    fprintf(f, "%02x", fast_open_cookie[i]);
+  fprintf(f, "\n");
+  fclose(f);
+  free(others);
+}
+
+/**
+ * [Client only]
+ * Gets what goes with the SYN. With a cookie, that is the first segment of
+ * input, if there is any yet (it doesn't wait); without one, it is a request
+ * for a cookie.
+ *
+ * conn: Connection to the server. Input read is kept in conn->syn_data.
+ * opt: Where to write the options.
+ * returns: Length of the options.
+ */
+uint16_t fast_open_syn(conn_t *conn, uint8_t *opt) {
+  if (!have_cookie)
+    return fast_open_option(opt, NULL);
+
+  /* Read it the first time. A SYN sent again takes the same data. */
+  struct pollfd input = { STDIN_FILENO, POLLIN, 0 };
+  if (conn->syn_data == NULL && poll(&input, 1, 0) == 1 &&
+      (input.revents & POLLIN)) {
+    char *data = malloc(MAX_SEG_DATA_SIZE);
+    async(STDIN_FILENO);
+    int r = conn_input(conn, data, MAX_SEG_DATA_SIZE);
+    if (r > 0) {
+      conn->syn_data = data;
+      conn->syn_data_len = r;
+    }
+    else {
+      free(data);
+    }
   }
+  return conn->syn_data ? fast_open_option(opt, fast_open_cookie) : 0;
+}
 
-  uint16_t data_len = len - sizeof(ctcp_segment_t);
-  uint16_t total_len = FULL_HDR_SIZE + data_len;
-
-  if (log_file != -1 || test_debug_on) {
-    log_segment(log_file, config->ip_addr, config->port, conn, segment_copy,
-                len, true, unix_socket);
+/**
+ * [Client only]
+ * Handles fast open in the SYN-ACK: keeps a new cookie, and finds out whether
+ * the server took the data sent with the SYN. If not, it is sent again as
+ * usual.
+ *
+ * conn: Connection to the server.
+ * synack: The SYN-ACK.
+ */
+void fast_open_synack(conn_t *conn, tcphdr_t *synack) {
+  uint8_t *opt = tcp_option(synack, TCPOPT_FASTOPEN, NULL);
+  if (opt && opt[1] == FAST_OPEN_OPT_SIZE &&
+      (!have_cookie ||
+       memcmp(opt + 2, fast_open_cookie, FAST_OPEN_COOKIE_SIZE) != 0)) {
+    memcpy(fast_open_cookie, opt + 2, FAST_OPEN_COOKIE_SIZE);
+    have_cookie = true;
+    fast_open_save();
   }
+  if (conn->syn_data == NULL)
+    return;
 
-  /* Convert from a cTCP segment to a real one and finally send the segment. */
-  char *pkt = convert_to_datagram(conn, segment_copy, len);
-  int n = send_pkt(conn, config->socket, pkt, total_len, 0);
-  if (DEBUG) {
-    fprintf(stderr, "[DEBUG] Sent segment\n");
-    print_hdr_ctcp(segment_copy);
+  if (ntohl(synack->th_ack) == conn->init_seqno + 1 + conn->syn_data_len) {
+    conn->syn_data_acked = true;
+    fprintf(stderr, "[INFO] Sent %d bytes with the SYN\n", conn->syn_data_len);
+  }
+  else {
+    conn->next_seqno -= conn->syn_data_len;
+    fprintf(stderr, "[INFO] Server did not take the data sent with the SYN\n");
   }
-  free(pkt);
-  free(segment_copy);
-
-  /* Kill forked process. */
-  if (am_i_forked)
-    exit(0);
-
-  /* Return number of bytes sent. Need to subtract some because the return value
-     is actually the size of the TCP segment instead of the cTCP segment. */
-  if (n >= (long int)TCP_HDR_SIZE)
-    return n - (TCP_HDR_SIZE + IP_HDR_SIZE - sizeof(ctcp_segment_t));
-  return n;
 }
 
 /**
- * Writes a buffer to STDOUT or the program associated with this connection.
- * If called with a length of 0, an EOF is recorded.
+ * [Server only]
+ * Handles fast open in a SYN. If the client's cookie is good, the data that
+ * came with it is kept in conn->syn_data for receive_syn_data().
  *
- * conn: The associated connection object.
- * buf: The buffer to output.
- * len: Number of bytes to write out.
- * returns: -1 if error, otherwise the number of bytes written out.
+ * conn: The new connection.
+ * pkt: The SYN.
+ * opt: Where to write the options for the SYN-ACK.
+ * returns: Length of the options: a cookie, if the client needs one.
  */
-int conn_output(conn_t *conn, const char *buf, size_t len) { ASSERT_CONN;
-  /* If already wrote EOF, can't write more. */
-  if (conn->wrote_eof)
+uint16_t fast_open_accept(conn_t *conn, char *pkt, uint8_t *opt) {
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  uint8_t cookie[FAST_OPEN_COOKIE_SIZE];
+  int i;
+
+  uint8_t *fo = tcp_option(syn, TCPOPT_FASTOPEN, NULL);
+  if (fo == NULL)
+    return 0;
+  fast_open_make_cookie(unix_socket ? ntohs(syn->th_sport) : ip_hdr->saddr,
+                        cookie);
+  if (fo[1] != FAST_OPEN_OPT_SIZE ||
+      memcmp(fo + 2, cookie, FAST_OPEN_COOKIE_SIZE) != 0)
+    return fast_open_option(opt, cookie);
+
+  int data_len = ntohs(ip_hdr->tot_len) - IP_HDR_SIZE - syn->th_off * 4;
+  if (data_len <= 0 || data_len > MAX_SEG_DATA_SIZE)
     return 0;
 
-  /* Writing EOF. */
-  if (len == 0) {
-    conn->wrote_eof = true;
+  /* Data corrupted on the way isn't taken. The handshake goes on as usual,
+     and the client sends the data again once it finds it wasn't ACKed. */
+  uint16_t sum = syn->th_sum;
+  syn->th_sum = 0;
+  bool corrupted = cksum_tcp(ip_hdr, syn->th_off * 4 - TCP_HDR_SIZE +
+                             data_len) != sum;
+  syn->th_sum = sum;
+  if (corrupted) {
+    fprintf(stderr, "[INFO] Ignoring data in a SYN with a bad checksum\n");
     return 0;
   }
 
-  /* If already wrote out an error, can't continue writing. */
-  if (conn->wrote_err) {
-    fprintf(stderr, "[ERROR] Attempting to write after error\n");
-    return -1;
+  /* The same SYN again is a replay. Don't deliver its data twice. */
+  for (i = 0; i < FAST_OPEN_SEEN; i++) {
+    if (fast_open_seen[i].ip == ip_hdr->saddr &&
+        fast_open_seen[i].port == syn->th_sport &&
+        fast_open_seen[i].seqno == syn->th_seq) {
+      fprintf(stderr, "[INFO] Ignoring data in a repeated SYN\n");
+      return 0;
+    }
   }
+  fast_open_seen[fast_open_next].ip = ip_hdr->saddr;
+  fast_open_seen[fast_open_next].port = syn->th_sport;
+  fast_open_seen[fast_open_next].seqno = syn->th_seq;
+  fast_open_next = (fast_open_next + 1) % FAST_OPEN_SEEN;
+
+  conn->syn_data = malloc(data_len);
+  memcpy(conn->syn_data, (char *) syn + syn->th_off * 4, data_len);
+  conn->syn_data_len = data_len;
+  return 0;
+}
 
-  int left = len;
-  int w = 0;
-
-  /* See if there is actually room to output. */
-  if (!conn_bufspace(conn))
-    return 0;
+/**
+ * [Server only]
+ * Passes the data that came with the SYN to the student code, as the first
+ * segment of the connection.
+ *
+ * conn: The connection, once the program (if any) has started.
+ */
+void receive_syn_data(conn_t *conn) {
+  uint16_t len = sizeof(ctcp_segment_t) + conn->syn_data_len;
+  ctcp_segment_t *segment = calloc(len, 1);
+  segment->seqno = htonl(1);
+  segment->ackno = htonl(1);
+  segment->len = htons(len);
+  segment->flags = TH_ACK;
+  segment->window = htons(ctcp_cfg->send_window);
+  memcpy(segment->data, conn->syn_data, conn->syn_data_len);
+  segment->cksum = cksum(segment, len);
 
-  /* Nothing in the output queue. Output immediately to the appropriate
-     interface. */
-  if (!conn->out_queue) {
-    if (run_program)
-      w = write(conn->stdin, buf, len);
-    else
-      w = write(STDOUT_FILENO, buf, len);
+  free(conn->syn_data);
+  conn->syn_data = NULL;
+  receive_segment(conn, segment, len);
+}
 
-    if (w < 0) {
-      if (errno != EAGAIN) {
-        if (run_program)
-          fprintf(stderr, "[INFO] Program exited\n");
-        conn->wrote_err = true;
-        return -1;
-      }
-    }
-    /* Write as much as possible. Keep track of how much was written. */
-    else {
-      buf += w;
-      left -= w;
-    }
+/**
+ * [Client-only]
+ * Sends a SYN to a server, to start the TCP handshake or because the last one
+ * has had no answer. The rest of the handshake happens in the main loop: see
+ * tcp_handshake() and resend_syns().
+ *
+ * conn: Connection to the server.
+ */
+void tcp_connect(conn_t *conn) { ASSERT_CLIENT_ONLY;
+  uint8_t opt[MAX_TCP_OPT_SIZE];
+  uint16_t opt_len = 0;
+
+  /* Only the connection that gets the input can send some with the SYN. */
+  if (opt_fast_open && conn == get_connections())
+    opt_len = fast_open_syn(conn, opt);
+  opt_len += mss_option(opt + opt_len);
+  if (opt_compress)
+    opt_len += offer_option(opt + opt_len, COMPRESS_OPT_EXID);
+  if (opt_fec)
+    opt_len += offer_option(opt + opt_len, FEC_OPT_EXID);
+
+  if (!conn->connecting) {
+    conn->connecting = true;
+    conn->syn_rto = ctcp_cfg->rt_timeout;
   }
+  conn->next_seqno = conn->init_seqno;
+  conn->syn_due = current_time_us() + conn->syn_rto * 1000ULL;
 
-  /* Put the rest in an output queue. */
-  if (left > 0) {
-    chunk_t *chunk = calloc(offsetof(chunk_t, buf[left]), 1);
-    chunk->next = NULL;
-    chunk->size = left;
-    chunk->used = 0;
-    memcpy(chunk->buf, buf, left);
+  /* A SYN that can't be sent is as good as lost. */
+  send_tcp_seg(conn, TH_SYN, opt, opt_len, conn->syn_data, conn->syn_data_len);
+}
 
-    /* Update pointers. */
-    *conn->out_queue_tail = chunk;
-    conn->out_queue_tail = &chunk->next;
+/**
+ * [Client-only]
+ * Sends the SYN again on connections that have waited long enough for a
+ * SYN-ACK, and waits twice as long the next time. Connections that have had
+ * SYN_RETRIES are given up on.
+ */
+void resend_syns() {
+  char name[INET_ADDRSTRLEN + 16];
+  uint64_t now = current_time_us();
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn->connecting || conn->delete_me || now < conn->syn_due)
+      continue;
+    if (conn->syn_retries == SYN_RETRIES) {
+      conn_name(conn, name, sizeof(name));
+      fprintf(stderr, "[ERROR] Could not connect to server %s\n", name);
+      conn->delete_me = true;
+      continue;
+    }
+    conn->syn_retries++;
+    conn->syn_rto *= 2;
+    tcp_connect(conn);
   }
+}
 
-  /* If there is stuff in the queue, create an event. */
-  if (conn->out_queue) {
-    if (run_program)
-      events[conn->stdin].events |= POLLOUT;
-    else
-      events[STDOUT_FILENO].events |= POLLOUT;
+/**
+ * [Client-only]
+ * Returns the number of milliseconds until a SYN needs sending again, or -1 if
+ * no connection is waiting for a SYN-ACK.
+ */
+long need_syn_in() {
+  uint64_t now = current_time_us();
+  long next = -1;
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn->connecting || conn->delete_me)
+      continue;
+    long in = conn->syn_due > now ? (conn->syn_due - now + 999) / 1000 : 0;
+    if (next < 0 || in < next)
+      next = in;
   }
-  return len;
+  return next;
 }
 
 /**
  * [Client-only]
- * TCP handshake with server. This includes the SYN, SYN-ACK, and ACK segments.
+ * Finishes the TCP handshake with a server once its SYN-ACK arrives, and
+ * hands the connection to the student code.
  *
- * returns: A connection object if able to connect, NULL otherwise. This
- *          object must be freed.
+ * conn: Connection to the server.
+ * pkt: The SYN-ACK.
  */
-conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
-  char buf[MAX_PACKET_SIZE];
-
-  /* Send a SYN segment to the server. */
-  if (send_syn(config->sconn))
-    exit(EXIT_FAILURE);
-
-  /* Wait to receive SYN-ACK. */
-  int r = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, NULL);
-  if (r <= 0)
-    return NULL;
-
-  tcphdr_t *synack = (tcphdr_t *) (buf + IP_HDR_SIZE);
+void tcp_handshake(conn_t *conn, char *pkt) { ASSERT_CLIENT_ONLY;
+  tcphdr_t *synack = (tcphdr_t *) (pkt + IP_HDR_SIZE);
 
   /* Set window size for the other host. */
   ctcp_cfg->send_window = ntohs(synack->window);
 
+  /* A ctcp server always answers with a SYN-ACK. Anything else on a Unix
+     socket is for an earlier client that used the same name, still being
+     closed down by the server. */
+  if (unix_socket && !(synack->th_flags & TH_SYN))
+    return;
+
   /* If an ACK is received instead of a SYN-ACK, continue previous
      connection. Get sequence numbers from previous connection. */
   if ((synack->th_flags & TH_SYN) == 0) {
-    config->sconn->init_seqno = ntohl(synack->th_ack) - 1;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq) - 1;
+    conn->init_seqno = ntohl(synack->th_ack) - 1;
+    conn->their_init_seqno = ntohl(synack->th_seq) - 1;
 
-    config->sconn->next_seqno = config->sconn->init_seqno + 1;
-    config->sconn->ackno = ntohl(synack->th_seq);
+    conn->next_seqno = conn->init_seqno + 1;
+    conn->ackno = ntohl(synack->th_seq);
   }
 
   /* Otherwise, set new acknowledgement number and send ACK response */
   else {
-    config->sconn->next_seqno++;
-    config->sconn->their_init_seqno = ntohl(synack->th_seq);
-    config->sconn->ackno = ntohl(synack->th_seq) + 1;
-    send_ack(config->sconn);
+    conn->next_seqno++;
+    conn->their_init_seqno = ntohl(synack->th_seq);
+    conn->ackno = ntohl(synack->th_seq) + 1;
+    if (opt_fast_open)
+      fast_open_synack(conn, synack);
+    conn->mss = mss_agreed(synack);
+    if (opt_compress && has_offer(synack, COMPRESS_OPT_EXID))
+      conn->compress = calloc(sizeof(struct conn_compress), 1);
+    if (opt_fec && has_offer(synack, FEC_OPT_EXID))
+      conn->fec = fec_new(conn->mss);
+    if (!unix_socket)
+      conn->pmtu = pmtu_new(conn);
+    send_ack(conn);
   }
+  conn->connecting = false;
 
-  return config->sconn;
+  /* Go to student code. */
+  ctcp_state_t *state = ctcp_init(conn, conn_config(conn));
+  char name[INET_ADDRSTRLEN + 16];
+  conn_name(conn, name, sizeof(name));
+  if (state == NULL) {
+    fprintf(stderr, "[ERROR] Could not connect to server %s\n", name);
+    conn->delete_me = true;
+    return;
+  }
+  fprintf(stderr, "[INFO] Connected to server %s\n", name);
+  conn->state = state;
+  if (opt_keepalive || opt_idle_timeout)
+    conn_heard(conn);
+  CTCP_TRACE(conn_create, conn, conn->ip_addr, conn->port);
+  streams_open(conn);
+
+  /* Hand over the input that went with the SYN. */
+  if (conn->syn_data)
+    PERF_COUNT(perf, PERF_READ, ctcp_read(state));
 }
 
 /**
@@ -1033,6 +3554,40 @@ conn_t *tcp_handshake(void) { ASSERT_CLIENT_ONLY;
  * returns: The conn_t associated with the new connection.
  */
 conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
+  iphdr_t *ip_hdr = (iphdr_t *) pkt;
+  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
+  uint8_t opt[MAX_TCP_OPT_SIZE];
+  uint16_t opt_len = 0;
+  conn_t *conn;
+
+  /* The client sent its SYN again, so the SYN-ACK was lost or is late. Send
+     it again. Once the client has answered, the same SYN is a new session
+     that happens to have the same initial sequence number. */
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (conn->connecting && !conn->delete_me &&
+        conn->port == ntohs(syn->th_sport) &&
+        conn->their_init_seqno == ntohl(syn->th_seq)) {
+      if (opt_fast_open)
+        opt_len = fast_open_accept(conn, pkt, opt);
+      opt_len += mss_option(opt + opt_len);
+      if (conn->compress)
+        opt_len += offer_option(opt + opt_len, COMPRESS_OPT_EXID);
+      if (conn->fec)
+        opt_len += offer_option(opt + opt_len, FEC_OPT_EXID);
+      send_tcp_seg(conn, TH_SYN | TH_ACK, opt, opt_len, NULL, 0);
+      return NULL;
+    }
+  }
+
+  /* A new SYN from where a connection already is: the client started over
+     (e.g. another session run right after the last), so the old one is
+     done, whether or not it got to close. */
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn->delete_me && conn->port == ntohs(syn->th_sport) &&
+        (unix_socket || conn->ip_addr == ip_hdr->saddr))
+      conn_reap(conn, "replaced by a new connection");
+  }
+
   /* Ignore if too many clients are connected. */
   if (num_connected >= MAX_NUM_CLIENTS) {
     fprintf(stderr, "[ERROR] Maximum number of clients (%d) reached\n",
@@ -1041,27 +3596,48 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
   }
   num_connected++;
 
-  iphdr_t *ip_hdr = (iphdr_t *) pkt;
-  tcphdr_t *syn = (tcphdr_t *) (pkt + IP_HDR_SIZE);
-
   /* Set up connection details and add to list of connections. */
-  conn_t *conn = calloc(sizeof(conn_t), 1);
+  conn = calloc(sizeof(conn_t), 1);
   conn_setup(conn, ntohl(ip_hdr->saddr), ntohs(syn->th_sport), unix_socket);
+  if (opt_isn >= 0)
+    conn->init_seqno = conn->next_seqno = opt_isn;
   conn->their_init_seqno = ntohl(syn->th_seq);
-  conn->ackno = conn->their_init_seqno + 1;
+
+  /* Fast open. Give the client a cookie if it needs one, and take the data
+     that came with the SYN if its cookie is good. */
+  if (opt_fast_open)
+    opt_len = fast_open_accept(conn, pkt, opt);
+  conn->ackno = conn->their_init_seqno + 1 + conn->syn_data_len;
+
+  /* Segments as large as both hosts take. */
+  conn->mss = mss_agreed(syn);
+  opt_len += mss_option(opt + opt_len);
+
+  /* Compress and correct errors if the client offered to as well. */
+  if (opt_compress && has_offer(syn, COMPRESS_OPT_EXID)) {
+    conn->compress = calloc(sizeof(struct conn_compress), 1);
+    opt_len += offer_option(opt + opt_len, COMPRESS_OPT_EXID);
+  }
+  if (opt_fec && has_offer(syn, FEC_OPT_EXID)) {
+    conn->fec = fec_new(conn->mss);
+    opt_len += offer_option(opt + opt_len, FEC_OPT_EXID);
+  }
+  conn->connecting = true;
   conn_add(conn);
 
   /* Send a SYN-ACK to the client. */
-  send_synack(conn);
+  send_tcp_seg(conn, TH_SYN | TH_ACK, opt, opt_len, NULL, 0);
 
   /* Get window size of the client. */
   ctcp_cfg->send_window = ntohs(syn->window);
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
 
   /* Student code. */
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
+  ctcp_state_t *state = ctcp_init(conn, conn_config(conn));
   conn->state = state;
+  CTCP_TRACE(conn_create, conn, conn->ip_addr, conn->port);
+  streams_open(conn);
+  if (opt_keepalive || opt_idle_timeout)
+    conn_heard(conn);
 
   fprintf(stderr, "[INFO] Client connected\n");
   return conn;
@@ -1075,49 +3651,171 @@ conn_t *tcp_new_connection(char *pkt) { ASSERT_SERVER_ONLY;
  * Executes a new program upon client connection. When the client sends a
  * message to the server, it is forwarded to the STDIN of this program. The
  * STDOUT of the program is then passed through the server back to the client.
+ * Streams after the first (--streams) go to STREAM_IN_FD() and
+ * STREAM_OUT_FD() of the program in the same way.
  *
  * conn: The conn_t associated with the client.
  */
 void execute_program(conn_t *conn) { ASSERT_SERVER_ONLY;
-  /* Create pipes to child. */
-  int pipes[2][2];
-  pipe(pipes[PARENT_READ_PIPE]);
-  pipe(pipes[PARENT_WRITE_PIPE]);
+  /* Create pipes to child, two for each stream. The macros use pipes, which
+     points at the stream's pair. */
+  int stream_pipes[MAX_STREAMS][2][2];
+  int (*pipes)[2];
+  int s;
+  for (s = 0; s < opt_streams; s++) {
+    pipe(stream_pipes[s][PARENT_READ_PIPE]);
+    pipe(stream_pipes[s][PARENT_WRITE_PIPE]);
+  }
 
   /* Fork child process to run program. */
-  if (fork() == 0) {
+  conn->pid = fork();
+  if (conn->pid == 0) {
+    /* Move the streams' ends out of the way first, since the pipes may be
+       using the numbers they go to. */
+    int fds[MAX_STREAMS][2];
+    for (s = 1; s < opt_streams; s++) {
+      pipes = stream_pipes[s];
+      fds[s][READ_FD] = fcntl(CHILD_READ_FD, F_DUPFD,
+                              STREAM_OUT_FD(MAX_STREAMS));
+      fds[s][WRITE_FD] = fcntl(CHILD_WRITE_FD, F_DUPFD,
+                               STREAM_OUT_FD(MAX_STREAMS));
+    }
+
     /* Duplicate fds so child and parent will share same pipe. */
+    pipes = stream_pipes[0];
     dup2(CHILD_READ_FD, STDIN_FILENO);
     dup2(CHILD_WRITE_FD, STDOUT_FILENO);
     dup2(CHILD_WRITE_FD, STDERR_FILENO);
 
     /* Close fds not required by child. */
-    close(CHILD_READ_FD);
-    close(CHILD_WRITE_FD);
-    close(PARENT_READ_FD);
-    close(PARENT_WRITE_FD);
+    for (s = 0; s < opt_streams; s++) {
+      pipes = stream_pipes[s];
+      close(CHILD_READ_FD);
+      close(CHILD_WRITE_FD);
+      close(PARENT_READ_FD);
+      close(PARENT_WRITE_FD);
+    }
+    for (s = 1; s < opt_streams; s++) {
+      dup2(fds[s][READ_FD], STREAM_IN_FD(s));
+      dup2(fds[s][WRITE_FD], STREAM_OUT_FD(s));
+      close(fds[s][READ_FD]);
+      close(fds[s][WRITE_FD]);
+    }
 
     execvp(config->program, config->argv);
   }
 
   /* Continue parent process's execution. */
   else {
-    /* Close fds not required by parent. */
-    close(CHILD_READ_FD);
-    close(CHILD_WRITE_FD);
+    for (s = 0; s < opt_streams; s++) {
+      conn_t *stream = s ? conn->streams[s] : conn;
+      pipes = stream_pipes[s];
+
+      /* Close fds not required by parent. */
+      close(CHILD_READ_FD);
+      close(CHILD_WRITE_FD);
+
+      /* Store fds for communication with program later. */
+      stream->stdin = PARENT_WRITE_FD;
+      stream->stdout = PARENT_READ_FD;
+
+      /* Start polling the stdout. */
+      struct pollfd *stdout = poll_slot();
+      stdout->fd = stream->stdout;
+      async(stdout->fd);
+      stdout->events = POLLIN | POLLHUP;
+      stream->poll_fd = stdout;
+    }
+  }
+}
+
+/**
+ * Whether to watch a connection for going quiet. A client's connection still
+ * in its handshake has its SYNs sent again instead (see resend_syns()).
+ */
+bool conn_watched(conn_t *conn) {
+  return !conn->delete_me && conn->heard_at != 0 &&
+         (SERVER || !conn->connecting);
+}
 
-    /* Store fds for communication with program later. */
-    conn->stdin = PARENT_WRITE_FD;
-    conn->stdout = PARENT_READ_FD;
+/**
+ * Sends a keepalive: the last byte sent again, which the other end ACKs
+ * again (RFC 1122). It goes alongside the student code, so it is only sent
+ * once everything has been ACKed; until then, the student code's own
+ * retransmissions find out whether the other end is still there.
+ *
+ * conn: The connection.
+ * returns: Whether it was sent.
+ */
+bool send_keepalive(conn_t *conn) {
+  if ((int32_t) (conn->sent_end - conn->last_ackno) > 0)
+    return false;
+
+  /* Before anything is sent, the last sequence number is the SYN's. Its
+     byte doesn't mean anything, since it has already been ACKed. */
+  char byte = 0;
+  conn->next_seqno = conn->init_seqno + (conn->sent_end ? conn->sent_end : 1)
+                     - 1;
+  if (conn->sent_ackno)
+    conn->ackno = conn->their_init_seqno + conn->sent_ackno;
+  send_tcp_seg(conn, TH_ACK, NULL, 0, &byte, 1);
+  stats_add(conn_stats(conn), STAT_KEEPALIVES, 1);
+  if (DEBUG)
+    fprintf(stderr, "[DEBUG] Sent keepalive %d\n", conn->keepalives + 1);
+  return true;
+}
+
+/**
+ * Sends keepalives on connections that have been idle for long enough
+ * (--keepalive), and reaps connections that have gone quiet: ones that have
+ * not answered that many keepalives, or that have been idle for
+ * --idle-timeout.
+ */
+void send_keepalives() {
+  uint64_t now = current_time_us();
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn_watched(conn))
+      continue;
+    if (opt_idle_timeout &&
+        now >= conn->heard_at + opt_idle_timeout * 1000000ULL) {
+      conn_reap(conn, "idle");
+      continue;
+    }
+    if (!opt_keepalive || now < conn->keepalive_due)
+      continue;
+    if (conn->keepalives == opt_keepalive_count) {
+      conn_reap(conn, "no answer to keepalives");
+      continue;
+    }
+    if (send_keepalive(conn))
+      conn->keepalives++;
+    conn->keepalive_due = now + opt_keepalive_interval * 1000000ULL;
+  }
+}
 
-    /* Start polling the stdout. */
-    int id = NUM_POLL + num_connected - 1;
-    struct pollfd *stdout = &events[id];
-    stdout->fd = conn->stdout;
-    async(stdout->fd);
-    stdout->events = POLLIN | POLLHUP;
-    conn->poll_fd = stdout;
+/**
+ * Returns the number of milliseconds until a keepalive needs sending or a
+ * connection may need reaping, or -1 if none does.
+ */
+long need_keepalive_in() {
+  uint64_t now = current_time_us();
+  long next = -1;
+  conn_t *conn;
+
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn_watched(conn))
+      continue;
+    uint64_t due = opt_keepalive ? conn->keepalive_due : UINT64_MAX;
+    if (opt_idle_timeout &&
+        conn->heard_at + opt_idle_timeout * 1000000ULL < due)
+      due = conn->heard_at + opt_idle_timeout * 1000000ULL;
+    long in = due > now ? (due - now + 999) / 1000 : 0;
+    if (next < 0 || in < next)
+      next = in;
   }
+  return next;
 }
 
 /**
@@ -1128,7 +3826,7 @@ void delete_all_connections() {
   conn_t *conn, *next;
   for (conn = get_connections(); conn != NULL; conn = next) {
     next = conn->next;
-    if (conn->delete_me)
+    if (conn_done(conn))
       conn_free(conn);
   }
 }
@@ -1141,27 +3839,71 @@ void delete_all_connections() {
  *   - Timeouts.
  */
 void do_loop() {
-  char buf[MAX_PACKET_SIZE];
+  /* Room for the largest packet this host offered to take. */
+  size_t buf_size = PACKET_SIZE(mss_offer());
+  char *buf = malloc(buf_size);
   conn_t *conn = NULL;
 
   while (true) {
-    memset(buf, 0, MAX_PACKET_SIZE);
-    poll(events, NUM_POLL + num_connected,
-         need_timer_in(&last_timeout, ctcp_cfg->timer));
+    /* Wake up for the timer, the emulated link or a SYN to send again,
+       whichever is first. */
+    long timeout = need_timer_in(&last_timeout, ctcp_cfg->timer);
+    long link_timeout = need_link_in();
+    if (link_timeout >= 0 && link_timeout < timeout)
+      timeout = link_timeout;
+    if (opt_keepalive || opt_idle_timeout) {
+      long keepalive_timeout = need_keepalive_in();
+      if (keepalive_timeout >= 0 && keepalive_timeout < timeout)
+        timeout = keepalive_timeout;
+    }
+    if (!SERVER) {
+      long syn_timeout = need_syn_in();
+      if (syn_timeout >= 0 && syn_timeout < timeout)
+        timeout = syn_timeout;
+
+      /* Leave input where it is until there is a connection to send it on,
+         and stop polling it once it is all read. */
+      conn = get_connections();
+      events[STDIN_FILENO].fd = conn && (conn->connecting || conn->read_eof) ?
+                                -1 : STDIN_FILENO;
+    }
+    poll(events, NUM_POLL + num_polled, timeout);
+
+    if (exit_signal)
+      exit_on_signal();
+    if (dump_latency) {
+      dump_latency = 0;
+      print_all_latency();
+    }
+    if (capture)
+      capture_poll(capture);
+
+    /* Let out segments that have made it through the emulated link. */
+    if (emu_link != NULL)
+      link_run(emu_link, current_time_us());
+    if (!SERVER)
+      resend_syns();
+    if (opt_keepalive || opt_idle_timeout)
+      send_keepalives();
 
     /* Input from stdin. Server will only send to most-recently connected
        client. */
-    if (!run_program && events[STDIN_FILENO].revents & POLLIN) {
+    if (!run_program && events[STDIN_FILENO].revents & (POLLIN | POLLHUP)) {
       conn = get_connections();
 
       if (conn != NULL)
-        ctcp_read(conn->state);
+        PERF_COUNT(perf, PERF_READ, ctcp_read(conn->state));
     }
 
     /* See if we can output more. */
     if (events[STDOUT_FILENO].revents & (POLLOUT | POLLHUP | POLLERR)) {
       for (conn = get_connections(); conn; conn = conn->next) {
-        conn_drain(conn);
+        int s;
+        PERF_COUNT(perf, PERF_DRAIN, conn_drain(conn));
+        for (s = 1; s < opt_streams; s++) {
+          if (conn->streams[s] && !conn->streams[s]->delete_me)
+            PERF_COUNT(perf, PERF_DRAIN, conn_drain(conn->streams[s]));
+        }
       }
     }
 
@@ -1170,63 +3912,99 @@ void do_loop() {
     if (run_program) {
       conn = get_connections();
       while (conn != NULL) {
-        if (conn->poll_fd->revents & POLLIN) {
-          ctcp_read(conn->state);
+        if (conn->poll_fd->revents & (POLLIN | POLLHUP)) {
+          PERF_COUNT(perf, PERF_READ, ctcp_read(conn->state));
+          if (conn->read_eof)
+            conn->poll_fd->fd = -1;
         }
         conn = conn->next;
       }
     }
 
+    /* Input for the other streams (--streams). Stop polling once it is all
+       read. */
+    for (conn = get_connections(); conn && opt_streams > 1;
+         conn = conn->next) {
+      int s;
+      for (s = 1; s < opt_streams; s++) {
+        conn_t *stream = conn->streams[s];
+        if (stream == NULL || stream->delete_me || stream->poll_fd == NULL ||
+            !(stream->poll_fd->revents & (POLLIN | POLLHUP)))
+          continue;
+        PERF_COUNT(perf, PERF_READ, ctcp_read(stream->state));
+        if (stream->read_eof)
+          stream->poll_fd->fd = -1;
+      }
+    }
+
     /* Receive packet on socket from other hosts. Ignore packets if they are
        not large enough or not for us. */
     if (events[2].revents & POLLIN) {
       conn = NULL;
-      int len = recv_filter(config->socket, buf, MAX_PACKET_SIZE, 0, &conn);
+      int len = recv_filter(config->socket, buf, buf_size, 0, &conn);
       if (len >= FULL_HDR_SIZE) {
         tcphdr_t *tcp_hdr = (tcphdr_t *) (buf + IP_HDR_SIZE);
 
+        /* Reply from a server the client is connecting to. */
+        if (conn != NULL && conn->connecting && !SERVER) {
+          tcp_handshake(conn, buf);
+        }
+
         /* Packet from an established connection. Pass to student code. */
-        if (conn != NULL) {
+        else if (conn != NULL) {
+          if (opt_keepalive || opt_idle_timeout)
+            conn_heard(conn);
           ctcp_segment_t *segment = convert_to_ctcp(conn, buf, len);
-          len = len - FULL_HDR_SIZE + sizeof(ctcp_segment_t);
+          len = len - IP_HDR_SIZE - tcp_hdr->th_off * 4 +
+                sizeof(ctcp_segment_t);
 
           /* Don't log or forward to student code if it's an ACK from a new
              connection. */
-          if (tcp_hdr->th_sport == new_connection &&
-              (segment->flags & TH_ACK) &&
-              ntohl(segment->seqno) == 1 && ntohl(segment->ackno) == 1) {
-            new_connection = 0;
+          conn_t *stream = stream_of(conn, tcp_hdr);
+          bool handshake_ack = stream == conn && conn->connecting &&
+            (segment->flags & TH_ACK) &&
+            ntohl(segment->seqno) == 1 + conn->syn_data_len &&
+            ntohl(segment->ackno) == 1;
+          conn->connecting = false;
+          if (handshake_ack || stream == NULL || stream->delete_me) {
             free(segment);
           }
           else {
-            if (log_file != -1 || test_debug_on) {
-              log_segment(log_file, config->ip_addr, config->port, conn,
-                          segment, len, false, unix_socket);
-            }
-            ctcp_receive(conn->state, segment, len);
+            if (stream->pmtu && (segment->flags & TH_ACK))
+              pmtu_acked(stream, ntohl(segment->ackno));
+            if (opt_e2e_bytes)
+              latency_tagged(stream, tcp_hdr);
+            segment = piece_received(stream, tcp_hdr, segment, &len);
+            if (segment && (stream->fec == NULL ||
+                            !fec_received(stream, tcp_hdr, segment, len)))
+              receive_segment(stream, segment, len);
           }
         }
 
         /* New connection. */
-        else if (tcp_hdr->th_flags & TH_SYN) {
+        else if (SERVER && (tcp_hdr->th_flags & TH_SYN)) {
           conn_t *conn = tcp_new_connection(buf);
 
           /* Start a new program associated with this client. */
           if (run_program && conn)
             execute_program(conn);
-          new_connection = tcp_hdr->th_sport;
+          if (conn && conn->syn_data)
+            receive_syn_data(conn);
         }
       }
     }
 
     /* Check if timer is up. */
     if (need_timer_in(&last_timeout, ctcp_cfg->timer) == 0) {
-      ctcp_timer();
+      PERF_COUNT(perf, PERF_TIMER, ctcp_timer());
       get_time(&last_timeout);
     }
 
-    /* Delete connections if needed. */
+    /* Delete connections if needed. A client left with none never got to
+       connect. */
     delete_all_connections();
+    if (!SERVER && get_connections() == NULL)
+      exit(EXIT_FAILURE);
   }
 }
 
@@ -1266,6 +4044,29 @@ void end_client() {
     return;
   }
 
+  /* Wait for connections to the other servers to finish. */
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next) {
+    if (!conn_done(conn))
+      return;
+  }
+
+  /* Don't lose segments still making their way through the emulated link
+     (e.g. the ACK of the server's FIN). */
+  flush_link();
+  if (emu_link != NULL) {
+    const link_stats_t *stats = link_get_stats(emu_link);
+    fprintf(stderr, "[INFO] Link delivered %lu segments, dropped %lu "
+                    "(queue), %lu (AQM) and %lu (loss)\n",
+            (unsigned long) stats->delivered,
+            (unsigned long) stats->dropped_queue,
+            (unsigned long) stats->dropped_aqm,
+            (unsigned long) stats->dropped_loss);
+    if (emu_link_send_failed > 0)
+      fprintf(stderr, "[INFO] Of those delivered, %lu could not be sent\n",
+              (unsigned long) emu_link_send_failed);
+  }
+
   delete_all_connections();
   close(config->socket);
   fprintf(stderr, "[INFO] Disconnected from server\n");
@@ -1275,26 +4076,32 @@ void end_client() {
 /**
  * Start a client.
  *
- * server: String containing the server to connect to.
+ * servers: Strings containing the servers to connect to. Input goes to the
+ *          last one.
+ * num_servers: Number of servers.
  * port: The port the client will run on.
  */
-int start_client(char *server, char *port) {
-  if (do_config_server(server) < 0 || do_config(port) < 0)
-    return -1;
+int start_client(char *servers[], int num_servers, char *port) {
+  int i;
 
-  /* Initialize connection with server. Go to student code. */
-  conn_t *conn = tcp_handshake();
-  ctcp_config_t *config_copy = calloc(sizeof(ctcp_config_t), 1);
-  memcpy(config_copy, ctcp_cfg, sizeof(ctcp_config_t));
-  ctcp_state_t *state = ctcp_init(conn, config_copy);
-  if (state == NULL) {
-    fprintf(stderr, "[ERROR] Could not connect to server!\n");
-    return -1;
+  /* Cookies are kept by host:port. do_config_server() takes it apart. */
+  if (opt_fast_open) {
+    fast_open_server = strdup(servers[num_servers - 1]);
+    have_cookie = fast_open_load();
   }
-  fprintf(stderr, "[INFO] Connected to server\n");
-  config->sconn->state = state;
-
+  for (i = 0; i < num_servers; i++) {
+    if (do_config_server(servers[i]) < 0)
+      return -1;
+  }
+  if (do_config(port) < 0)
+    return -1;
   setup_poll();
+
+  /* Start the handshakes. They finish in the main loop, and then go to
+     student code. */
+  conn_t *conn;
+  for (conn = get_connections(); conn; conn = conn->next)
+    tcp_connect(conn);
   do_loop();
   return 0;
 }
@@ -1332,16 +4139,41 @@ int start_server(char *port, int argc, char *argv[]) {
 static void usage(char *progname) {
   fprintf(stderr,
     "\nUsage: %s\n"
-    "   -c server_host:server_port  [client only]\n"
+    "   -c server_host:server_port  [client only, can repeat]\n"
     "   -s                          [server only]\n"
     "   -p port\n"
     "   [-d]\n"
     "   [-w window_size]\n"
     "   [--seed seed]\n"
+    "   [--isn initial_seqno]\n"
     "   [--drop drop_percent]\n"
     "   [--corrupt corrupt_percent]\n"
     "   [--delay delay_percent]\n"
     "   [--duplicate duplicate_percent]\n"
+    "   [--rate kbps]\n"
+    "   [--latency ms]\n"
+    "   [--jitter ms]\n"
+    "   [--jitter-dist uniform|normal|pareto]\n"
+    "   [--queue packets]\n"
+    "   [--aqm droptail|red|codel]\n"
+    "   [--gemodel p[,r[,1-h[,1-k]]]]\n"
+    "   [--uplink-trace file]\n"
+    "   [--downlink-trace file]\n"
+    "   [--histograms]\n"
+    "   [--e2e-latency bytes]\n"
+    "   [--fast-open]\n"
+    "   [--streams num_streams]\n"
+    "   [--compress]\n"
+    "   [--fec]\n"
+    "   [--mss bytes]\n"
+    "   [--keepalive idle[,interval[,count]]]\n"
+    "   [--idle-timeout seconds]\n"
+    "   [--stats]\n"
+    "   [--pcap file]\n"
+    "   [--perf]\n"
+    "   [-l]\n"
+    "   [--log-headers]\n"
+    "   [--log-sample n]\n"
     "   [-- program arg1 arg2 ...]\n\n",
     progname
   );
@@ -1359,10 +4191,15 @@ int main(int argc , char *argv[]) {
   /* Possible command-line arguments. */
   bool is_server = 0;
   bool is_client = 0;
-  char *server = NULL;
+  char *servers[MAX_NUM_CLIENTS];
+  int num_servers = 0;
   char *port_str = NULL;
   int port = -1;
   int window = 1;
+  char *pcap_path = NULL;
+  bool opt_perf = false;
+  bool log_headers = false;
+  int log_sample = 1;
   seed = time(NULL);
   test_debug_on = false;
   lab5_mode = false;
@@ -1375,11 +4212,35 @@ int main(int argc , char *argv[]) {
     { "window", required_argument, NULL, 'w' },
 
     { "seed", required_argument, NULL, 'e'},
+    { "isn", required_argument, NULL, 'i' },
     { "drop", required_argument, NULL, 'r' },
     { "corrupt", required_argument, NULL, 't' },
     { "delay", required_argument, NULL, 'y' },
     { "duplicate", required_argument, NULL, 'q' },
+    { "rate", required_argument, NULL, 'b' },
+    { "latency", required_argument, NULL, 'a' },
+    { "jitter", required_argument, NULL, 'j' },
+    { "jitter-dist", required_argument, NULL, 'J' },
+    { "queue", required_argument, NULL, 'Q' },
+    { "aqm", required_argument, NULL, 'M' },
+    { "gemodel", required_argument, NULL, 'g' },
+    { "uplink-trace", required_argument, NULL, 'U' },
+    { "downlink-trace", required_argument, NULL, 'D' },
+    { "histograms", no_argument, NULL, 'H' },
+    { "e2e-latency", required_argument, NULL, 'E' },
+    { "fast-open", no_argument, NULL, 'O' },
+    { "streams", required_argument, NULL, 'N' },
+    { "compress", no_argument, NULL, 'Z' },
+    { "fec", no_argument, NULL, 'F' },
+    { "mss", required_argument, NULL, 'X' },
+    { "keepalive", required_argument, NULL, 'K' },
+    { "idle-timeout", required_argument, NULL, 'I' },
+    { "stats", no_argument, NULL, 'S' },
+    { "pcap", required_argument, NULL, 'P' },
+    { "perf", no_argument, NULL, 'C' },
     { "logging", no_argument, NULL, 'l' },
+    { "log-headers", no_argument, NULL, 'L' },
+    { "log-sample", required_argument, NULL, 'm' },
     { "lab5", no_argument, NULL, 'f' },
     { NULL, 0, NULL, 0 }
   };
@@ -1396,10 +4257,16 @@ int main(int argc , char *argv[]) {
     case 's':
       is_server = true;
       break;
-    /* Run as client and connect to a specified server. */
+    /* Run as client and connect to a specified server. Can be given more
+       than once to connect to several. */
     case 'c':
       is_client = true;
-      server = optarg;
+      if (num_servers == MAX_NUM_CLIENTS) {
+        fprintf(stderr, "[ERROR] Can connect to at most %d servers\n",
+                MAX_NUM_CLIENTS);
+        usage(progname);
+      }
+      servers[num_servers++] = optarg;
       break;
     /* Port to run on. */
     case 'p':
@@ -1414,6 +4281,10 @@ int main(int argc , char *argv[]) {
     case 'e':
       seed = atoi(optarg);
       break;
+    /* Initial sequence number, instead of a random one. */
+    case 'i':
+      opt_isn = strtoul(optarg, NULL, 0) & 0xffffffff;
+      break;
     /* Segment drop. */
     case 'r':
       opt_drop = atoi(optarg);
@@ -1430,10 +4301,130 @@ int main(int argc , char *argv[]) {
     case 'q':
       opt_duplicate = atoi(optarg);
       break;
+    /* Link rate. */
+    case 'b':
+      opt_link = true;
+      link_cfg.rate_kbps = atoi(optarg);
+      break;
+    /* Link propagation delay. */
+    case 'a':
+      opt_link = true;
+      link_cfg.delay_us = atof(optarg) * 1000;
+      break;
+    /* Link delay variation. */
+    case 'j':
+      opt_link = true;
+      link_cfg.jitter_us = atof(optarg) * 1000;
+      break;
+    case 'J':
+      if (link_parse_jitter_dist(optarg, &link_cfg.jitter_dist) < 0)
+        usage(progname);
+      break;
+    /* Link queue limit. */
+    case 'Q':
+      opt_link = true;
+      link_cfg.queue_limit = atoi(optarg);
+      break;
+    /* Queue management on the link. */
+    case 'M':
+      opt_link = true;
+      if (link_parse_aqm(optarg, &link_cfg.aqm) < 0)
+        usage(progname);
+      break;
+    /* Bursty (Gilbert-Elliott) loss on the link. */
+    case 'g':
+      opt_link = true;
+      if (link_parse_gemodel(optarg, &link_cfg) < 0)
+        usage(progname);
+      break;
+    /* Delivery traces for the link. */
+    case 'U':
+      opt_uplink_trace = optarg;
+      break;
+    case 'D':
+      opt_downlink_trace = optarg;
+      break;
+    /* Latency histograms. */
+    case 'H':
+      opt_histograms = true;
+      break;
+    /* End-to-end latency of sampled bytes. Needs the histograms. */
+    case 'E':
+      opt_e2e_bytes = atoi(optarg);
+      if (opt_e2e_bytes <= 0)
+        usage(progname);
+      opt_histograms = true;
+      break;
+    /* Streams over one connection. */
+    case 'N':
+      opt_streams = atoi(optarg);
+      if (opt_streams < 1 || opt_streams > MAX_STREAMS) {
+        fprintf(stderr, "[ERROR] --streams must be from 1 to %d\n",
+                MAX_STREAMS);
+        usage(progname);
+      }
+      break;
+    /* Data in the SYN. */
+    case 'O':
+      opt_fast_open = true;
+      break;
+    /* Compression. */
+    case 'Z':
+      opt_compress = true;
+      break;
+    /* Forward error correction. */
+    case 'F':
+      opt_fec = true;
+      break;
+    /* Most segment data to offer. */
+    case 'X':
+      opt_mss = atoi(optarg);
+      if (opt_mss < 1 || opt_mss > MAX_LOCAL_SEG_DATA_SIZE) {
+        fprintf(stderr, "[ERROR] --mss must be from 1 to %d\n",
+                (int) MAX_LOCAL_SEG_DATA_SIZE);
+        usage(progname);
+      }
+      break;
+    /* Keepalives on idle connections, and reaping ones that don't answer. */
+    case 'K':
+      if (sscanf(optarg, "%d,%d,%d", &opt_keepalive, &opt_keepalive_interval,
+                 &opt_keepalive_count) < 1 || opt_keepalive < 1 ||
+          opt_keepalive_interval < 1 || opt_keepalive_count < 1) {
+        fprintf(stderr, "[ERROR] --keepalive takes seconds idle, then "
+                "optionally seconds between keepalives and how many\n");
+        usage(progname);
+      }
+      break;
+    /* Reaping connections that have gone quiet. */
+    case 'I':
+      opt_idle_timeout = atoi(optarg);
+      if (opt_idle_timeout < 1)
+        usage(progname);
+      break;
+    /* Statistics for ctcp_stat. */
+    case 'S':
+      opt_stats = true;
+      break;
+    /* Packet capture. */
+    case 'P':
+      pcap_path = optarg;
+      break;
+    /* Hardware performance counters. */
+    case 'C':
+      opt_perf = true;
+      break;
     /* Turn logging on. */
     case 'l':
       log_file = 0;
       break;
+    /* Log segments without their data. */
+    case 'L':
+      log_headers = true;
+      break;
+    /* Log one segment in every so many. */
+    case 'm':
+      log_sample = atoi(optarg);
+      break;
     /* Turn logging data off for tester. */
     case 'z':
       test_debug_on = true;
@@ -1450,12 +4441,65 @@ int main(int argc , char *argv[]) {
 
   /* Seed RNG. */
   srand(seed);
+  if (opt_fast_open && is_server)
+    fast_open_new_key();
+
+  /* Delivery trace for this host's direction of the link. */
+  char *trace = is_server ? opt_downlink_trace : opt_uplink_trace;
+  if (trace != NULL) {
+    if (link_load_trace(trace, &link_cfg) < 0) {
+      fprintf(stderr, "[ERROR] Could not load trace %s\n", trace);
+      return 1;
+    }
+    opt_link = true;
+  }
+
+  /* Print the latency histograms on request. */
+  if (opt_histograms) {
+    int i;
+    for (i = 0; i < NUM_LATENCIES; i++)
+      hist_init(&closed_latency[i]);
+    signal(SIGUSR1, handle_sigusr1);
+  }
+
+  /* Emulated link. Gets its own generator so the link sees the same
+     impairments for the same seed, whatever else uses rand(). */
+  if (opt_link) {
+    emu_link = link_create(&link_cfg, seed, link_deliver, NULL,
+                           current_time_us());
+    atexit(close_link);
+  }
 
   /* Validate arguments. */
   if ((is_client && is_server) || (!is_client && !is_server) || port <= 0) {
     usage(progname);
   }
 
+  /* Data can't go with the SYN before the server has agreed to compress. */
+  if (opt_compress && opt_fast_open && is_client) {
+    fprintf(stderr, "[INFO] Not sending data with the SYN, because of "
+            "--compress\n");
+    opt_fast_open = false;
+  }
+
+  /* Streams after the first need somewhere to go: the program on a server,
+     file descriptors the client was started with. Check before anything else
+     is opened and takes their numbers. */
+  if (opt_streams > 1 && is_server && argc - optind == 0) {
+    fprintf(stderr, "[ERROR] --streams needs a program to run on the "
+            "server\n");
+    usage(progname);
+  }
+  int s;
+  for (s = 1; s < opt_streams && is_client; s++) {
+    if (fcntl(STREAM_IN_FD(s), F_GETFD) < 0 ||
+        fcntl(STREAM_OUT_FD(s), F_GETFD) < 0) {
+      fprintf(stderr, "[ERROR] Stream %d needs file descriptors %d (input) "
+              "and %d (output)\n", s, STREAM_IN_FD(s), STREAM_OUT_FD(s));
+      exit(EXIT_FAILURE);
+    }
+  }
+
   /* Construct log file if logging is turned on. Don't create a file if not
      logging data, since that is only used for testing purposes. */
   if (log_file == 0) {
@@ -1467,10 +4511,18 @@ int main(int argc , char *argv[]) {
              port);
     log_file = open(log_filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
     write_log_header(log_file);
+
+    /* The tester reads the log from stderr as it goes, so only use the
+       writer thread for the file. */
+    if (!test_debug_on) {
+      logger = logger_create(log_file, log_headers, log_sample);
+      atexit(close_logger);
+    }
   }
 
   /* Global configuration. */
   struct config cc;
+  memset(&cc, 0, sizeof(cc));
   config = &cc;
 
   /* CTCP config for students. */
@@ -1482,13 +4534,48 @@ int main(int argc , char *argv[]) {
   cfg.rt_timeout = RT_INTERVAL;
 
   /* Used for polling later. */
-  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS];
-  memset(_events, 0, sizeof(struct pollfd) * (NUM_POLL + MAX_NUM_CLIENTS));
+  struct pollfd _events[NUM_POLL + MAX_NUM_CLIENTS * MAX_STREAMS];
+  memset(_events, 0, sizeof(_events));
   events = _events;
 
+  /* Statistics for ctcp_stat. Remove them again on the way out. */
+  if (opt_stats) {
+    if (stats_create(is_server) < 0) {
+      fprintf(stderr, "[ERROR] Could not create statistics region\n");
+      return 1;
+    }
+    atexit(stats_destroy);
+    fprintf(stderr, "[INFO] Statistics for ctcp_stat in /dev/shm"
+            STATS_NAME_FORMAT "\n", getpid());
+  }
+
+  /* Packet capture. */
+  if (pcap_path) {
+    if ((capture = capture_open(pcap_path)) == NULL) {
+      fprintf(stderr, "[ERROR] Could not create %s\n", pcap_path);
+      return 1;
+    }
+    atexit(close_capture);
+  }
+
+  /* Performance counters, reported at exit. Carries on without them if they
+     can't be opened. */
+  if (opt_perf && (perf = perf_open()))
+    atexit(close_perf);
+
+  /* Tidy up the above on SIGINT and SIGTERM. Blocking calls are interrupted
+     rather than restarted, so a client stuck connecting still exits. */
+  if (opt_stats || capture || logger || perf) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_exit_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+  }
+
   /* Start client/server. */
   if (is_client) {
-    if (start_client(server, port_str) < 0) {
+    if (start_client(servers, num_servers, port_str) < 0) {
       fprintf(stderr, "[ERROR] Client terminated\n");
       return 1;
     }
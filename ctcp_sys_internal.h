@@ -9,7 +9,11 @@
 #ifndef CTCP_SYS_INTERNAL_H
 #define CTCP_SYS_INTERNAL_H
 
+#include <net/if.h>
+#include <sys/ioctl.h>
+
 #include "ctcp.h"
+#include "ctcp_log.h"
 #include "ctcp_sys.h"
 #include "ctcp_utils.h"
 
@@ -41,8 +45,16 @@
 /** Timer interval (for calls to ctcp_timer) in milliseconds. */
 #define TIMER_INTERVAL 40
 
-/** Connection timeout interval in seconds. */
-#define CONN_TIMEOUT 10
+/** Times a client sends its SYN again before giving up on a server. It waits
+    the retransmission interval for the first SYN-ACK, then twice as long
+    after each SYN, so gives up after 12.6 seconds by default. */
+#define SYN_RETRIES 5
+
+/** Keepalives (--keepalive), unless given: seconds between them once a
+    connection is idle, and how many go unanswered before it is reaped. The
+    same as Linux's defaults. */
+#define KEEPALIVE_INTERVAL 75
+#define KEEPALIVE_COUNT 9
 
 /////////////////////////////////// SYSTEM ////////////////////////////////////
 
@@ -61,6 +73,167 @@
 #define CHILD_READ_FD (pipes[PARENT_WRITE_PIPE][READ_FD])
 #define CHILD_WRITE_FD (pipes[PARENT_READ_PIPE][WRITE_FD])
 
+/** Most streams a connection can carry (--streams), including the first. */
+#define MAX_STREAMS 8
+
+/** File descriptors stream s (from 1) is read from and written to, by the
+    client and by the server's program: 3 and 4 for stream 1, 5 and 6 for
+    stream 2, and so on. Stream 0 is STDIN and STDOUT. */
+#define STREAM_IN_FD(s) (1 + 2 * (s))
+#define STREAM_OUT_FD(s) (2 + 2 * (s))
+
+/** Compression (--compress). Input is read in blocks of up to
+    COMPRESS_BLOCK_SIZE bytes, and each goes into the stream as a frame: its
+    type, then the length of the frame's data and of the block (2 bytes each,
+    in network order), then the block, compressed or as it is. */
+#define COMPRESS_BLOCK_SIZE 8192
+#define COMPRESS_HDR_SIZE 5
+#define COMPRESS_FRAME_RAW 0
+#define COMPRESS_FRAME_LZ 1
+
+/** Blocks shorter than this aren't worth compressing. */
+#define COMPRESS_MIN_BLOCK 64
+
+/** A block is only sent compressed if that saves at least 1/this of it. */
+#define COMPRESS_MIN_SAVING 8
+
+/** After a block that doesn't compress, the next one is sent as it is without
+    trying, then the next 2, 4, and so on up to this many, until one does. */
+#define COMPRESS_MAX_SKIP 64
+
+/** Compression state of a connection, once both ends have agreed to it. */
+struct conn_compress {
+  uint8_t out[COMPRESS_HDR_SIZE + COMPRESS_BLOCK_SIZE];  /* Frame being given
+                                                           to conn_input() */
+  uint16_t out_len;
+  uint16_t out_used;
+  int skip;                    /* Blocks still to send without trying */
+  int backoff;                 /* How many to skip after the next failure */
+
+  uint8_t in[COMPRESS_HDR_SIZE + COMPRESS_BLOCK_SIZE];   /* Frame being put
+                                                           together from
+                                                           conn_output() */
+  uint16_t in_len;
+
+  uint64_t read;               /* Bytes of input read */
+  uint64_t sent;               /* Bytes of frames they went in */
+  uint64_t received;           /* Bytes of frames received */
+  uint64_t written;            /* Bytes of output they held */
+};
+
+/** Forward error correction (--fec). After every k data segments, a parity
+    segment goes out with their XOR, so the receiver can rebuild any one of
+    them that is lost without waiting for it to be sent again. k is picked
+    from the loss the receiver reports: a group of k + 1 segments is meant to
+    lose about 1/FEC_GROUP_LOSSES of a segment. */
+#define FEC_MAX_K 16
+#define FEC_INIT_K 4
+#define FEC_GROUP_LOSSES 4
+
+/** Segments the receiver must have accounted for between estimates of the
+    loss. */
+#define FEC_ADAPT_SEGMENTS 32
+
+/** Groups a receiver collects at once. A group is given up on, and what it
+    lost is counted, once one FEC_GROUPS newer arrives. */
+#define FEC_GROUPS 4
+
+/** XOR of the segments of a group: the header fields that differ between
+    them, in network order, and the data. */
+struct fec_block {
+  uint32_t seqno;
+  uint32_t ackno;
+  uint16_t len;
+  uint16_t window;
+  uint8_t flags;
+  uint8_t *data;               /* The connection's MSS of it */
+};
+
+/** A group being collected by the receiver. */
+struct fec_group {
+  bool used;
+  uint8_t id;
+  uint8_t k;
+  bool has_parity;
+  bool done;                   /* Nothing left to rebuild */
+  uint16_t received;           /* Bit for each data segment that arrived */
+  uint8_t arrived;             /* Data and parity segments that arrived */
+  uint16_t parity_len;         /* Data in its parity */
+  struct fec_block xor;        /* Of those so far */
+};
+
+/** Forward error correction state of a connection, once both ends have
+    agreed to it. */
+struct conn_fec {
+  uint8_t group;               /* Sending: group being sent, mod 256 */
+  uint8_t k;                   /* Data segments in it */
+  uint8_t index;               /* Data segments sent in it so far */
+  uint16_t mss;                /* Data a block holds */
+  struct fec_block parity;
+  uint16_t parity_len;         /* Longest data in it */
+  uint16_t expected;           /* Last report from the other end */
+  uint16_t lost;
+  uint16_t expected_mark;      /* The report at the last estimate */
+  uint16_t lost_mark;
+  double loss;                 /* Estimated, -1 before the first estimate */
+  uint64_t parity_sent;
+
+  struct fec_group groups[FEC_GROUPS];  /* Receiving */
+  uint16_t received_expected;  /* Segments in groups given up on, mod 2^16 */
+  uint16_t received_lost;      /* Of those, lost */
+  uint64_t recovered;
+};
+
+/** Packetization layer path MTU discovery (RFC 8899) for the raw-IP
+    transport. Sizes are of whole IP packets. A connection assumes PMTU_BASE
+    gets through, probes the largest size that could be of use first, then
+    halves the gap to the smallest size lost, until it is PMTU_SEARCH_STEP or
+    less. */
+#define PMTU_BASE 1200
+#define PMTU_SEARCH_STEP 16
+
+/** Seconds before a path that took less than the largest size is searched
+    again, in case it has grown. */
+#define PMTU_RAISE_INTERVAL 600
+
+/** Retransmissions in a row, of data no larger than the size found, after
+    which the path is taken to have shrunk and is searched again from
+    PMTU_BASE. */
+#define PMTU_BLACK_HOLE 3
+
+/** Path MTU discovery state of a connection over raw IP. */
+struct conn_pmtu {
+  uint16_t size;               /* Largest packet known to get through */
+  uint16_t high;               /* Smallest known not to, or ceiling + 1 */
+  uint16_t ceiling;            /* Largest of any use: the MSS or the MTU of
+                                  the interface, whichever is smaller */
+  uint16_t probe;              /* Size of the probe in flight, 0 if none */
+  uint32_t probe_start;        /* Its relative sequence numbers */
+  uint32_t probe_end;
+  uint32_t sent_end;           /* After the last byte sent */
+  uint32_t whole_start;        /* Segment being sent in pieces: its relative
+                                  sequence number */
+  uint16_t whole_len;          /* and data length, 0 if none is */
+  uint32_t acked;              /* Last ACK number */
+  int retransmits;             /* In a row, since the ACK number moved */
+  uint64_t raise_at;           /* When to search again (us), once done */
+  uint64_t probes;             /* Probes sent, */
+  uint64_t probes_lost;        /* and lost */
+};
+
+/** A segment that arrived in pieces (see PIECE_OPT_EXID), being put back
+    together. */
+struct conn_pieces {
+  uint32_t seqno;              /* Relative sequence number of its data */
+  uint16_t len;                /* Length of its data, */
+  uint16_t have;               /* how much of it has arrived, */
+  uint16_t off_by;             /* and how far its checksum is off, which is
+                                  as far as any piece's is */
+  bool fin;                    /* Its last piece has FIN set */
+  ctcp_segment_t *segment;     /* The segment, filled in as pieces arrive */
+  uint8_t got[];               /* Which bytes of its data have arrived */
+};
+
 /** Maximum space for buffering STDOUT for a given connection. */
 #define MAX_BUF_SPACE 8192
 
@@ -72,6 +245,7 @@ struct chunk {
   struct chunk *next;
   size_t size;              /* Size of chunk, in bytes */
   size_t used;              /* Amount of chunk already outputted */
+  uint64_t queued_us;       /* When the chunk was queued */
   char buf[1];              /* Data */
 } __attribute__((packed));
 typedef struct chunk chunk_t;
@@ -98,10 +272,9 @@ int async(int fd) {
  * ts: Timespec object to store result.
  */
 void get_time(struct timespec *ts) {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  ts->tv_sec = tv.tv_sec;
-  ts->tv_nsec = tv.tv_usec * 1000;
+  uint64_t now = current_time_us();
+  ts->tv_sec = now / 1000000;
+  ts->tv_nsec = now % 1000000 * 1000;
 }
 
 /**
@@ -144,8 +317,79 @@ typedef struct tcphdr tcphdr_t;
 #define TCP_HDR_SIZE sizeof(tcphdr_t)
 #define FULL_HDR_SIZE (sizeof(iphdr_t) + sizeof(tcphdr_t))
 
+/** Most TCP option bytes a header can carry. */
+#define MAX_TCP_OPT_SIZE 40
+
+/** Largest segment data a host offers on a Unix socket, where no MTU limits
+    it: what fits in an IP packet of 65535 bytes with the most options. */
+#define MAX_LOCAL_SEG_DATA_SIZE (IP_MAXPACKET - FULL_HDR_SIZE - \
+                                 MAX_TCP_OPT_SIZE)
+
+/** Packet size (data and headers) for a given most segment data. */
+#define PACKET_SIZE(mss) ((mss) + FULL_HDR_SIZE + MAX_TCP_OPT_SIZE)
+
 /** Maximum packet size (data and headers). */
-#define MAX_PACKET_SIZE (1440 + sizeof(iphdr_t) + sizeof(tcphdr_t))
+#define MAX_PACKET_SIZE PACKET_SIZE(MAX_LOCAL_SEG_DATA_SIZE)
+
+/** Packets of the largest size the socket buffers are made to hold, if the
+    host offers more than MAX_SEG_DATA_SIZE. */
+#define SOCKET_BUF_PACKETS 16
+
+/** TCP option carrying the send time of one byte (--e2e-latency). It is an
+    experimental option (RFC 6994): kind, length, a 16-bit ExID, then the
+    byte's relative sequence number and the time it was read, in
+    microseconds mod 2^32. */
+#define TCPOPT_EXPERIMENT 253
+#define E2E_OPT_EXID 0x6354
+#define E2E_OPT_SIZE 12
+
+/** Experimental option giving the stream a segment belongs to (--streams):
+    kind, length, ExID, then the 16-bit stream number. Segments of stream 0
+    don't carry it. Padded to 8 bytes with NOPs. */
+#define STREAM_OPT_EXID 0x6353
+#define STREAM_OPT_SIZE 6
+
+/** Experimental option on each piece of a segment split to fit the path MTU:
+    kind, length, ExID, then the piece's offset in the segment's data and the
+    length of all of that data, 16 bits each. The receiver puts the segment
+    back together before student code sees it. */
+#define PIECE_OPT_EXID 0x6350
+#define PIECE_OPT_SIZE 8
+
+/** Experimental option a host puts in its SYN or SYN-ACK to offer a feature
+    (--compress, --fec): kind, length and the feature's ExID only. A
+    connection uses it if both hosts offer it. */
+#define OFFER_OPT_SIZE 4
+#define COMPRESS_OPT_EXID 0x635a
+
+/** Experimental options for --fec, told apart by their length. A data
+    segment carries a tag: its group mod 256, then its index in the group and
+    the group's k - 1, 4 bits each (FEC_TAG_SIZE, padded to 8 bytes). A parity
+    segment carries the group, k, and the XOR of the group's flags, sequence
+    and ACK numbers, lengths and windows (FEC_PARITY_SIZE, padded to 20), and
+    the XOR of their data as its own data. Every segment reports how many
+    segments the groups given up on had and how many of those were lost, mod
+    2^16 (FEC_REPORT_SIZE). */
+#define FEC_OPT_EXID 0x6346
+#define FEC_TAG_SIZE 6
+#define FEC_PARITY_SIZE 19
+#define FEC_REPORT_SIZE 8
+
+/** TCP Fast Open option (--fast-open, RFC 7413). A client sends it empty in
+    its SYN to ask for a cookie, and the server's SYN-ACK carries one. After
+    that, the client's SYNs carry the cookie and the first segment of data.
+    Options are padded to 4 bytes with NOPs. */
+#define TCPOPT_FASTOPEN 34
+#define FAST_OPEN_COOKIE_SIZE 8
+#define FAST_OPEN_OPT_SIZE (2 + FAST_OPEN_COOKIE_SIZE)
+
+/** Where a client keeps the cookies it has been given, one line per server,
+    in the current directory. */
+#define FAST_OPEN_COOKIE_FILE ".ctcp_cookies"
+
+/** Number of recent SYNs with data a server remembers, so a replayed SYN
+    doesn't deliver its data twice. */
+#define FAST_OPEN_SEEN 64
 
 /** TCP pseudoheader, used in checksum calculations. */
 struct tcp_pseudoheader {
@@ -181,33 +425,55 @@ bool add_network_line_ending(bool webserver, char *buf, size_t len) {
 }
 
 /**
- * Computes the TCP checksum. Returns the checksum in network order.
+ * Computes the TCP checksum from the sum of the segment's data, so data that
+ * has already been summed with cksum_add() isn't gone over again. Returns the
+ * checksum in network order.
  *
  * packet: IP packet with a TCP payload.
- * len: Length of data (0 if no data and only TCP and IP headers).
+ * opt_len: Length of the TCP options.
+ * data_len: Length of the data.
+ * data_sum: Sum of the data, from cksum_add().
  *
  * returns: The checksum in network order.
  */
-uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
+uint16_t cksum_tcp_data(iphdr_t *packet, uint16_t opt_len, uint16_t data_len,
+                        uint32_t data_sum) {
   tcphdr_t *tcp_hdr = (tcphdr_t *) ((uint8_t *) packet + IP_HDR_SIZE);
 
   /* Construct pseudoheader. */
-  tcp_pseudoheader_t *phdr = calloc(TCP_PSEUDOHDR_SIZE + len, 1);
-  phdr->src_addr = packet->saddr;
-  phdr->dst_addr = packet->daddr;
-  phdr->protocol = IPPROTO_TCP;
-  phdr->tcp_len = htons(TCP_HDR_SIZE + len);
-
-  /* Append TCP segment and compute checksum. */
-  memcpy(&(phdr->tcp_hdr), tcp_hdr, TCP_HDR_SIZE + len);
-  uint16_t result = cksum(phdr, len + TCP_PSEUDOHDR_SIZE);
-  free(phdr);
-  return result;
+  tcp_pseudoheader_t phdr;
+  memset(&phdr, 0, sizeof(phdr));
+  phdr.src_addr = packet->saddr;
+  phdr.dst_addr = packet->daddr;
+  phdr.protocol = IPPROTO_TCP;
+  phdr.tcp_len = htons(TCP_HDR_SIZE + opt_len + data_len);
+
+  /* Checksum it and the TCP header where it is, rather than a copy, then add
+     on the data. */
+  uint32_t sum = cksum_add(0, &phdr, TCP_PSEUDOHDR_SIZE - TCP_HDR_SIZE);
+  sum = cksum_add(sum, tcp_hdr, TCP_HDR_SIZE + opt_len);
+  sum += data_sum;
+  if (sum < data_sum)
+    sum++;
+  return cksum_finish(sum);
+}
+
+/**
+ * Computes the TCP checksum. Returns the checksum in network order.
+ *
+ * packet: IP packet with a TCP payload.
+ * len: Length of data (0 if no data and only TCP and IP headers).
+ *
+ * returns: The checksum in network order.
+ */
+uint16_t cksum_tcp(iphdr_t *packet, uint16_t len) {
+  return cksum_tcp_data(packet, len, 0, 0);
 }
 
 /**
  * Creates an IP packet. The resulting packet must be freed by the caller.
- * Assumes arguments are in network order.
+ * Assumes arguments are in network order. Packets aren't to be fragmented, so
+ * one too large for the path is dropped and path MTU discovery can tell.
  *
  * src_ip: Source IP address.
  * dst_ip: Destination IP address.
@@ -225,7 +491,7 @@ char *create_datagram(in_addr_t src_ip, in_addr_t dst_ip, uint16_t len) {
   ip_hdr->tos = 0;
   ip_hdr->tot_len = htons(total_len);
   ip_hdr->id = htons(IP_ID);
-  ip_hdr->frag_off = 0;
+  ip_hdr->frag_off = htons(IP_DF);
   ip_hdr->ttl = DEFAULT_TTL;
   ip_hdr->protocol = IPPROTO_TCP;
   ip_hdr->check = 0;
@@ -288,10 +554,50 @@ struct conn {
   bool wrote_eof;              /* EOF wrote to STDOUT */
   bool wrote_err;              /* Error writing to STDOUT */
   bool delete_me;              /* Whether or not to delete this object. */
+  bool connecting;             /* Handshake not finished. Client: no state
+                                  yet, so nothing goes to the student code */
+  uint64_t syn_due;            /* Client: when to send the SYN again (us) */
+  int syn_rto;                 /* Client: how long that was after the last */
+  int syn_retries;             /* Client: times the SYN has been sent again */
+  uint64_t heard_at;           /* When something last arrived from the other
+                                  end (us), with --keepalive or
+                                  --idle-timeout */
+  uint64_t keepalive_due;      /* When to send the next keepalive (us) */
+  int keepalives;              /* Keepalives sent since then */
+  pid_t pid;                   /* Server: the program run for it, if any */
 
   chunk_t *out_queue;          /* Queue for output to STDOUT */
   chunk_t **out_queue_tail;    /* End of the output queue */
 
+  uint16_t mss;                /* Most data a segment carries, agreed on in
+                                  the handshake */
+
+  char *syn_data;              /* Fast open: data that went with the SYN */
+  uint16_t syn_data_len;       /* Its length. Server: 0 unless taken */
+  uint16_t syn_data_read;      /* Client: how much conn_input() has given */
+  bool syn_data_acked;         /* Client: server took it, so don't send it */
+
+  struct conn_compress *compress;  /* If --compress was agreed on */
+  struct conn_fec *fec;        /* If --fec was agreed on */
+  struct conn_pmtu *pmtu;      /* Path MTU discovery, over raw IP */
+  struct conn_pieces *pieces;  /* Segment arriving in pieces, if one is */
+
+  int stream;                  /* Stream number (--streams), 0 for the
+                                  connection itself */
+  struct conn *parent;         /* Stream: the connection it goes over */
+  struct conn *streams[MAX_STREAMS];  /* Connection: its other streams, from
+                                         index 1 */
+
+  struct conn_latency *latency;/* Latency histograms, if kept */
+  ctcp_stats_t *stats;         /* Statistics, if kept */
+  uint32_t sent_end;           /* For statistics and keepalives: after the
+                                  last byte sent, */
+  uint32_t sent_ackno;         /* the last ACK number sent, */
+  uint32_t received_end;       /* after the last byte received, */
+  uint32_t last_ackno;         /* the last ACK number received, */
+  uint32_t rtt_end;            /* and the end of the segment being timed */
+  uint64_t rtt_start;          /* When it was sent, 0 if none is */
+
   struct conn *next;           /* Linked list of connections */
   struct conn **prev;
 };
@@ -318,6 +624,7 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
   /* Set up IP address and port. */
   conn->ip_addr = ip_addr;
   conn->port = port;
+  conn->mss = MAX_SEG_DATA_SIZE;
 
   /* Socket address. Could be a Unix socket. */
   if (unix_socket) {
@@ -330,8 +637,11 @@ void conn_setup(conn_t *conn, in_addr_t ip_addr, int port, bool unix_socket) {
     conn->saddr.sin_addr.s_addr = ip_addr;
   }
 
-  /* Random initial sequence number. */
-  conn->init_seqno = rand();
+  /* Random initial sequence number. rand() alone repeats for hosts started
+     in the same second, so a client run again at once would pick the same
+     one; the pid and time tell them apart. */
+  conn->init_seqno = rand() ^ ((uint32_t) getpid() << 16) ^
+                     (uint32_t) current_time_us();
 
   /* Other sequence numbers needed for connection setup and teardown. */
   conn->seqno = 0;
@@ -370,6 +680,43 @@ in_addr_t ip_from_self(void) {
   return ip_addr;
 }
 
+/**
+ * Gets the MTU of the interface the client's own IP address is on (see
+ * ip_from_self()).
+ *
+ * returns: The MTU, or 0 if it could not be found.
+ */
+int mtu_of_self(void) {
+  struct ifaddrs *addrs = NULL, *iface;
+  struct ifreq ifr;
+  int mtu = 0;
+  int s = socket(AF_INET, SOCK_DGRAM, 0);
+  if (s < 0)
+    return 0;
+  getifaddrs(&addrs);
+
+  /* Same interface as ip_from_self(). */
+  char *correct_iface = ETH_INTERFACE;
+  char check_iface[100];
+  memset(check_iface, 0, 100);
+
+  for (iface = addrs; iface != NULL; iface = iface->ifa_next) {
+    if (iface->ifa_addr && iface->ifa_addr->sa_family == AF_INET) {
+      memcpy(check_iface, iface->ifa_name, strlen(iface->ifa_name) - 1);
+      if (strcmp(check_iface, correct_iface) != 0)
+        continue;
+
+      memset(&ifr, 0, sizeof(ifr));
+      strncpy(ifr.ifr_name, iface->ifa_name, IFNAMSIZ - 1);
+      if (ioctl(s, SIOCGIFMTU, &ifr) == 0)
+        mtu = ifr.ifr_mtu;
+    }
+  }
+  freeifaddrs(addrs);
+  close(s);
+  return mtu;
+}
+
 /**
  * Gets the IP address associated with a given hostname.
  *
@@ -404,9 +751,6 @@ in_addr_t ip_from_hostname(char *hostname) {
 
 /////////////////////////////////// LOGGING ////////////////////////////////////
 
-#define LOG_SIZE (4 * MAX_SEG_DATA_SIZE)
-#define LOG_ENTRY_SIZE 20
-#define ADDR_FORMAT_STR "%s\t%d\t%s\t%d\t"
 #define LOCALHOST_STR "localhost"
 
 /** Headers for the log file. */
@@ -416,69 +760,13 @@ in_addr_t ip_from_hostname(char *hostname) {
 #define DEBUG_TEARDOWN "###teardown###\n"
 
 /**
- * Format the IP addresses and ports for the logger into the provided buffer.
- *
- * ip_addr: The logger's IP address.
- * port: The logger's port.
- * conn: The other's connection details.
- * is_sent_segment: Whether or not this is logging a segment sent by the logger.
- * is_unix_socket: Whether or not the connection is via a Unix socket.
- * buf: Buffer to write formatted IP addresses and ports.
- */
-void format_addresses(in_addr_t ip_addr, int port, conn_t *conn,
-                      bool is_sent_segment, bool is_unix_socket, char *buf) {
-  if (!is_unix_socket) {
-    char this_ip_addr[INET_ADDRSTRLEN];
-    char other_ip_addr[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &ip_addr, this_ip_addr, 100);
-    inet_ntop(AF_INET, &(conn->ip_addr), other_ip_addr, 100);
-
-    if (is_sent_segment) {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, this_ip_addr, port,
-               other_ip_addr, conn->port);
-    }
-    else {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, other_ip_addr,
-               conn->port, this_ip_addr, port);
-    }
-  }
-
-  /** Just print "localhost" for Unix sockets. */
-  else {
-    if (is_sent_segment) {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, LOCALHOST_STR, port,
-               LOCALHOST_STR, conn->port);
-    }
-    else {
-      snprintf(buf, 5 * LOG_ENTRY_SIZE, ADDR_FORMAT_STR, LOCALHOST_STR,
-               conn->port, LOCALHOST_STR, port);
-    }
-  }
-}
-
-/**
- * Creates a hex dump of data.
- *
- * from: Data to create hex dump.
- * to: Location to write output of dump.
- * len: Length of data.
- */
-void hex_dump(unsigned char *from, char *to, int len) {
-  snprintf(to, 2, "\t");
-  to++;
-
-  /* Loop through all bytes in the data. */
-  int i;
-  for (i = 0; i < len; i++) {
-    snprintf(to + i * 3, 4, "%02x ", from[i]);
-  }
-  snprintf(to + i * 3, 2, "\n");
-}
-
-/**
- * Logs a segment sent or received. Logged output is of the form:
+ * Logs a segment sent or received, straight away. Logged output is of the
+ * form:
  *    time fromIP fromPort toIP toPort seqno ackno len flags window cksum data
  *
+ * For the tester, the line goes to stderr without the data. Otherwise -l
+ * normally goes through the asynchronous logger in ctcp_log.h instead.
+ *
  * file: File to output to.
  * ip_addr: The logger's IP address.
  * port: The logger's port.
@@ -491,44 +779,17 @@ void hex_dump(unsigned char *from, char *to, int len) {
 void log_segment(int file, in_addr_t ip_addr, int port, conn_t *conn,
                  ctcp_segment_t *segment, uint16_t len, bool is_sent_segment,
                  bool is_unix_socket) {
-  /* Create output buffer and write IP addresses and ports. */
-  char buf[LOG_SIZE];
-  memset(buf, 0, LOG_SIZE);
-
-  /* Timestamp. */
-  snprintf(buf, LOG_ENTRY_SIZE, "%lu\t", current_time());
-
-  /* Source and destination. */
-  format_addresses(ip_addr, port, conn, is_sent_segment, is_unix_socket,
-                   buf + strlen(buf));
-
-  /* Sequence number, ack number, length. */
-  snprintf(buf + strlen(buf), 5 * LOG_ENTRY_SIZE, "%d\t%d\t%d\t",
-           ntohl(segment->seqno), ntohl(segment->ackno), ntohs(segment->len));
-
-  /* TCP flags. */
-  if (segment->flags & TH_SYN)
-    snprintf(buf + strlen(buf), 5, "SYN ");
-  if (segment->flags & TH_ACK)
-    snprintf(buf + strlen(buf), 5, "ACK ");
-  if (segment->flags & TH_FIN)
-    snprintf(buf + strlen(buf), 5, "FIN ");
-
-  /* Window and checksum. */
-  snprintf(buf + strlen(buf), LOG_ENTRY_SIZE, "\t%d\t0x%x",
-           ntohs(segment->window), segment->cksum);
-
-  /* Data. */
-  if (!test_debug_on) {
-    hex_dump((unsigned char *) segment->data,
-             buf + strlen(buf),
-             ntohs(segment->len) - sizeof(ctcp_segment_t));
-    write(file, buf, strlen(buf));
-  }
+  log_entry_t entry;
+  char buf[LOG_MAX_LINE];
+  log_fill(&entry, ip_addr, port, conn->ip_addr, conn->port, segment,
+           is_sent_segment, is_unix_socket, !test_debug_on);
+  size_t n = log_format(&entry, buf, !test_debug_on);
+
+  if (!test_debug_on)
+    write(file, buf, n);
   /* Log data for the tester. */
-  else {
+  else
     fprintf(stderr, "!!!%s!!!\n", buf);
-  }
 }
 
 /**
@@ -0,0 +1,48 @@
+/******************************************************************************
+ * ctcp_trace.h
+ * ------------
+ * Static tracepoints (USDT probes) at the protocol's hot spots. When
+ * <sys/sdt.h> is available (systemtap-sdt-dev / systemtap-sdt-devel), each
+ * CTCP_TRACE() compiles to a single nop plus a note in the binary describing
+ * where its arguments are. Nothing runs until a tracer attaches, e.g.
+ *
+ *    sudo bpftrace -e 'usdt:./ctcp:ctcp:retransmit { @[arg1] = count(); }'
+ *    sudo perf probe -x ./ctcp sdt_ctcp:segment_send
+ *
+ * Without <sys/sdt.h>, or built with -DCTCP_NO_TRACE, the probes compile to
+ * nothing and their arguments are not evaluated.
+ *
+ * Probes, all in the "ctcp" provider. conn is the conn_t pointer, so probes
+ * for one connection can be matched up; sequence numbers are relative, as in
+ * ctcp.c; flags are the TH_* bits.
+ *
+ *    conn_create(conn, ip_addr, port)      Connection set up
+ *    conn_destroy(conn, ip_addr, port)     Connection torn down
+ *    segment_send(conn, seqno, ackno, data_len, flags)
+ *    segment_receive(conn, seqno, ackno, data_len, flags)
+ *    cksum_fail(conn, seqno, len)          Received segment dropped as corrupt
+ *    retransmit(conn, seqno, count)        Segment retransmitted for the
+ *                                          count'th time
+ *    window_update(conn, ackno, window)    ACK opened the send window
+ *    output_queue_full(conn, queued)       STDOUT couldn't take everything;
+ *                                          queued is the bytes now waiting
+ *
+ *****************************************************************************/
+
+#ifndef CTCP_TRACE_H
+#define CTCP_TRACE_H
+
+#if !defined(CTCP_NO_TRACE) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CTCP_HAVE_USDT 1
+#endif
+#endif
+
+#ifdef CTCP_HAVE_USDT
+#define CTCP_TRACE(name, ...) STAP_PROBEV(ctcp, name, __VA_ARGS__)
+#else
+#define CTCP_TRACE(name, ...) do { } while (0)
+#endif
+
+#endif /* CTCP_TRACE_H */
@@ -1,27 +1,75 @@
 #include "ctcp_utils.h"
 
-uint16_t cksum(const void *_data, uint16_t len) {
+uint32_t cksum_add(uint32_t sum, const void *_data, size_t len) {
   const uint8_t *data = _data;
-  uint32_t sum = 0;
+  uint64_t total = sum;
+  uint32_t word;
+  uint16_t half = 0;
 
-  for (sum = 0; len >= 2; data += 2, len -=2) {
-    sum += (data[0] << 8) | data[1];
+  /* The sum of 16-bit words is the same in either byte order, once swapped
+     back (RFC 1071), so add them as they are in memory, 4 bytes at a time. */
+  for (; len >= 4; data += 4, len -= 4) {
+    memcpy(&word, data, sizeof(word));
+    total += word;
+  }
+  if (len >= 2) {
+    memcpy(&half, data, sizeof(half));
+    total += half;
+    data += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    half = 0;
+    memcpy(&half, data, 1);
+    total += half;
   }
-  if (len > 0) sum += data[0] << 8;
 
+  while (total >> 32)
+    total = (total & 0xffffffff) + (total >> 32);
+  return total;
+}
+
+uint16_t cksum_finish(uint32_t sum) {
   while (sum > 0xffff) {
     sum = (sum >> 16) + (sum & 0xffff);
   }
-  sum = htons(~sum);
-  return sum ? sum : 0xffff;
+  uint16_t result = ~sum;
+  return result ? result : 0xffff;
 }
 
+uint16_t cksum(const void *_data, uint16_t len) {
+  return cksum_finish(cksum_add(0, _data, len));
+}
+
+#ifdef CTCP_SIM
+static uint64_t sim_clock_us = SIM_START_US;
+
+void sim_set_time(uint64_t us) {
+  if (us > sim_clock_us)
+    sim_clock_us = us;
+}
+
+long current_time() {
+  return sim_clock_us / 1000;
+}
+
+uint64_t current_time_us() {
+  return sim_clock_us;
+}
+#else
 long current_time() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
   return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+uint64_t current_time_us() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+#endif
+
 void print_hdr_ctcp(ctcp_segment_t *segment) {
   fprintf(stderr, "[cTCP] seqno: %d, ackno: %d, len: %d, flags:",
           ntohl(segment->seqno), ntohl(segment->ackno), ntohs(segment->len));
@@ -22,11 +22,55 @@
  */
 uint16_t cksum(const void *_data, uint16_t len);
 
+/**
+ * Adds data to a checksum being computed over several pieces, such as a
+ * header and the data that follows it. Every piece but the last must have an
+ * even length.
+ *
+ * sum: Sum so far, 0 to start.
+ * _data: Data to add.
+ * len: Length of data.
+ *
+ * returns: The new sum, for cksum_add() or cksum_finish().
+ */
+uint32_t cksum_add(uint32_t sum, const void *_data, size_t len);
+
+/**
+ * Turns a sum from cksum_add() into a checksum, the same as cksum() would give
+ * over all the pieces.
+ *
+ * sum: The sum.
+ *
+ * returns: The checksum in network-byte order.
+ */
+uint16_t cksum_finish(uint32_t sum);
+
 /**
  * Gets the current time in milliseconds.
  */
 long current_time();
 
+/**
+ * Gets the current time in microseconds.
+ */
+uint64_t current_time_us();
+
+#ifdef CTCP_SIM
+/** Where the virtual clock starts, in microseconds. Not 0, so code that uses
+    0 as "never" still works. */
+#define SIM_START_US 1000000
+
+/**
+ * Moves the virtual clock forward. Only in simulation builds (compiled with
+ * CTCP_SIM), where current_time() and current_time_us() read this clock
+ * instead of the wall clock. Time never goes backwards, so earlier times are
+ * ignored.
+ *
+ * us: New time, in microseconds.
+ */
+void sim_set_time(uint64_t us);
+#endif
+
 /**
  * Prints out the headers of a cTCP segment. Expects the segment to come in
  * network-byte order. All fields are converted and printed out in host order,